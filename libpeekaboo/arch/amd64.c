@@ -14,8 +14,37 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
 #include "amd64.h"
 
+void amd64_regfile_layout(const storage_option_amd64_t *option, regfile_layout_amd64_t *layout)
+{
+	layout->size = sizeof(amd64_cpu_gr_t);
+	layout->simd_offset = 0;
+	layout->fxsave_offset = 0;
+	if (option->has_simd)
+	{
+		layout->simd_offset = layout->size;
+		layout->size += sizeof(amd64_cpu_simd_t);
+	}
+	if (option->has_fxsave)
+	{
+		layout->fxsave_offset = layout->size;
+		layout->size += sizeof(fxsave_area_t);
+	}
+}
+
+// Expands a record into a full regfile. Classes the record does not have are zeroed.
+void amd64_regfile_unpack(const regfile_layout_amd64_t *layout, const void *record, regfile_amd64_t *regfile)
+{
+	const uint8_t *bytes = record;
+	memset(regfile, 0, sizeof(regfile_amd64_t));
+	memcpy(&regfile->gpr, bytes, sizeof(amd64_cpu_gr_t));
+	if (layout->simd_offset) memcpy(&regfile->simd, bytes + layout->simd_offset, sizeof(amd64_cpu_simd_t));
+	if (layout->fxsave_offset) memcpy(&regfile->fxsave, bytes + layout->fxsave_offset, sizeof(fxsave_area_t));
+}
+
 void amd64_regfile_pp(regfile_amd64_t *regfile)
 {
 	printf("\tRegisters:\n");
@@ -44,3 +73,20 @@ void amd64_regfile_pp(regfile_amd64_t *regfile)
 	}
 	printf("\n");
 }
+
+void amd64_regderef_pp(regfile_amd64_t *regfile, regderef_amd64_t *regderef)
+{
+	printf("\tMemory pointed by registers:\n");
+	char *gpr_string[] = {"rdi", "rsi", "rsp", "rbp", "rbx", "rdx", "rcx", "rax",
+	                      "r8 ", "r9 ", "r10", "r11", "r12", "r13", "r14", "r15"};
+
+	for (int x=0; x<AMD64_NUM_DEREF_GPRS; x++)
+	{
+		uint64_t reg_value = ((uint64_t *)&(regfile->gpr))[x];
+		if (regderef->valid & (1 << x))
+			printf("\t  %s: [0x%" PRIx64 "] = 0x%016" PRIx64 "\n", gpr_string[x], reg_value, regderef->value[x]);
+		else
+			printf("\t  %s: [0x%" PRIx64 "] = [Invalid Memory Access]\n", gpr_string[x], reg_value);
+	}
+	printf("\n");
+}
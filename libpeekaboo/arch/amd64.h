@@ -31,7 +31,6 @@ typedef struct storage_option_amd64{
 } storage_option_amd64_t;
 
 #include "../common.h"
-#include "amd64_conf.h"
 
 #define AMD64_NUM_SIMD_SLOTS 16
 
@@ -120,15 +119,34 @@ typedef struct {
 
 typedef struct regfile_amd64{
 	amd64_cpu_gr_t gpr;
-#ifdef _STORE_SIMD
 	amd64_cpu_simd_t simd;
-#endif
-#ifdef _STORE_FXSAVE
 	fxsave_area_t fxsave;
-#endif
 } regfile_amd64_t;
 
+/* A regfile record only has the classes in the trace's storage options, in
+ * the order gpr, simd, fxsave. GPRs are always there.
+ */
+typedef struct regfile_layout_amd64 {
+	uint32_t size;		/* Bytes per record */
+	uint32_t simd_offset;	/* 0 if SIMD is not stored */
+	uint32_t fxsave_offset;	/* 0 if FXSAVE is not stored */
+} regfile_layout_amd64_t;
+
+void amd64_regfile_layout(const storage_option_amd64_t *option, regfile_layout_amd64_t *layout);
+void amd64_regfile_unpack(const regfile_layout_amd64_t *layout, const void *record, regfile_amd64_t *regfile);
 void amd64_regfile_pp(regfile_amd64_t *regfile);
 /* End of Regfile */
 
+/* Regderef: the 8 bytes each GPR points to, before the instruction executes */
+#define AMD64_NUM_DEREF_GPRS 16
+
+typedef struct regderef_amd64 {
+	uint32_t valid;		/* Bit x is set if value[x] could be read */
+	uint32_t reserved;
+	uint64_t value[AMD64_NUM_DEREF_GPRS];	/* Same order as amd64_cpu_gr_t */
+} regderef_amd64_t;
+
+void amd64_regderef_pp(regfile_amd64_t *regfile, regderef_amd64_t *regderef);
+/* End of Regderef */
+
 #endif
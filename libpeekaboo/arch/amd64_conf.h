@@ -1,2 +0,0 @@
-#define _STORE_SIMD
-#define _STORE_FXSAVE
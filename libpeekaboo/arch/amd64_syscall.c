@@ -21,7 +21,7 @@ static const uint64_t args_offset[] =
     [0] = offsetof(amd64_cpu_gr_t, reg_rdi) / sizeof(uint64_t),
     [1] = offsetof(amd64_cpu_gr_t, reg_rsi) / sizeof(uint64_t),
     [2] = offsetof(amd64_cpu_gr_t, reg_rdx) / sizeof(uint64_t),
-    [3] = offsetof(amd64_cpu_gr_t, reg_rcx) / sizeof(uint64_t),
+    [3] = offsetof(amd64_cpu_gr_t, reg_r10) / sizeof(uint64_t),	// Not rcx: the syscall instruction clobbers it
     [4] = offsetof(amd64_cpu_gr_t, reg_r8) / sizeof(uint64_t),
     [5] = offsetof(amd64_cpu_gr_t, reg_r9) / sizeof(uint64_t),
 };
@@ -366,9 +366,8 @@ static const struct_syscall_info syscall_infos[] =
     /* [335 ... 423] - reserved to sync up with other architectures */
 };
 
-int amd64_syscall_pp(regfile_amd64_t *regfile, uint64_t rvalue, bool print_details)
+int amd64_syscall_args_pp(uint64_t syscall_id, const uint64_t *args, uint64_t rvalue, bool print_details)
 {
-	const uint64_t syscall_id = regfile->gpr.reg_rax;
 	if (syscall_id >= sizeof(syscall_infos)/sizeof(struct_syscall_info))
 	{
 		// Unrecognized syscall ID. Return.
@@ -391,8 +390,17 @@ int amd64_syscall_pp(regfile_amd64_t *regfile, uint64_t rvalue, bool print_detai
 	for (arg_idx = 0; arg_idx < syscall_info->nargs; arg_idx++)
 	{
 		if (arg_idx != 0) printf(", ");
-		printf("0x%lx", ((uint64_t *)&regfile->gpr)[args_offset[arg_idx]]);
+		printf("0x%lx", args[arg_idx]);
 	}
 	printf(") = 0x%lx", rvalue);
 	return 0;
-}
\ No newline at end of file
+}
+
+int amd64_syscall_pp(regfile_amd64_t *regfile, uint64_t rvalue, bool print_details)
+{
+	uint64_t args[sizeof(args_offset)/sizeof(uint64_t)];
+	unsigned int arg_idx;
+	for (arg_idx = 0; arg_idx < sizeof(args_offset)/sizeof(uint64_t); arg_idx++)
+		args[arg_idx] = ((uint64_t *)&regfile->gpr)[args_offset[arg_idx]];
+	return amd64_syscall_args_pp(regfile->gpr.reg_rax, args, rvalue, print_details);
+}
@@ -6,6 +6,8 @@
 #include <stdbool.h>
 
 int amd64_syscall_pp(regfile_amd64_t *regfile, uint64_t rvalue, bool print_details);
+// args are the 6 arguments in the order of the calling convention, see syscall_t
+int amd64_syscall_args_pp(uint64_t syscall_id, const uint64_t *args, uint64_t rvalue, bool print_details);
 
 typedef struct sysent {
 	unsigned int nargs;
@@ -0,0 +1,175 @@
+/* 
+ * Copyright 2019 Chua Zheng Leong
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "compress.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t *ptr)
+{
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(uint32_t));
+	return value;
+}
+
+static uint32_t hash32(uint32_t value)
+{
+	return (value * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+}
+
+static size_t write_length(uint8_t *dst, size_t len)
+{
+	size_t size = 0;
+	for (; len >= 255; len -= 255) dst[size++] = 255;
+	dst[size++] = (uint8_t)len;
+	return size;
+}
+
+/* A sequence is a token (literal length << 4 | match length - MIN_MATCH), the
+ * rest of the literal length, the literals, the 2-byte match offset and the
+ * rest of the match length. A length of 15 in the token continues in bytes
+ * that are added up until one is below 255. The last sequence has literals only.
+ */
+static size_t write_sequence(uint8_t *dst, const uint8_t *literals, size_t num_literals, size_t offset, size_t match_len)
+{
+	size_t size = 1;
+	size_t match_code = match_len ? match_len - MIN_MATCH : 0;
+	dst[0] = (uint8_t)(((num_literals < 15 ? num_literals : 15) << 4) | (match_code < 15 ? match_code : 15));
+	if (num_literals >= 15) size += write_length(dst + size, num_literals - 15);
+	memcpy(dst + size, literals, num_literals);
+	size += num_literals;
+	if (match_len == 0) return size;
+	dst[size++] = offset & 0xff;
+	dst[size++] = offset >> 8;
+	if (match_code >= 15) size += write_length(dst + size, match_code - 15);
+	return size;
+}
+
+static void delta_filter(const uint8_t *src, size_t size, uint32_t stride, uint8_t *dst)
+{
+	size_t x;
+	memcpy(dst, src, size);
+	for (x = stride; x + 8 <= size; x += 8)
+	{
+		uint64_t cur, prev;
+		memcpy(&cur, src + x, 8);
+		memcpy(&prev, src + x - stride, 8);
+		cur -= prev;
+		memcpy(dst + x, &cur, 8);
+	}
+}
+
+static void delta_unfilter(uint8_t *buf, size_t size, uint32_t stride)
+{
+	size_t x;
+	for (x = stride; x + 8 <= size; x += 8)
+	{
+		uint64_t cur, prev;
+		memcpy(&cur, buf + x, 8);
+		memcpy(&prev, buf + x - stride, 8);
+		cur += prev;
+		memcpy(buf + x, &cur, 8);
+	}
+}
+
+size_t compress_block(const uint8_t *src, size_t raw_size, uint32_t stride, uint8_t *dst, compress_work_t *work)
+{
+	const uint8_t *in = src;
+	size_t ip = 0, anchor = 0, op = 0;
+
+	if (stride)
+	{
+		delta_filter(src, raw_size, stride, work->filtered);
+		in = work->filtered;
+	}
+	memset(work->table, 0, sizeof(work->table));
+
+	// table has the position + 1 of the last 4 bytes with each hash
+	while (ip + MIN_MATCH <= raw_size)
+	{
+		uint32_t value = read32(in + ip);
+		uint32_t hash = hash32(value);
+		size_t ref = work->table[hash];
+		work->table[hash] = ip + 1;
+		if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(in + ref - 1) != value)
+		{
+			ip++;
+			continue;
+		}
+
+		ref--;
+		size_t match_len = MIN_MATCH;
+		while (ip + match_len < raw_size && in[ref + match_len] == in[ip + match_len]) match_len++;
+		op += write_sequence(dst + op, in + anchor, ip - anchor, ip - ref, match_len);
+		ip += match_len;
+		anchor = ip;
+		if (op >= raw_size) return raw_size;
+	}
+	op += write_sequence(dst + op, in + anchor, raw_size - anchor, 0, 0);
+	return op < raw_size ? op : raw_size;
+}
+
+static int read_length(const uint8_t *src, size_t comp_size, size_t *ip, size_t *len)
+{
+	uint8_t byte;
+	do
+	{
+		if (*ip >= comp_size) return -1;
+		byte = src[(*ip)++];
+		*len += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+int decompress_block(const uint8_t *src, size_t comp_size, uint32_t stride, uint8_t *dst, size_t raw_size)
+{
+	size_t ip = 0, op = 0;
+
+	if (comp_size == raw_size)
+	{
+		memcpy(dst, src, raw_size);
+		return 0;
+	}
+
+	while (ip < comp_size)
+	{
+		uint8_t token = src[ip++];
+		size_t num_literals = token >> 4;
+		if (num_literals == 15 && read_length(src, comp_size, &ip, &num_literals)) return -1;
+		if (num_literals > comp_size - ip || num_literals > raw_size - op) return -1;
+		memcpy(dst + op, src + ip, num_literals);
+		ip += num_literals;
+		op += num_literals;
+		if (ip == comp_size) break;
+
+		if (comp_size - ip < 2) return -1;
+		size_t offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		size_t match_len = token & 15;
+		if (match_len == 15 && read_length(src, comp_size, &ip, &match_len)) return -1;
+		match_len += MIN_MATCH;
+		if (offset == 0 || offset > op || match_len > raw_size - op) return -1;
+		// The match may overlap what it copies
+		for (; match_len; match_len--, op++) dst[op] = dst[op - offset];
+	}
+	if (op != raw_size) return -1;
+
+	if (stride) delta_unfilter(dst, raw_size, stride);
+	return 0;
+}
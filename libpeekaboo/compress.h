@@ -0,0 +1,59 @@
+/* 
+ * Copyright 2019 Chua Zheng Leong
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LIBPEEKABOO_COMPRESS_H__
+#define __LIBPEEKABOO_COMPRESS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Block compression of trace streams (META_FLAG_COMPRESSED).
+ * A compressed stream is a series of blocks that decompress on their own. Its
+ * seek table, <stream>.seek, has one seek_entry_t per block. A block is first
+ * delta filtered: every 8-byte word minus the word stride bytes before it,
+ * which turns sequential pcs and strided addresses into repeats. Then it is
+ * compressed with a small LZ77 codec in the LZ4 style.
+ */
+#define COMPRESS_BLOCK_SIZE (256 << 10)	/* Largest raw block */
+#define COMPRESS_HASH_BITS 14
+
+typedef struct {
+	uint64_t raw_offset;	/* Offset of the block in the uncompressed stream */
+	uint64_t file_offset;	/* Offset of the compressed block in the file */
+	uint32_t raw_size;
+	uint32_t comp_size;	/* Equal to raw_size if the block is stored as is */
+	uint32_t stride;	/* Delta filter distance in bytes, a multiple of 8. 0 for none. */
+	uint32_t padding;
+} seek_entry_t;
+
+// Scratch memory of compress_block()
+typedef struct {
+	uint32_t table[1 << COMPRESS_HASH_BITS];
+	uint8_t filtered[COMPRESS_BLOCK_SIZE];
+} compress_work_t;
+
+// Size of the output buffer compress_block() needs for raw_size bytes
+#define COMPRESS_BOUND(raw_size) ((raw_size) + (raw_size) / 255 + 16)
+
+/* Compresses raw_size (up to COMPRESS_BLOCK_SIZE) bytes of src into dst and
+ * returns the compressed size. Returns raw_size if the block does not
+ * compress; store src as is then.
+ */
+size_t compress_block(const uint8_t *src, size_t raw_size, uint32_t stride, uint8_t *dst, compress_work_t *work);
+// Returns 0, or -1 if the block is corrupt
+int decompress_block(const uint8_t *src, size_t comp_size, uint32_t stride, uint8_t *dst, size_t raw_size);
+
+#endif
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE	/* fopencookie() */
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -22,6 +23,8 @@
 #include <unistd.h>
 
 #include "libpeekaboo.h"
+#include "compress.h"
+#include "live.h"
 
 int create_folder(char *name, char *output, uint32_t max_size)
 {
@@ -77,18 +80,53 @@ int create_trace_file(char *dir_path, char *filename, int size, FILE **output)
 void close_trace(peekaboo_trace_t *trace_ptr)
 {
 	fflush(trace_ptr->insn_trace);
-	fflush(trace_ptr->bytes_map);
 	fflush(trace_ptr->regfile);
 	fflush(trace_ptr->memfile);
 	fflush(trace_ptr->memrefs);
 	//fflush(trace_ptr->metafile);
 
 	fclose(trace_ptr->insn_trace);
-	fclose(trace_ptr->bytes_map);
+	// bytes_map is shared by the threads of a process. The tracer may close it itself.
+	if (trace_ptr->bytes_map) fclose(trace_ptr->bytes_map);
 	fclose(trace_ptr->regfile);
 	fclose(trace_ptr->memfile);
 	fclose(trace_ptr->memrefs);
 	//fclose(trace_ptr->metafile);
+	if (trace_ptr->regderef)
+	{
+		fflush(trace_ptr->regderef);
+		fclose(trace_ptr->regderef);
+	}
+	if (trace_ptr->memfile_ext)
+	{
+		fflush(trace_ptr->memfile_ext);
+		fclose(trace_ptr->memfile_ext);
+	}
+	if (trace_ptr->regfile_keyidx)
+	{
+		fflush(trace_ptr->regfile_keyidx);
+		fclose(trace_ptr->regfile_keyidx);
+	}
+	if (trace_ptr->segments)
+	{
+		fflush(trace_ptr->segments);
+		fclose(trace_ptr->segments);
+	}
+	if (trace_ptr->syscalls)
+	{
+		fflush(trace_ptr->syscalls);
+		fclose(trace_ptr->syscalls);
+	}
+	if (trace_ptr->memaddrs)
+	{
+		fflush(trace_ptr->memaddrs);
+		fclose(trace_ptr->memaddrs);
+	}
+	if (trace_ptr->order)
+	{
+		fflush(trace_ptr->order);
+		fclose(trace_ptr->order);
+	}
 }
 
 peekaboo_trace_t *create_trace(char *name)
@@ -103,6 +141,7 @@ peekaboo_trace_t *create_trace(char *name)
 
 	trace_ptr = (peekaboo_trace_t *)malloc(sizeof(peekaboo_trace_t));
 	if (!trace_ptr) PEEKABOO_DIE("libpeekaboo: Unable to malloc trace instance.\n");
+	memset(trace_ptr, 0, sizeof(peekaboo_trace_t));
 
 	create_trace_file(dir_path, "insn.trace", MAX_PATH, &trace_ptr->insn_trace);
 	create_trace_file(dir_path, "regfile", MAX_PATH, &trace_ptr->regfile);
@@ -119,6 +158,12 @@ peekaboo_trace_t *create_trace(char *name)
 	return trace_ptr;
 }
 
+static int compare_bytes_map(const void *a, const void *b)
+{
+	uint64_t pc_a = ((const bytes_map_t *)a)->pc, pc_b = ((const bytes_map_t *)b)->pc;
+	return (pc_a > pc_b) - (pc_a < pc_b);
+}
+
 void load_bytes_map(peekaboo_trace_t *trace)
 {
 	fseek(trace->bytes_map, 0, SEEK_END);
@@ -134,6 +179,20 @@ void load_bytes_map(peekaboo_trace_t *trace)
 	{
 		PEEKABOO_DIE("libpeekaboo: BYTES MAP READ ERROR!\n");
 	}
+
+	// The tracer sorts the bytemap by pc when it exits. Sort older or cut-short traces here.
+	bytes_map_t *bytes_map_buf = trace->internal->bytes_map_buf;
+	size_t x, num_unique = 0;
+	for (x=1; x<num_maps; x++)
+		if (bytes_map_buf[x-1].pc >= bytes_map_buf[x].pc) break;
+	if (x < num_maps)
+	{
+		qsort(bytes_map_buf, num_maps, sizeof(bytes_map_t), compare_bytes_map);
+		for (x=0; x<num_maps; x++)
+			if (num_unique == 0 || bytes_map_buf[x].pc != bytes_map_buf[num_unique-1].pc)
+				bytes_map_buf[num_unique++] = bytes_map_buf[x];
+		trace->internal->bytes_map_size = num_unique * sizeof(bytes_map_t);
+	}
 	printf("\n");
 	return ;
 }
@@ -142,17 +201,111 @@ bytes_map_t *find_bytes_map(uint64_t pc, peekaboo_trace_t *trace)
 {
 	bytes_map_t *bytes_map_buf = trace->internal->bytes_map_buf;
 	size_t map_size = trace->internal->bytes_map_size;
-	size_t num_maps = map_size / sizeof(bytes_map_t);
-	int x;
-	for (x=0; x<num_maps; x++)
+	size_t lo = 0, hi = map_size / sizeof(bytes_map_t);
+	while (lo < hi)
 	{
-		if ((bytes_map_buf+x)->pc == pc)
-			return bytes_map_buf+x;
+		size_t mid = lo + (hi - lo) / 2;
+		if (bytes_map_buf[mid].pc == pc)
+			return bytes_map_buf+mid;
+		if (bytes_map_buf[mid].pc < pc)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
 	return NULL;
 }
 
+/* Regfile delta encoding.
+ * A regfile is seen as an array of REGFILE_SLOT_SIZE-byte slots. A delta record
+ * is a bitmask of the slots that differ from the previous regfile, followed by
+ * the new values of those slots. Every keyframe_interval-th record (starting
+ * with the first one) is a full regfile instead. The file offset of every
+ * keyframe goes into regfile.keyidx.
+ */
+static size_t regfile_num_slots(size_t regfile_size)
+{
+	return (regfile_size + REGFILE_SLOT_SIZE - 1) / REGFILE_SLOT_SIZE;
+}
+
+static size_t regfile_mask_size(size_t regfile_size)
+{
+	return (regfile_num_slots(regfile_size) + 7) / 8;
+}
+
+size_t regfile_delta_max_size(size_t regfile_size)
+{
+	return regfile_mask_size(regfile_size) + regfile_size;
+}
+
+size_t regfile_delta_encode(const uint8_t *prev, const uint8_t *cur, size_t regfile_size, uint8_t *out)
+{
+	const size_t num_slots = regfile_num_slots(regfile_size);
+	const size_t mask_size = regfile_mask_size(regfile_size);
+	uint8_t *mask = out;
+	size_t out_size = mask_size;
+	size_t slot;
+
+	memset(mask, 0, mask_size);
+	for (slot=0; slot<num_slots; slot++)
+	{
+		size_t offset = slot * REGFILE_SLOT_SIZE;
+		size_t slot_size = (regfile_size - offset < REGFILE_SLOT_SIZE) ? (regfile_size - offset) : REGFILE_SLOT_SIZE;
+		if (!memcmp(prev + offset, cur + offset, slot_size)) continue;
+		mask[slot / 8] |= 1 << (slot % 8);
+		memcpy(out + out_size, cur + offset, slot_size);
+		out_size += slot_size;
+	}
+	return out_size;
+}
+
+// Apply the next delta record in trace->regfile onto the cached regfile
+static void regfile_delta_apply(peekaboo_trace_t *trace)
+{
+	const size_t regfile_size = trace->internal->regfile_size;
+	const size_t num_slots = regfile_num_slots(regfile_size);
+	uint8_t mask[regfile_mask_size(regfile_size)];
+	uint8_t *regfile = trace->internal->regfile_cache;
+	size_t slot;
+
+	if (fread(mask, sizeof(mask), 1, trace->regfile) != 1) PEEKABOO_DIE("libpeekaboo: Regfile delta is truncated!\n");
+	for (slot=0; slot<num_slots; slot++)
+	{
+		if (!(mask[slot / 8] & (1 << (slot % 8)))) continue;
+		size_t offset = slot * REGFILE_SLOT_SIZE;
+		size_t slot_size = (regfile_size - offset < REGFILE_SLOT_SIZE) ? (regfile_size - offset) : REGFILE_SLOT_SIZE;
+		if (fread(regfile + offset, slot_size, 1, trace->regfile) != 1) PEEKABOO_DIE("libpeekaboo: Regfile delta is truncated!\n");
+	}
+}
+
+// Rebuild the regfile of instruction id from the nearest keyframe, or from the cached state if it is on the way.
+static void read_delta_regfile(const size_t id, peekaboo_trace_t *trace, void *output)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	const size_t regfile_size = internal->regfile_size;
+	const size_t keyframe = (id-1) / internal->keyframe_interval;
+	const size_t keyframe_id = keyframe * internal->keyframe_interval + 1;
+
+	if (internal->regfile_cache_id == 0 || internal->regfile_cache_id > id || internal->regfile_cache_id < keyframe_id)
+	{
+		uint64_t offset;
+		if (fseek(trace->regfile_keyidx, keyframe * sizeof(uint64_t), SEEK_SET) ||
+		    fread(&offset, sizeof(uint64_t), 1, trace->regfile_keyidx) != 1)
+			PEEKABOO_DIE("libpeekaboo: Cannot find the regfile keyframe for instruction %lu!\n", id);
+		fseek(trace->regfile, offset, SEEK_SET);
+		if (fread(internal->regfile_cache, regfile_size, 1, trace->regfile) != 1)
+			PEEKABOO_DIE("libpeekaboo: Regfile keyframe is truncated!\n");
+		internal->regfile_cache_id = keyframe_id;
+	}
+
+	while (internal->regfile_cache_id < id)
+	{
+		regfile_delta_apply(trace);
+		internal->regfile_cache_id++;
+	}
+	memcpy(output, internal->regfile_cache, regfile_size);
+}
+
 size_t get_num_insn(peekaboo_trace_t *trace)
 {
 	return trace->internal->num_insns;
@@ -168,9 +321,778 @@ size_t get_regfile_size(peekaboo_trace_t *trace)
 	return trace->internal->regfile_size;
 }
 
+/* Basic block traces.
+ * load_bb_trace() scans insn.trace once to count the instructions and to index
+ * every BB_INDEX_INTERVAL-th block. get_bb_addr() finds the block of an
+ * instruction from that index and walks insn.bytemap from the start of the
+ * block. A cursor makes sequential reads O(1).
+ */
+#define BB_INDEX_INTERVAL 1024
+
+static bb_ref_t read_bb_ref(size_t ref, peekaboo_trace_t *trace)
+{
+	bb_ref_t bb_ref;
+	fseek(trace->insn_trace, ref * sizeof(bb_ref_t), SEEK_SET);
+	if (fread(&bb_ref, sizeof(bb_ref_t), 1, trace->insn_trace) != 1)
+		PEEKABOO_DIE("libpeekaboo: Unable to read basic block %lu in insn.trace.\n", ref);
+	return bb_ref;
+}
+
+static bb_entry_t *get_bb_entry(uint32_t bb_id, peekaboo_trace_t *trace)
+{
+	if (bb_id >= trace->internal->bb_table_size)
+		PEEKABOO_DIE("libpeekaboo: Basic block %u is not in insn.bbtable.\n", bb_id);
+	return &trace->internal->bb_table[bb_id];
+}
+
+// Points the cursor to the block at insn.trace position ref, which starts with instruction start.
+static void set_bb_cursor(size_t ref, size_t start, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	struct bb_cursor *cursor = &internal->bb_cursor;
+	bb_ref_t bb_ref = read_bb_ref(ref, trace);
+	if (bb_ref.id & BB_REF_EARLY_EXIT)
+		PEEKABOO_DIE("libpeekaboo: Unexpected early exit marker at %lu in insn.trace.\n", ref);
+
+	bb_entry_t *bb = get_bb_entry(bb_ref.id, trace);
+	cursor->ref = ref;
+	cursor->start = start;
+	cursor->bb_id = bb_ref.id;
+	cursor->len = bb->num_insns;
+	cursor->insn = start;
+	cursor->pc = bb->pc;
+
+	// Did the block exit early?
+	if (ref + 1 < internal->num_bb_refs)
+	{
+		bb_ref = read_bb_ref(ref + 1, trace);
+		if (bb_ref.id & BB_REF_EARLY_EXIT) cursor->len = bb_ref.id & ~BB_REF_EARLY_EXIT;
+	}
+}
+
+// Moves the cursor to the block that follows it in insn.trace
+static void next_bb_cursor(peekaboo_trace_t *trace)
+{
+	struct bb_cursor *cursor = &trace->internal->bb_cursor;
+	size_t ref = cursor->ref + 1;
+	if (ref < trace->internal->num_bb_refs && (read_bb_ref(ref, trace).id & BB_REF_EARLY_EXIT)) ref++;
+	if (ref >= trace->internal->num_bb_refs)
+		PEEKABOO_DIE("libpeekaboo: Instruction %lu is beyond the end of insn.trace.\n", cursor->start + cursor->len + 1);
+	set_bb_cursor(ref, cursor->start + cursor->len, trace);
+}
+
+static uint64_t get_bb_addr(size_t id, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	struct bb_cursor *cursor = &internal->bb_cursor;
+	const size_t insn = id - 1;
+
+	if (insn >= internal->num_insns)
+		PEEKABOO_DIE("libpeekaboo: Instruction %lu is beyond the end of insn.trace.\n", id);
+
+	if (cursor->len == 0 || insn < cursor->start || insn >= cursor->start + cursor->len + BB_INDEX_INTERVAL)
+	{
+		// Far away from the cursor. Binary search the index for the last indexed block starting at or before insn.
+		size_t low = 0, high = internal->bb_index_size;
+		while (high - low > 1)
+		{
+			size_t mid = (low + high) / 2;
+			if (internal->bb_index[mid].start <= insn) low = mid;
+			else high = mid;
+		}
+		set_bb_cursor(internal->bb_index[low].ref, internal->bb_index[low].start, trace);
+	}
+	while (insn >= cursor->start + cursor->len) next_bb_cursor(trace);
+
+	// Walk the bytemap to the instruction
+	if (insn < cursor->insn)
+	{
+		cursor->insn = cursor->start;
+		cursor->pc = get_bb_entry(cursor->bb_id, trace)->pc;
+	}
+	while (cursor->insn < insn)
+	{
+		bytes_map_t *bytes_map = find_bytes_map(cursor->pc, trace);
+		if (!bytes_map) PEEKABOO_DIE("libpeekaboo: Error. Cannot find instruction at 0x%"PRIx64" in bytes_map. Terminated!\n", cursor->pc);
+		cursor->pc += bytes_map->size;
+		cursor->insn++;
+	}
+	return cursor->pc;
+}
+
+static void load_bb_trace(char *dir_path, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	char path[MAX_PATH];
+
+	// Load the block table
+	snprintf(path, MAX_PATH, "%s/../%s", dir_path, "insn.bbtable");
+	FILE *bb_table_file = fopen(path, "rb");
+	if (bb_table_file == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+	fseek(bb_table_file, 0, SEEK_END);
+	size_t num_entries = ftell(bb_table_file) / sizeof(bb_entry_t);
+	rewind(bb_table_file);
+	bb_entry_t *entries = malloc(num_entries * sizeof(bb_entry_t));
+	if (num_entries && fread(entries, sizeof(bb_entry_t), num_entries, bb_table_file) != num_entries) PEEKABOO_DIE("libpeekaboo: BB TABLE READ ERROR!\n");
+	fclose(bb_table_file);
+
+	// Forked processes append out of id order, and a process killed right
+	// after taking an id leaves a hole. Size the table by the largest id.
+	uint32_t table_size = 0;
+	for (size_t x=0; x<num_entries; x++)
+		if (entries[x].id >= table_size) table_size = entries[x].id + 1;
+	internal->bb_table = calloc(table_size, sizeof(bb_entry_t));
+	internal->bb_table_size = table_size;
+	for (size_t x=0; x<num_entries; x++)
+		internal->bb_table[entries[x].id] = entries[x];
+	free(entries);
+
+	// Count instructions and index the blocks
+	fseek(trace->insn_trace, 0, SEEK_END);
+	internal->num_bb_refs = ftell(trace->insn_trace) / sizeof(bb_ref_t);
+	rewind(trace->insn_trace);
+	internal->bb_index = malloc(sizeof(struct bb_index) * (internal->num_bb_refs / BB_INDEX_INTERVAL + 1));
+	internal->bb_index_size = 0;
+
+	bb_ref_t buffer[4096];
+	size_t num_blocks = 0, num_insns = 0, last_len = 0;
+	size_t ref = 0, read_size;
+	do {
+		read_size = fread(buffer, sizeof(bb_ref_t), 4096, trace->insn_trace);
+		for (size_t x=0; x<read_size; x++, ref++)
+		{
+			if (buffer[x].id & BB_REF_EARLY_EXIT)
+			{
+				// The previous block did not run to its end
+				num_insns -= last_len - (buffer[x].id & ~BB_REF_EARLY_EXIT);
+				continue;
+			}
+			if (num_blocks % BB_INDEX_INTERVAL == 0)
+			{
+				internal->bb_index[internal->bb_index_size].ref = ref;
+				internal->bb_index[internal->bb_index_size].start = num_insns;
+				internal->bb_index_size++;
+			}
+			last_len = get_bb_entry(buffer[x].id, trace)->num_insns;
+			num_insns += last_len;
+			num_blocks++;
+		}
+	} while (read_size == 4096);
+	rewind(trace->insn_trace);
+
+	internal->num_insns = num_insns;
+	memset(&internal->bb_cursor, 0, sizeof(struct bb_cursor));
+	fprintf(stderr, "Basic block trace: %lu blocks, %lu instructions.\n", num_blocks, num_insns);
+}
+
+/* Control flow traces.
+ * The decoder walks insn.bytemap from one control transfer to the next and
+ * takes a branch_ref_t at every one that is not direct. load_branch_trace()
+ * runs it over the whole trace once to count the instructions, and keeps its
+ * state every BRANCH_INDEX_INTERVAL instructions. get_branch_addr() starts from
+ * the nearest one. A cursor makes sequential reads O(1).
+ */
+#define BRANCH_INDEX_INTERVAL 4096
+#define BRANCH_REF_CACHE 4096
+
+static branch_ref_t read_branch_ref(size_t ref, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	if (ref < internal->branch_refs_start || ref >= internal->branch_refs_start + internal->num_cached_refs)
+	{
+		fseek(trace->insn_trace, ref * sizeof(branch_ref_t), SEEK_SET);
+		internal->branch_refs_start = ref;
+		internal->num_cached_refs = fread(internal->branch_refs, sizeof(branch_ref_t), BRANCH_REF_CACHE, trace->insn_trace);
+		if (internal->num_cached_refs == 0)
+			PEEKABOO_DIE("libpeekaboo: Unable to read branch %lu in insn.trace.\n", ref);
+	}
+	return internal->branch_refs[ref - internal->branch_refs_start];
+}
+
+static branch_entry_t *find_branch(uint64_t pc, peekaboo_trace_t *trace)
+{
+	branch_entry_t *branch_table = trace->internal->branch_table;
+	size_t lo = 0, hi = trace->internal->branch_table_size;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (branch_table[mid].pc == pc)
+			return branch_table+mid;
+		if (branch_table[mid].pc < pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+// Takes the asynchronous transfers made before the instruction at the cursor ran
+static void take_async_branches(struct branch_cursor *cursor, peekaboo_trace_t *trace)
+{
+	const size_t num_refs = trace->internal->num_branch_refs;
+	while (cursor->ref < num_refs)
+	{
+		branch_ref_t branch_ref = read_branch_ref(cursor->ref, trace);
+		if (branch_ref.target & BRANCH_REF_ASYNC)
+		{
+			uint64_t from = branch_ref.target & ~BRANCH_REF_ASYNC;
+			if (from != 0 && from != cursor->pc) return;
+			if (cursor->ref + 1 >= num_refs)
+				PEEKABOO_DIE("libpeekaboo: Transfer %lu in insn.trace has no destination.\n", cursor->ref);
+			cursor->pc = read_branch_ref(cursor->ref + 1, trace).target;
+			cursor->ref += 2;
+		}
+		else if (cursor->pc == 0)
+		{
+			// Unknown start. Pick up at the first recorded transfer.
+			cursor->pc = branch_ref.target;
+			cursor->ref++;
+		}
+		else return;
+	}
+}
+
+/* Moves the cursor to the next instruction. Returns false, leaving the cursor
+ * alone, if the trace ends: a transfer has nothing left in insn.trace, or the
+ * thread left the instructions in insn.bytemap.
+ */
+static bool next_branch_cursor(struct branch_cursor *cursor, peekaboo_trace_t *trace)
+{
+	struct branch_cursor next = *cursor;
+	branch_entry_t *branch = find_branch(next.pc, trace);
+	if (branch && branch->type == BRANCH_DIRECT)
+	{
+		next.pc = branch->target;
+	}
+	else if (branch)
+	{
+		if (next.ref >= trace->internal->num_branch_refs) return false;
+		branch_ref_t branch_ref = read_branch_ref(next.ref, trace);
+		if (branch_ref.target & BRANCH_REF_ASYNC)
+			PEEKABOO_DIE("libpeekaboo: Branch at 0x%"PRIx64" has no destination at %lu in insn.trace.\n", next.pc, next.ref);
+		next.pc = branch_ref.target;
+		next.ref++;
+	}
+	else
+	{
+		bytes_map_t *bytes_map = find_bytes_map(next.pc, trace);
+		if (!bytes_map) PEEKABOO_DIE("libpeekaboo: Error. Cannot find instruction at 0x%"PRIx64" in bytes_map. Terminated!\n", next.pc);
+		next.pc += bytes_map->size;
+	}
+	next.insn++;
+	take_async_branches(&next, trace);
+	if (!find_bytes_map(next.pc, trace)) return false;
+	*cursor = next;
+	return true;
+}
+
+static uint64_t get_branch_addr(size_t id, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	struct branch_cursor *cursor = &internal->branch_cursor;
+	const size_t insn = id - 1;
+
+	if (insn >= internal->num_insns)
+		PEEKABOO_DIE("libpeekaboo: Instruction %lu is beyond the end of insn.trace.\n", id);
+
+	if (insn < cursor->insn || insn >= cursor->insn + BRANCH_INDEX_INTERVAL)
+		*cursor = internal->branch_index[insn / BRANCH_INDEX_INTERVAL];
+	while (cursor->insn < insn)
+		if (!next_branch_cursor(cursor, trace))
+			PEEKABOO_DIE("libpeekaboo: Instruction %lu is beyond the end of insn.trace.\n", id);
+	return cursor->pc;
+}
+
+static int compare_branch_entry(const void *a, const void *b)
+{
+	uint64_t pc_a = ((const branch_entry_t *)a)->pc, pc_b = ((const branch_entry_t *)b)->pc;
+	return (pc_a > pc_b) - (pc_a < pc_b);
+}
+
+static void load_branch_trace(char *dir_path, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	char path[MAX_PATH];
+
+	// Load the branch table. A forked child may have added branches again.
+	snprintf(path, MAX_PATH, "%s/../%s", dir_path, "insn.brtable");
+	FILE *branch_table_file = fopen(path, "rb");
+	if (branch_table_file == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+	fseek(branch_table_file, 0, SEEK_END);
+	size_t num_entries = ftell(branch_table_file) / sizeof(branch_entry_t);
+	rewind(branch_table_file);
+	internal->branch_table = malloc(num_entries * sizeof(branch_entry_t));
+	if (fread(internal->branch_table, sizeof(branch_entry_t), num_entries, branch_table_file) != num_entries)
+		PEEKABOO_DIE("libpeekaboo: BRANCH TABLE READ ERROR!\n");
+	fclose(branch_table_file);
+	qsort(internal->branch_table, num_entries, sizeof(branch_entry_t), compare_branch_entry);
+	size_t x, num_unique = 0;
+	for (x=0; x<num_entries; x++)
+		if (num_unique == 0 || internal->branch_table[x].pc != internal->branch_table[num_unique-1].pc)
+			internal->branch_table[num_unique++] = internal->branch_table[x];
+	internal->branch_table_size = num_unique;
+
+	fseek(trace->insn_trace, 0, SEEK_END);
+	internal->num_branch_refs = ftell(trace->insn_trace) / sizeof(branch_ref_t);
+	rewind(trace->insn_trace);
+	internal->branch_refs = malloc(sizeof(branch_ref_t) * BRANCH_REF_CACHE);
+	internal->num_cached_refs = 0;
+
+	// Decode the whole trace once. Past the last transfer, a loop of direct
+	// jumps would never end; stop after more instructions than there are.
+	struct branch_cursor cursor = {0, 0, 0};
+	size_t index_capacity = 1024, num_insns = 0;
+	size_t last_ref = 0, last_ref_insn = 0;
+	const size_t max_straight = internal->bytes_map_size / sizeof(bytes_map_t);
+	internal->branch_index = malloc(sizeof(struct branch_cursor) * index_capacity);
+	internal->branch_index_size = 0;
+	take_async_branches(&cursor, trace);
+	if (cursor.pc && find_bytes_map(cursor.pc, trace))
+	{
+		do {
+			if (cursor.insn % BRANCH_INDEX_INTERVAL == 0)
+			{
+				if (internal->branch_index_size == index_capacity)
+				{
+					index_capacity *= 2;
+					internal->branch_index = realloc(internal->branch_index, sizeof(struct branch_cursor) * index_capacity);
+				}
+				internal->branch_index[internal->branch_index_size++] = cursor;
+			}
+			if (cursor.ref != last_ref)
+			{
+				last_ref = cursor.ref;
+				last_ref_insn = cursor.insn;
+			}
+			else if (cursor.ref >= internal->num_branch_refs && cursor.insn - last_ref_insn > max_straight) break;
+		} while (next_branch_cursor(&cursor, trace));
+		num_insns = cursor.insn + 1;
+	}
+	if (cursor.ref < internal->num_branch_refs)
+		fprintf(stderr, "libpeekaboo: [Warning] Decoding stopped at 0x%"PRIx64" with %lu transfers left in insn.trace.\n", cursor.pc, internal->num_branch_refs - cursor.ref);
+
+	internal->num_insns = num_insns;
+	if (internal->branch_index_size) internal->branch_cursor = internal->branch_index[0];
+	fprintf(stderr, "Control flow trace: %lu transfers, %lu instructions.\n", internal->num_branch_refs, num_insns);
+}
+
+/* A compressed stream (META_FLAG_COMPRESSED) is read through a FILE that
+ * looks uncompressed. Only the block holding the position is decompressed,
+ * and the last one is kept.
+ */
+typedef struct {
+	FILE *file;
+	seek_entry_t *entries;
+	size_t num_entries;
+	uint64_t size;		/* Uncompressed size */
+	uint64_t pos;
+	size_t cached;		/* Block in block. num_entries if none. */
+	uint8_t *block;
+	uint8_t *comp_block;
+} compressed_stream_t;
+
+static ssize_t compressed_read(void *cookie, char *buf, size_t size)
+{
+	compressed_stream_t *stream = cookie;
+	size_t done = 0;
+	while (done < size && stream->pos < stream->size)
+	{
+		// Last block starting at or before pos
+		size_t lo = 0, hi = stream->num_entries;
+		while (hi - lo > 1)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (stream->entries[mid].raw_offset <= stream->pos)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		seek_entry_t *entry = &stream->entries[lo];
+		if (stream->cached != lo)
+		{
+			fseek(stream->file, entry->file_offset, SEEK_SET);
+			if (fread(stream->comp_block, 1, entry->comp_size, stream->file) != entry->comp_size ||
+			    decompress_block(stream->comp_block, entry->comp_size, entry->stride, stream->block, entry->raw_size))
+				PEEKABOO_DIE("libpeekaboo: Compressed block %lu is corrupt.\n", lo);
+			stream->cached = lo;
+		}
+
+		size_t offset = stream->pos - entry->raw_offset;
+		size_t chunk = entry->raw_size - offset;
+		if (chunk > size - done) chunk = size - done;
+		memcpy(buf + done, stream->block + offset, chunk);
+		done += chunk;
+		stream->pos += chunk;
+	}
+	return done;
+}
+
+static int compressed_seek(void *cookie, off64_t *offset, int whence)
+{
+	compressed_stream_t *stream = cookie;
+	int64_t base = whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? stream->pos : stream->size);
+	if (base + *offset < 0) return -1;
+	stream->pos = base + *offset;
+	*offset = stream->pos;
+	return 0;
+}
+
+static int compressed_close(void *cookie)
+{
+	compressed_stream_t *stream = cookie;
+	fclose(stream->file);
+	free(stream->entries);
+	free(stream->block);
+	free(stream->comp_block);
+	free(stream);
+	return 0;
+}
+
+// Opens a trace stream for reading. A compressed one needs its seek table at path.seek.
+static FILE *open_stream(char *path, bool compressed)
+{
+	if (!compressed) return fopen(path, "rb");
+
+	char seek_path[MAX_PATH + 8];
+	snprintf(seek_path, sizeof(seek_path), "%s.seek", path);
+	FILE *seek_table = fopen(seek_path, "rb");
+	if (seek_table == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", seek_path);
+
+	compressed_stream_t *stream = malloc(sizeof(compressed_stream_t));
+	memset(stream, 0, sizeof(compressed_stream_t));
+	fseek(seek_table, 0, SEEK_END);
+	stream->num_entries = ftell(seek_table) / sizeof(seek_entry_t);
+	rewind(seek_table);
+	stream->entries = malloc(stream->num_entries * sizeof(seek_entry_t));
+	if (fread(stream->entries, sizeof(seek_entry_t), stream->num_entries, seek_table) != stream->num_entries)
+		PEEKABOO_DIE("libpeekaboo: Unable to read %s\n", seek_path);
+	fclose(seek_table);
+
+	size_t x, max_raw = 0, max_comp = 0;
+	for (x=0; x<stream->num_entries; x++)
+	{
+		if (stream->entries[x].raw_size > max_raw) max_raw = stream->entries[x].raw_size;
+		if (stream->entries[x].comp_size > max_comp) max_comp = stream->entries[x].comp_size;
+	}
+	if (stream->num_entries)
+		stream->size = stream->entries[x-1].raw_offset + stream->entries[x-1].raw_size;
+	stream->block = malloc(max_raw);
+	stream->comp_block = malloc(max_comp);
+	stream->cached = stream->num_entries;
+
+	stream->file = fopen(path, "rb");
+	if (stream->file == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+
+	cookie_io_functions_t funcs = {
+		.read = compressed_read,
+		.write = NULL,
+		.seek = compressed_seek,
+		.close = compressed_close,
+	};
+	return fopencookie(stream, "rb", funcs);
+}
+
+/* A stream in parts (META_FLAG_PARTS) is read through a FILE that looks like
+ * one file. Only the part holding the position is open.
+ */
+typedef struct {
+	char path[MAX_PATH];	/* Of part 0 */
+	bool compressed;
+	uint64_t *offsets;	/* Where each part starts, and the end of the stream */
+	size_t num_parts;
+	size_t current;		/* Part open in file. num_parts if none. */
+	FILE *file;
+	uint64_t pos;
+} parts_stream_t;
+
+static FILE *open_part(parts_stream_t *stream, size_t part)
+{
+	char path[MAX_PATH];
+	int len;
+	if (part)
+		len = snprintf(path, sizeof(path), "%s.%lu", stream->path, part);
+	else
+		len = snprintf(path, sizeof(path), "%s", stream->path);
+	if (len >= (int)sizeof(path)) PEEKABOO_DIE("libpeekaboo: Path too long for part %lu of %s\n", part, stream->path);
+	FILE *file = open_stream(path, stream->compressed);
+	if (file == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+	return file;
+}
+
+static ssize_t parts_read(void *cookie, char *buf, size_t size)
+{
+	parts_stream_t *stream = cookie;
+	size_t done = 0;
+	while (done < size && stream->pos < stream->offsets[stream->num_parts])
+	{
+		// Last part starting at or before pos. Empty parts start where the next one does.
+		size_t lo = 0, hi = stream->num_parts;
+		while (hi - lo > 1)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (stream->offsets[mid] <= stream->pos)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		if (stream->current != lo)
+		{
+			if (stream->file) fclose(stream->file);
+			stream->file = open_part(stream, lo);
+			stream->current = lo;
+		}
+
+		size_t chunk = stream->offsets[lo + 1] - stream->pos;
+		if (chunk > size - done) chunk = size - done;
+		fseek(stream->file, stream->pos - stream->offsets[lo], SEEK_SET);
+		size_t read_size = fread(buf + done, 1, chunk, stream->file);
+		done += read_size;
+		stream->pos += read_size;
+		if (read_size < chunk) break;
+	}
+	return done;
+}
+
+static int parts_seek(void *cookie, off64_t *offset, int whence)
+{
+	parts_stream_t *stream = cookie;
+	int64_t base = whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? stream->pos : stream->offsets[stream->num_parts]);
+	if (base + *offset < 0) return -1;
+	stream->pos = base + *offset;
+	*offset = stream->pos;
+	return 0;
+}
+
+static int parts_close(void *cookie)
+{
+	parts_stream_t *stream = cookie;
+	if (stream->file) fclose(stream->file);
+	free(stream->offsets);
+	free(stream);
+	return 0;
+}
+
+/* Opens a stream of a trace in parts. Each part is as long as its file, or
+ * its uncompressed blocks; the manifest says where it should start.
+ */
+static FILE *open_parts(char *path, uint32_t stream_id, bool compressed, part_t *manifest, size_t manifest_size)
+{
+	size_t x, num_parts = 0;
+	for (x=0; x<manifest_size; x++)
+		if (manifest[x].stream == stream_id && manifest[x].index >= num_parts) num_parts = manifest[x].index + 1;
+	if (num_parts <= 1) return open_stream(path, compressed);
+
+	parts_stream_t *stream = malloc(sizeof(parts_stream_t));
+	memset(stream, 0, sizeof(parts_stream_t));
+	strncpy(stream->path, path, MAX_PATH - 1);
+	stream->compressed = compressed;
+	stream->num_parts = num_parts;
+	stream->offsets = malloc((num_parts + 1) * sizeof(uint64_t));
+	for (x=0; x<num_parts; x++)
+	{
+		FILE *part = open_part(stream, x);
+		fseek(part, 0, SEEK_END);
+		stream->offsets[x + 1] = ftell(part);
+		fclose(part);
+	}
+	stream->offsets[0] = 0;
+	for (x=0; x<num_parts; x++)
+		stream->offsets[x + 1] += stream->offsets[x];
+	for (x=0; x<manifest_size; x++)
+		if (manifest[x].stream == stream_id && manifest[x].offset != stream->offsets[manifest[x].index])
+			PEEKABOO_DIE("libpeekaboo: Part %u of %s should start at %"PRIu64", but the parts before it end at %"PRIu64"\n", manifest[x].index, path, manifest[x].offset, stream->offsets[manifest[x].index]);
+	stream->current = num_parts;
+
+	cookie_io_functions_t funcs = {
+		.read = parts_read,
+		.write = NULL,
+		.seek = parts_seek,
+		.close = parts_close,
+	};
+	return fopencookie(stream, "rb", funcs);
+}
+
+static int compare_part(const void *a, const void *b)
+{
+	const part_t *x = a, *y = b;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+// Reads manifest. Keeps the parts of insn.trace for find_part().
+static part_t *load_manifest(char *dir_path, peekaboo_trace_t *trace, size_t *manifest_size)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	char path[MAX_PATH];
+	size_t x;
+
+	snprintf(path, MAX_PATH, "%s/%s", dir_path, "manifest");
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+	fseek(file, 0, SEEK_END);
+	*manifest_size = ftell(file) / sizeof(part_t);
+	rewind(file);
+	part_t *manifest = malloc(*manifest_size * sizeof(part_t));
+	if (fread(manifest, sizeof(part_t), *manifest_size, file) != *manifest_size)
+		PEEKABOO_DIE("libpeekaboo: Unable to read %s\n", path);
+	fclose(file);
+
+	internal->parts = malloc(*manifest_size * sizeof(part_t));
+	internal->num_parts = 0;
+	for (x=0; x<*manifest_size; x++)
+		if (manifest[x].stream == PART_INSN_TRACE) internal->parts[internal->num_parts++] = manifest[x];
+	qsort(internal->parts, internal->num_parts, sizeof(part_t), compare_part);
+	fprintf(stderr, "Trace in parts: insn.trace has %lu.\n", internal->num_parts);
+	return manifest;
+}
+
+// memaddr_t read ahead by next_mem_access()
+#define MEMADDR_BUF_LEN 4096
+
+static void load_segments(peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	fseek(trace->segments, 0, SEEK_END);
+	internal->num_segments = ftell(trace->segments) / sizeof(segment_t);
+	rewind(trace->segments);
+	internal->segments = malloc(internal->num_segments * sizeof(segment_t));
+	if (fread(internal->segments, sizeof(segment_t), internal->num_segments, trace->segments) != internal->num_segments)
+		PEEKABOO_DIE("libpeekaboo: Unable to read segments.\n");
+	fprintf(stderr, "Sampled trace: %lu segments.\n", internal->num_segments);
+}
+
+static void load_syscalls(peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	fseek(trace->syscalls, 0, SEEK_END);
+	internal->num_syscalls = ftell(trace->syscalls) / sizeof(syscall_t);
+	rewind(trace->syscalls);
+	internal->syscalls = malloc(internal->num_syscalls * sizeof(syscall_t));
+	if (fread(internal->syscalls, sizeof(syscall_t), internal->num_syscalls, trace->syscalls) != internal->num_syscalls)
+		PEEKABOO_DIE("libpeekaboo: Unable to read syscalls.\n");
+	fprintf(stderr, "Found %lu syscalls.\n", internal->num_syscalls);
+}
+
+static void load_order(peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	fseek(trace->order, 0, SEEK_END);
+	internal->num_orders = ftell(trace->order) / sizeof(order_t);
+	rewind(trace->order);
+	internal->orders = malloc(internal->num_orders * sizeof(order_t));
+	if (fread(internal->orders, sizeof(order_t), internal->num_orders, trace->order) != internal->num_orders)
+		PEEKABOO_DIE("libpeekaboo: Unable to read order.\n");
+}
+
+// modules is next to insn.bytemap. Older traces have none.
+static void load_modules(char *dir_path, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	char path[MAX_PATH];
+	snprintf(path, MAX_PATH, "%s/../%s", dir_path, "modules");
+	FILE *modules = fopen(path, "rb");
+	if (modules == NULL) return;
+	fseek(modules, 0, SEEK_END);
+	internal->num_modules = ftell(modules) / sizeof(module_event_t);
+	rewind(modules);
+	internal->modules = malloc(internal->num_modules * sizeof(module_event_t));
+	if (fread(internal->modules, sizeof(module_event_t), internal->num_modules, modules) != internal->num_modules)
+		PEEKABOO_DIE("libpeekaboo: Unable to read modules.\n");
+	fclose(modules);
+}
+
+static int compare_bb_count_pc(const void *a, const void *b)
+{
+	const bb_count_t *bb_a = a, *bb_b = b;
+	if (bb_a->pc != bb_b->pc) return (bb_a->pc > bb_b->pc) - (bb_a->pc < bb_b->pc);
+	return (bb_a->num_insns > bb_b->num_insns) - (bb_a->num_insns < bb_b->num_insns);
+}
+
+static int compare_bb_count_heat(const void *a, const void *b)
+{
+	const bb_count_t *bb_a = a, *bb_b = b;
+	uint64_t insns_a = bb_a->count * bb_a->num_insns, insns_b = bb_b->count * bb_b->num_insns;
+	if (insns_a != insns_b) return (insns_a < insns_b) - (insns_a > insns_b);
+	return compare_bb_count_pc(a, b);
+}
+
+// bbcounts is next to insn.bytemap. The counts of a block in several processes are added up.
+static void load_bb_counts(char *dir_path, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	char path[MAX_PATH];
+	size_t x, num_unique = 0;
+
+	snprintf(path, MAX_PATH, "%s/../%s", dir_path, "bbcounts");
+	FILE *bb_counts = fopen(path, "rb");
+	if (bb_counts == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+	fseek(bb_counts, 0, SEEK_END);
+	internal->num_bb_counts = ftell(bb_counts) / sizeof(bb_count_t);
+	rewind(bb_counts);
+	internal->bb_counts = malloc(internal->num_bb_counts * sizeof(bb_count_t));
+	if (fread(internal->bb_counts, sizeof(bb_count_t), internal->num_bb_counts, bb_counts) != internal->num_bb_counts)
+		PEEKABOO_DIE("libpeekaboo: Unable to read bbcounts.\n");
+	fclose(bb_counts);
+
+	qsort(internal->bb_counts, internal->num_bb_counts, sizeof(bb_count_t), compare_bb_count_pc);
+	for (x=0; x<internal->num_bb_counts; x++)
+	{
+		bb_count_t *bb = &internal->bb_counts[x];
+		if (num_unique && compare_bb_count_pc(bb, &internal->bb_counts[num_unique-1]) == 0)
+		{
+			internal->bb_counts[num_unique-1].count += bb->count;
+			if (internal->bb_counts[num_unique-1].pid != bb->pid) internal->bb_counts[num_unique-1].pid = 0;
+		}
+		else
+			internal->bb_counts[num_unique++] = *bb;
+	}
+	internal->num_bb_counts = num_unique;
+	qsort(internal->bb_counts, internal->num_bb_counts, sizeof(bb_count_t), compare_bb_count_heat);
+	fprintf(stderr, "Found %lu basic blocks.\n", internal->num_bb_counts);
+}
+
+static int compare_memdesc(const void *a, const void *b)
+{
+	uint64_t pc_a = ((const memdesc_t *)a)->pc, pc_b = ((const memdesc_t *)b)->pc;
+	return (pc_a > pc_b) - (pc_a < pc_b);
+}
+
+// insn.memdesc is next to insn.bytemap. Forked children may have written an instruction again.
+static void load_memdescs(char *dir_path, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	char path[MAX_PATH];
+	size_t x, num_unique = 0;
+
+	snprintf(path, MAX_PATH, "%s/../%s", dir_path, "insn.memdesc");
+	FILE *memdescs = fopen(path, "rb");
+	if (memdescs == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+	fseek(memdescs, 0, SEEK_END);
+	internal->num_memdescs = ftell(memdescs) / sizeof(memdesc_t);
+	rewind(memdescs);
+	internal->memdescs = malloc(internal->num_memdescs * sizeof(memdesc_t));
+	if (fread(internal->memdescs, sizeof(memdesc_t), internal->num_memdescs, memdescs) != internal->num_memdescs)
+		PEEKABOO_DIE("libpeekaboo: Unable to read insn.memdesc.\n");
+	fclose(memdescs);
+
+	qsort(internal->memdescs, internal->num_memdescs, sizeof(memdesc_t), compare_memdesc);
+	for (x=0; x<internal->num_memdescs; x++)
+		if (num_unique == 0 || internal->memdescs[x].pc != internal->memdescs[num_unique-1].pc)
+			internal->memdescs[num_unique++] = internal->memdescs[x];
+	internal->num_memdescs = num_unique;
+}
+
+memdesc_t *find_memdesc(uint64_t pc, peekaboo_trace_t *trace)
+{
+	memdesc_t key = {.pc = pc};
+	if (!trace->internal->memdescs) return NULL;
+	return bsearch(&key, trace->internal->memdescs, trace->internal->num_memdescs, sizeof(memdesc_t), compare_memdesc);
+}
+
 uint64_t get_addr(size_t id, peekaboo_trace_t *trace)
 {
 	if (!id) PEEKABOO_DIE("libpeekaboo: Error. Instruction index 0 is not accepted.\n");
+	if (trace->internal->flags & META_FLAG_BB_TRACE) return get_bb_addr(id, trace);
+	if (trace->internal->flags & META_FLAG_BRANCH_TRACE) return get_branch_addr(id, trace);
 
 	uint64_t addr = 0;
 	size_t ptr_size = get_ptr_size(trace);
@@ -185,6 +1107,11 @@ size_t get_num_mem(size_t id, peekaboo_trace_t *trace)
 	if (!id) PEEKABOO_DIE("libpeekaboo: Error. Instruction index 0 is not accepted.\n");
 
 	size_t num_mem = 0;
+	if (trace->internal->flags & META_FLAG_MEMDESC)
+	{
+		memdesc_t *memdesc = find_memdesc(get_addr(id, trace), trace);
+		return memdesc ? memdesc->num_mem : 0;
+	}
 	fseek(trace->memrefs, (id-1) * sizeof(memref_t), SEEK_SET);
 	size_t fread_bytes = fread(&num_mem, sizeof(memref_t), 1, trace->memrefs);
 	return num_mem;
@@ -205,8 +1132,9 @@ void load_memrefs_offsets(char *dir_path, peekaboo_trace_t *trace)
 		 * in memfile buffer that can't be cleaned up.
 		 * Thus, When read those traces, we need to find the real starting
 		 * point of the memfile. We use base_offset to store it.
+		 * Traces with META_FLAG_ALIGNED have no residue.
 		 */
-		if (trace->internal->version >= 3)
+		if (trace->internal->version >= 3 && !(trace->internal->flags & (META_FLAG_ALIGNED | META_FLAG_MEMDESC)))
 		{
 			// Find the first instruction that has memory access
 			uint64_t first_pc = 0x0;
@@ -253,11 +1181,31 @@ void load_memrefs_offsets(char *dir_path, peekaboo_trace_t *trace)
 		size_t read_size = 0;
 		size_t offset = base_offset;
 
-		rewind(trace->memrefs);
-		do {
-			read_size = fread(buffer, sizeof(memref_t), 1024, trace->memrefs);
-			int x;
-			for (x=0; x<read_size; x++)
+		// The operands of each instruction come from insn.memdesc
+		if (trace->internal->flags & META_FLAG_MEMDESC)
+		{
+			size_t id, x = 0;
+			for (id=1; id<=trace->internal->num_insns; id++)
+			{
+				size_t num_mem = get_num_mem(id, trace);
+				write_buffer[x++] = num_mem ? offset : (size_t)-1;
+				offset += num_mem * sizeof(uint64_t);
+				if (x == 1024 || id == trace->internal->num_insns)
+				{
+					fwrite(write_buffer, sizeof(size_t), x, memrefs_offsets);
+					x = 0;
+				}
+			}
+			fclose(memrefs_offsets);
+			trace->memrefs_offsets = fopen(path, "rb");
+			return;
+		}
+
+		rewind(trace->memrefs);
+		do {
+			read_size = fread(buffer, sizeof(memref_t), 1024, trace->memrefs);
+			int x;
+			for (x=0; x<read_size; x++)
 			{
 				if (buffer[x].length)
 				{
@@ -282,67 +1230,80 @@ void load_memrefs_offsets(char *dir_path, peekaboo_trace_t *trace)
 
 }
 
-void load_trace(char *dir_path, peekaboo_trace_t *trace_ptr)
+// Takes over what the metadata says about the trace
+static void load_metadata(peekaboo_internal_t *internal, const metadata_hdr_t *meta)
 {
-	char path[MAX_PATH];
-
-	// Load metadata first
-	snprintf(path, MAX_PATH, "%s/%s", dir_path, "metafile");
-	trace_ptr->metafile = fopen(path, "rb");
-	if (trace_ptr->metafile == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
-
-	// Creates the internal data-structure to store the
-	// meta-information about the loaded trace
-	trace_ptr->internal = malloc(sizeof(peekaboo_internal_t));
-	memset(trace_ptr->internal, 0, sizeof(peekaboo_internal_t));
-
-	// Setup the information
-	metadata_hdr_t meta;
-	size_t fread_bytes = fread(&meta, sizeof(metadata_hdr_t), 1, trace_ptr->metafile);
-	trace_ptr->internal->arch = meta.arch;
-	trace_ptr->internal->version = meta.version;
-	fprintf(stderr, "Trace's libpeekaboo version: %d\n", meta.version);
-	fclose(trace_ptr->metafile);
+	internal->arch = meta->arch;
+	internal->version = meta->version;
+	internal->flags = meta->flags;
+	internal->keyframe_interval = meta->keyframe_interval;
+	fprintf(stderr, "Trace's libpeekaboo version: %d\n", meta->version);
 
-	if (trace_ptr->internal->version >= 4)
+	if (internal->version >= 4)
 	{
 		// New trace format that can customize which registers to store
-		if (trace_ptr->internal->arch == ARCH_AMD64)
+		if (internal->arch == ARCH_AMD64)
 		{
-			trace_ptr->internal->storage_options.amd64.has_simd = meta.storage_options.amd64.has_simd;
-			trace_ptr->internal->storage_options.amd64.has_fxsave = meta.storage_options.amd64.has_fxsave;
+			internal->storage_options.amd64.has_simd = meta->storage_options.amd64.has_simd;
+			internal->storage_options.amd64.has_fxsave = meta->storage_options.amd64.has_fxsave;
 			fprintf(stderr, "Stored register: GPRs ");
-			if (trace_ptr->internal->storage_options.amd64.has_simd) fprintf(stderr, "SIMD ");
-			if (trace_ptr->internal->storage_options.amd64.has_fxsave) fprintf(stderr, "FXSAVE ");
+			if (internal->storage_options.amd64.has_simd) fprintf(stderr, "SIMD ");
+			if (internal->storage_options.amd64.has_fxsave) fprintf(stderr, "FXSAVE ");
 			fprintf(stderr, "\n");
 		}
 	}
 	else
 	{
 		// Trace version lower than 003, stores everything
-		trace_ptr->internal->storage_options.amd64.has_simd = 1;
-		trace_ptr->internal->storage_options.amd64.has_fxsave = 1;
+		internal->storage_options.amd64.has_simd = 1;
+		internal->storage_options.amd64.has_fxsave = 1;
 	}
 
-	switch (meta.arch)
+	switch (meta->arch)
 	{
 		case ARCH_AMD64:
-			trace_ptr->internal->ptr_size = 8;
-			trace_ptr->internal->regfile_size = sizeof(regfile_amd64_t);
+			internal->ptr_size = 8;
+			amd64_regfile_layout(&internal->storage_options.amd64, &internal->regfile_layout);
+			internal->regfile_size = internal->regfile_layout.size;
+			if (meta->regfile_size && meta->regfile_size != internal->regfile_size)
+				PEEKABOO_DIE("libpeekaboo: Regfile records are %u bytes, but the stored registers make %lu!\n", meta->regfile_size, internal->regfile_size);
 			break;
 		case ARCH_AARCH64:
-			trace_ptr->internal->ptr_size = 8;
-			trace_ptr->internal->regfile_size = sizeof(regfile_aarch64_t);
+			internal->ptr_size = 8;
+			internal->regfile_size = sizeof(regfile_aarch64_t);
 			break;
 		case ARCH_X86:
-			trace_ptr->internal->ptr_size = 4;
-			trace_ptr->internal->regfile_size = sizeof(regfile_x86_t);
+			internal->ptr_size = 4;
+			internal->regfile_size = sizeof(regfile_x86_t);
 			break;
 		default:
-			trace_ptr->internal->ptr_size = 0;
-			trace_ptr->internal->regfile_size = 0;
+			internal->ptr_size = 0;
+			internal->regfile_size = 0;
 			break;
 	}
+}
+
+void load_trace(char *dir_path, peekaboo_trace_t *trace_ptr)
+{
+	char path[MAX_PATH];
+
+	// Load metadata first
+	snprintf(path, MAX_PATH, "%s/%s", dir_path, "metafile");
+	trace_ptr->metafile = fopen(path, "rb");
+	if (trace_ptr->metafile == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+
+	// Creates the internal data-structure to store the
+	// meta-information about the loaded trace
+	trace_ptr->internal = malloc(sizeof(peekaboo_internal_t));
+	memset(trace_ptr->internal, 0, sizeof(peekaboo_internal_t));
+
+	// Setup the information
+	// Older versions have a shorter header. Fields they don't have stay zero.
+	metadata_hdr_t meta;
+	memset(&meta, 0, sizeof(metadata_hdr_t));
+	size_t fread_bytes = fread(&meta, 1, sizeof(metadata_hdr_t), trace_ptr->metafile);
+	fclose(trace_ptr->metafile);
+	load_metadata(trace_ptr->internal, &meta);
 
 	// Load bytes_map based on the version
 	if (meta.version > 1)
@@ -352,21 +1313,89 @@ void load_trace(char *dir_path, peekaboo_trace_t *trace_ptr)
 		snprintf(path, MAX_PATH, "%s/%s", dir_path, "insn.bytemap");
 	trace_ptr->bytes_map = fopen(path, "rb");
 	if (trace_ptr->bytes_map == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load bytes_map\n");
-
-	// Load insn.trace, regfile, memfile, memrefs.
+	if (meta.version > 1) load_modules(dir_path, trace_ptr);
+	if ((trace_ptr->internal->flags & META_FLAG_MODULE_PCS) && !trace_ptr->internal->num_modules)
+		PEEKABOO_DIE("libpeekaboo: The trace has module pcs, but no modules.\n");
+
+	// Load insn.trace, regfile, memfile, memrefs. A stream in parts reads like one file.
+	bool compressed = trace_ptr->internal->flags & META_FLAG_COMPRESSED;
+	part_t *manifest = NULL;
+	size_t manifest_size = 0;
+	if (trace_ptr->internal->flags & META_FLAG_PARTS) manifest = load_manifest(dir_path, trace_ptr, &manifest_size);
 	snprintf(path, MAX_PATH, "%s/%s", dir_path, "insn.trace");
-	trace_ptr->insn_trace = fopen(path, "rb");
+	trace_ptr->insn_trace = open_parts(path, PART_INSN_TRACE, compressed, manifest, manifest_size);
 	if (trace_ptr->insn_trace == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
 	snprintf(path, MAX_PATH, "%s/%s", dir_path, "regfile");
-	trace_ptr->regfile = fopen(path, "rb");
+	trace_ptr->regfile = open_parts(path, PART_REGFILE, compressed, manifest, manifest_size);
 	if (trace_ptr->regfile == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
 	snprintf(path, MAX_PATH, "%s/%s", dir_path, "memfile");
-	trace_ptr->memfile = fopen(path, "rb");
+	trace_ptr->memfile = open_parts(path, PART_MEMFILE, compressed, manifest, manifest_size);
 	if (trace_ptr->memfile == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
 	snprintf(path, MAX_PATH, "%s/%s", dir_path, "memrefs");
-	trace_ptr->memrefs = fopen(path, "rb");
+	trace_ptr->memrefs = open_parts(path, PART_MEMREFS, compressed, manifest, manifest_size);
 	if (trace_ptr->memrefs == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
 
+	// Optional streams
+	trace_ptr->regfile_keyidx = NULL;
+	if (trace_ptr->internal->flags & META_FLAG_REGFILE_DELTA)
+	{
+		if (!trace_ptr->internal->keyframe_interval) PEEKABOO_DIE("libpeekaboo: Delta encoded regfile without keyframes!\n");
+		snprintf(path, MAX_PATH, "%s/%s", dir_path, "regfile.keyidx");
+		trace_ptr->regfile_keyidx = fopen(path, "rb");
+		if (trace_ptr->regfile_keyidx == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+		trace_ptr->internal->regfile_cache = malloc(trace_ptr->internal->regfile_size);
+		trace_ptr->internal->regfile_cache_id = 0;
+	}
+	trace_ptr->regderef = NULL;
+	if (trace_ptr->internal->flags & META_FLAG_REGDEREF)
+	{
+		snprintf(path, MAX_PATH, "%s/%s", dir_path, "regderef");
+		trace_ptr->regderef = fopen(path, "rb");
+		if (trace_ptr->regderef == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+	}
+	trace_ptr->memfile_ext = NULL;
+	if (trace_ptr->internal->flags & META_FLAG_MEMVAL)
+	{
+		snprintf(path, MAX_PATH, "%s/%s", dir_path, "memfile.ext");
+		trace_ptr->memfile_ext = fopen(path, "rb");
+		if (trace_ptr->memfile_ext == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+	}
+	trace_ptr->segments = NULL;
+	if (trace_ptr->internal->flags & META_FLAG_SEGMENTS)
+	{
+		snprintf(path, MAX_PATH, "%s/%s", dir_path, "segments");
+		trace_ptr->segments = fopen(path, "rb");
+		if (trace_ptr->segments == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+		load_segments(trace_ptr);
+	}
+	trace_ptr->syscalls = NULL;
+	if (trace_ptr->internal->flags & META_FLAG_SYSCALLS)
+	{
+		snprintf(path, MAX_PATH, "%s/%s", dir_path, "syscalls");
+		trace_ptr->syscalls = fopen(path, "rb");
+		if (trace_ptr->syscalls == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+		load_syscalls(trace_ptr);
+	}
+	trace_ptr->order = NULL;
+	if (trace_ptr->internal->flags & META_FLAG_ORDER)
+	{
+		snprintf(path, MAX_PATH, "%s/%s", dir_path, "order");
+		trace_ptr->order = fopen(path, "rb");
+		if (trace_ptr->order == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+		load_order(trace_ptr);
+	}
+	if (trace_ptr->internal->flags & META_FLAG_BB_COUNTS) load_bb_counts(dir_path, trace_ptr);
+	if (trace_ptr->internal->flags & META_FLAG_MEMDESC) load_memdescs(dir_path, trace_ptr);
+	trace_ptr->memaddrs = NULL;
+	if (trace_ptr->internal->flags & META_FLAG_MEMADDRS)
+	{
+		snprintf(path, MAX_PATH, "%s/%s", dir_path, "memaddrs");
+		trace_ptr->memaddrs = open_parts(path, PART_MEMADDRS, compressed, manifest, manifest_size);
+		if (trace_ptr->memaddrs == NULL) PEEKABOO_DIE("libpeekaboo: Unable to load %s\n", path);
+		trace_ptr->internal->memaddr_buf = malloc(sizeof(memaddr_t) * MEMADDR_BUF_LEN);
+	}
+	free(manifest);
+
 	// Init for internal structure
 	size_t trace_size = 0;
 	size_t ptr_size = trace_ptr->internal->ptr_size;
@@ -378,45 +1407,400 @@ void load_trace(char *dir_path, peekaboo_trace_t *trace_ptr)
 	// loads the rawbytes map for the trace
 	load_bytes_map(trace_ptr);
 
-	// load memrefs_offsets. Create if not exist 
-	load_memrefs_offsets(dir_path, trace_ptr);
+	// insn.trace of a basic block trace has blocks, not instructions
+	if (trace_ptr->internal->flags & META_FLAG_BB_TRACE) load_bb_trace(dir_path, trace_ptr);
+	// ...and of a control flow trace, transfers
+	if (trace_ptr->internal->flags & META_FLAG_BRANCH_TRACE) load_branch_trace(dir_path, trace_ptr);
+
+	// load memrefs_offsets. Create if not exist. A control flow trace has no memory operands.
+	trace_ptr->memrefs_offsets = NULL;
+	if (!(trace_ptr->internal->flags & META_FLAG_BRANCH_TRACE)) load_memrefs_offsets(dir_path, trace_ptr);
 
 	// All good. Ready to go~!
 	return ;
 }
 
+/* Live traces.
+ * load_live_trace() follows one thread of a ring the tracer writes with -live.
+ * The messages of the thread are queued per stream until every part of its
+ * next instruction is there. Then the instruction is decoded into the
+ * history, which keeps the last LIVE_HISTORY instructions for
+ * get_peekaboo_insn(). An instruction that lost a part to LIVE_POLICY_DROP is
+ * skipped; the ids of the others stay contiguous.
+ */
+#define LIVE_HISTORY 1024
+#define LIVE_UNSORTED_MAX 1024	/* New bytes_map_t searched one by one before they are sorted in */
+#define LIVE_POLL_US 1000
+
+struct live_chunk {
+	struct live_chunk *next;
+	uint64_t first;		/* Record number of the first record */
+	uint64_t num;		/* Records in data */
+	uint64_t aux;		/* live_msg_t.aux */
+	uint8_t data[];
+};
+
+struct live_queue {
+	struct live_chunk *head, *tail;
+	size_t record_size;
+};
+
+struct live_trace {
+	live_ring_t ring;
+	uint32_t tid;
+	bool exited;		/* The thread's LIVE_STREAM_EXIT is in */
+	struct live_queue queues[LIVE_NUM_STREAMS];
+	void *payload;
+	size_t payload_size;
+	size_t bytes_map_capacity;
+	size_t num_sorted;	/* bytes_map_buf is sorted up to here. New ones are appended. */
+
+	uint64_t next_record;	/* Next insn, regfile and memrefs record to decode */
+	uint64_t memrefs_chunk;	/* First record of the memrefs chunk memfile_pos is in */
+	uint64_t memrefs_pos;	/* memfile_pos is the first memfile_t of this memrefs record */
+	uint64_t memfile_pos;
+	size_t num_lost;
+
+	peekaboo_insn_t history[LIVE_HISTORY];	/* Instruction id is in history[id % LIVE_HISTORY] */
+};
+
+static void live_queue_push(struct live_queue *queue, const live_msg_t *msg, const void *payload)
+{
+	struct live_chunk *chunk = malloc(sizeof(struct live_chunk) + msg->size);
+	if (!chunk) PEEKABOO_DIE("libpeekaboo: Out of memory for the live trace!\n");
+	chunk->next = NULL;
+	chunk->first = msg->offset / queue->record_size;
+	chunk->num = msg->size / queue->record_size;
+	chunk->aux = msg->aux;
+	memcpy(chunk->data, payload, msg->size);
+	if (queue->tail) queue->tail->next = chunk;
+	else queue->head = chunk;
+	queue->tail = chunk;
+}
+
+/* Finds record r, dropping the records before it. Returns NULL if it is not
+ * there yet, or, setting *lost, if it never will be.
+ */
+static struct live_chunk *live_queue_get(struct live_queue *queue, uint64_t r, bool *lost)
+{
+	while (queue->head && queue->head->first + queue->head->num <= r)
+	{
+		struct live_chunk *chunk = queue->head;
+		queue->head = chunk->next;
+		if (!queue->head) queue->tail = NULL;
+		free(chunk);
+	}
+	if (queue->head && queue->head->first > r) *lost = true;
+	if (!queue->head || queue->head->first > r) return NULL;
+	return queue->head;
+}
+
+#define LIVE_RECORD(chunk, r, size) ((chunk)->data + ((r) - (chunk)->first) * (size))
+
+// Instructions are shared by all threads
+static void live_add_bytes_map(peekaboo_trace_t *trace, const void *payload, size_t size)
+{
+	struct live_trace *live = trace->internal->live;
+	size_t num_maps = trace->internal->bytes_map_size / sizeof(bytes_map_t);
+	size_t new_maps = size / sizeof(bytes_map_t);
+	if (num_maps + new_maps > live->bytes_map_capacity)
+	{
+		live->bytes_map_capacity = (num_maps + new_maps) * 2;
+		trace->internal->bytes_map_buf = realloc(trace->internal->bytes_map_buf, live->bytes_map_capacity * sizeof(bytes_map_t));
+		if (!trace->internal->bytes_map_buf) PEEKABOO_DIE("libpeekaboo: Out of memory for the live trace!\n");
+	}
+	memcpy(trace->internal->bytes_map_buf + num_maps, payload, new_maps * sizeof(bytes_map_t));
+	trace->internal->bytes_map_size += new_maps * sizeof(bytes_map_t);
+}
+
+// Reads what the ring has. Returns false if nothing more will come for the thread.
+static bool live_pump(peekaboo_trace_t *trace)
+{
+	struct live_trace *live = trace->internal->live;
+	live_msg_t msg;
+	bool got = false;
+
+	while (live_ring_read(&live->ring, &msg, &live->payload, &live->payload_size))
+	{
+		got = true;
+		if (msg.stream == LIVE_STREAM_BYTEMAP)
+		{
+			live_add_bytes_map(trace, live->payload, msg.size);
+			continue;
+		}
+		if (msg.tid != live->tid) continue;
+		if (msg.stream == LIVE_STREAM_EXIT)
+			live->exited = true;
+		else if (msg.stream != LIVE_STREAM_META && msg.stream < LIVE_NUM_STREAMS && live->queues[msg.stream].record_size)
+			live_queue_push(&live->queues[msg.stream], &msg, live->payload);
+	}
+	if (got) return true;
+	if (live->exited || live_ring_closed(&live->ring)) return false;
+	usleep(LIVE_POLL_US);
+	return true;
+}
+
+// Looks in the sorted part, then in the new ones. Sorts them in once there are enough.
+static bytes_map_t *live_find_bytes_map(uint64_t pc, peekaboo_trace_t *trace)
+{
+	struct live_trace *live = trace->internal->live;
+	bytes_map_t *bytes_map_buf = trace->internal->bytes_map_buf;
+	size_t x, num_maps = trace->internal->bytes_map_size / sizeof(bytes_map_t);
+	bytes_map_t key;
+
+	if (num_maps - live->num_sorted > LIVE_UNSORTED_MAX)
+	{
+		size_t num_unique = 0;
+		qsort(bytes_map_buf, num_maps, sizeof(bytes_map_t), compare_bytes_map);
+		for (x=0; x<num_maps; x++)
+			if (num_unique == 0 || bytes_map_buf[x].pc != bytes_map_buf[num_unique-1].pc)
+				bytes_map_buf[num_unique++] = bytes_map_buf[x];
+		trace->internal->bytes_map_size = num_unique * sizeof(bytes_map_t);
+		live->num_sorted = num_maps = num_unique;
+	}
+	key.pc = pc;
+	bytes_map_t *found = bsearch(&key, bytes_map_buf, live->num_sorted, sizeof(bytes_map_t), compare_bytes_map);
+	for (x=live->num_sorted; !found && x<num_maps; x++)
+		if (bytes_map_buf[x].pc == pc) found = &bytes_map_buf[x];
+	return found;
+}
+
+// Decodes the next complete instruction into the history. Returns false at the end of the thread.
+static bool live_decode_next(peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	struct live_trace *live = internal->live;
+	struct live_queue *queues = live->queues;
+
+	for (;;)
+	{
+		uint64_t r = live->next_record;
+		bool lost = false;
+		struct live_chunk *insn_chunk = live_queue_get(&queues[LIVE_STREAM_INSN], r, &lost);
+		struct live_chunk *regfile_chunk = live_queue_get(&queues[LIVE_STREAM_REGFILE], r, &lost);
+		struct live_chunk *memrefs_chunk = live_queue_get(&queues[LIVE_STREAM_MEMREFS], r, &lost);
+		if (lost)
+		{
+			live->num_lost++;
+			live->next_record++;
+			continue;
+		}
+		if (!insn_chunk || !regfile_chunk || !memrefs_chunk)
+		{
+			if (!live_pump(trace)) return false;
+			continue;
+		}
+
+		// The first memfile_t of record r, counted from the start of its memrefs chunk
+		if (live->memrefs_chunk != memrefs_chunk->first || live->memrefs_pos > r)
+		{
+			live->memrefs_chunk = memrefs_chunk->first;
+			live->memrefs_pos = memrefs_chunk->first;
+			live->memfile_pos = memrefs_chunk->aux;
+		}
+		for (; live->memrefs_pos < r; live->memrefs_pos++)
+			live->memfile_pos += ((memref_t *)LIVE_RECORD(memrefs_chunk, live->memrefs_pos, sizeof(memref_t)))->length;
+
+		insn_ref_t *insn_ref = (insn_ref_t *)LIVE_RECORD(insn_chunk, r, sizeof(insn_ref_t));
+		uint32_t num_mem = ((memref_t *)LIVE_RECORD(memrefs_chunk, r, sizeof(memref_t)))->length;
+		uint64_t pc = internal->ptr_size == 4 ? (uint32_t)insn_ref->pc : insn_ref->pc;
+		if (num_mem > 8) PEEKABOO_DIE("libpeekaboo: Error. Instruction at 0x%"PRIx64" has more than 8 memory ops. Terminated!\n", pc);
+
+		peekaboo_insn_t *insn = &live->history[(internal->num_insns + 1) % LIVE_HISTORY];
+		uint32_t idx;
+		for (idx=0; idx<num_mem; idx++)
+		{
+			struct live_chunk *memfile_chunk = live_queue_get(&queues[LIVE_STREAM_MEMFILE], live->memfile_pos + idx, &lost);
+			if (!memfile_chunk) break;
+			memcpy(&insn->mem[idx], LIVE_RECORD(memfile_chunk, live->memfile_pos + idx, sizeof(memfile_t)), sizeof(memfile_t));
+		}
+		if (lost)
+		{
+			live->num_lost++;
+			live->next_record++;
+			continue;
+		}
+		bytes_map_t *bytes_map = idx == num_mem ? live_find_bytes_map(pc, trace) : NULL;
+		if (!bytes_map)
+		{
+			if (!live_pump(trace))
+			{
+				if (idx == num_mem) PEEKABOO_DIE("libpeekaboo: Error. Cannot find instruction at 0x%"PRIx64" in the live bytes_map. Terminated!\n", pc);
+				return false;
+			}
+			continue;
+		}
+
+		insn->addr = pc;
+		insn->size = bytes_map->size;
+		memcpy(insn->rawbytes, bytes_map->rawbytes, 16);
+		insn->num_mem = num_mem;
+		uint8_t *record = LIVE_RECORD(regfile_chunk, r, internal->regfile_size);
+		if (internal->arch == ARCH_AMD64)
+			amd64_regfile_unpack(&internal->regfile_layout, record, insn->regfile);
+		else
+			memcpy(insn->regfile, record, internal->regfile_size);
+
+		live->next_record++;
+		internal->num_insns++;
+		return true;
+	}
+}
+
+// Copy of instruction id from the history, decoding up to it first
+static peekaboo_insn_t *live_get_insn(const size_t id, peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	struct live_trace *live = internal->live;
+	size_t regfile_size = internal->arch == ARCH_AMD64 ? sizeof(regfile_amd64_t) : internal->regfile_size;
+
+	while (internal->num_insns < id)
+		if (!live_decode_next(trace)) PEEKABOO_DIE("libpeekaboo: Instruction %lu is past the end of the live trace!\n", id);
+	if (id == 0 || id + LIVE_HISTORY <= internal->num_insns)
+		PEEKABOO_DIE("libpeekaboo: Instruction %lu is not in the live history any more!\n", id);
+
+	peekaboo_insn_t *insn = malloc(sizeof(peekaboo_insn_t));
+	memcpy(insn, &live->history[id % LIVE_HISTORY], sizeof(peekaboo_insn_t));
+	insn->regfile = malloc(regfile_size);
+	memcpy(insn->regfile, live->history[id % LIVE_HISTORY].regfile, regfile_size);
+	return insn;
+}
+
+void load_live_trace(char *path, uint32_t tid, peekaboo_trace_t *trace_ptr)
+{
+	memset(trace_ptr, 0, sizeof(peekaboo_trace_t));
+	trace_ptr->internal = malloc(sizeof(peekaboo_internal_t));
+	memset(trace_ptr->internal, 0, sizeof(peekaboo_internal_t));
+	struct live_trace *live = malloc(sizeof(struct live_trace));
+	if (!live) PEEKABOO_DIE("libpeekaboo: Out of memory for the live trace!\n");
+	memset(live, 0, sizeof(struct live_trace));
+	trace_ptr->internal->live = live;
+	if (live_ring_open(path, &live->ring)) PEEKABOO_DIE("libpeekaboo: %s is not a live trace\n", path);
+
+	// Wait for the metadata of the thread, or of the first one if tid is 0
+	live_msg_t msg;
+	for (;;)
+	{
+		if (!live_ring_read(&live->ring, &msg, &live->payload, &live->payload_size))
+		{
+			if (live_ring_closed(&live->ring)) PEEKABOO_DIE("libpeekaboo: The live trace ended before thread %u started\n", tid);
+			usleep(LIVE_POLL_US);
+			continue;
+		}
+		if (msg.stream == LIVE_STREAM_BYTEMAP) live_add_bytes_map(trace_ptr, live->payload, msg.size);
+		if (msg.stream == LIVE_STREAM_META && (tid == 0 || msg.tid == tid)) break;
+	}
+	live->tid = msg.tid;
+	metadata_hdr_t meta;
+	memset(&meta, 0, sizeof(metadata_hdr_t));
+	memcpy(&meta, live->payload, msg.size < sizeof(metadata_hdr_t) ? msg.size : sizeof(metadata_hdr_t));
+	load_metadata(trace_ptr->internal, &meta);
+	fprintf(stderr, "Following thread %u of the live trace\n", live->tid);
+
+	live->queues[LIVE_STREAM_INSN].record_size = sizeof(insn_ref_t);
+	live->queues[LIVE_STREAM_REGFILE].record_size = trace_ptr->internal->regfile_size;
+	live->queues[LIVE_STREAM_MEMREFS].record_size = sizeof(memref_t);
+	live->queues[LIVE_STREAM_MEMFILE].record_size = sizeof(memfile_t);
+	live->memrefs_chunk = ~0ULL;
+	size_t x, regfile_size = meta.arch == ARCH_AMD64 ? sizeof(regfile_amd64_t) : trace_ptr->internal->regfile_size;
+	for (x=0; x<LIVE_HISTORY; x++)
+	{
+		live->history[x].arch = meta.arch;
+		live->history[x].regfile = calloc(1, regfile_size);
+	}
+}
+
+bool has_insn(peekaboo_trace_t *trace, size_t id)
+{
+	if (trace->internal->live)
+		while (trace->internal->num_insns < id)
+			if (!live_decode_next(trace)) break;
+	return id >= 1 && id <= trace->internal->num_insns;
+}
+
+static void free_live_trace(peekaboo_trace_t *trace_ptr)
+{
+	struct live_trace *live = trace_ptr->internal->live;
+	size_t x;
+	if (live->num_lost) fprintf(stderr, "libpeekaboo: %lu instructions of the live trace were dropped by the tracer\n", live->num_lost);
+	for (x=0; x<LIVE_NUM_STREAMS; x++)
+	{
+		struct live_chunk *chunk = live->queues[x].head;
+		while (chunk)
+		{
+			struct live_chunk *next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+	}
+	for (x=0; x<LIVE_HISTORY; x++) free(live->history[x].regfile);
+	live_ring_unmap(&live->ring);
+	free(live->payload);
+	free(live);
+	free(trace_ptr->internal->bytes_map_buf);
+	free(trace_ptr->internal);
+	free(trace_ptr);
+}
+
 void free_peekaboo_trace(peekaboo_trace_t *trace_ptr)
 {
+	if (trace_ptr->internal->live)
+	{
+		free_live_trace(trace_ptr);
+		return;
+	}
 	fclose(trace_ptr->bytes_map);
 	fclose(trace_ptr->insn_trace);
 	fclose(trace_ptr->regfile);
 	fclose(trace_ptr->memfile);
 	fclose(trace_ptr->memrefs);
 	if (trace_ptr->memrefs_offsets)	fclose(trace_ptr->memrefs_offsets);
+	if (trace_ptr->regderef) fclose(trace_ptr->regderef);
+	if (trace_ptr->memfile_ext) fclose(trace_ptr->memfile_ext);
+	if (trace_ptr->regfile_keyidx) fclose(trace_ptr->regfile_keyidx);
+	if (trace_ptr->segments) fclose(trace_ptr->segments);
+	if (trace_ptr->syscalls) fclose(trace_ptr->syscalls);
+	if (trace_ptr->memaddrs) fclose(trace_ptr->memaddrs);
+	if (trace_ptr->order) fclose(trace_ptr->order);
+	free(trace_ptr->internal->memaddr_buf);
+	free(trace_ptr->internal->parts);
+	free(trace_ptr->internal->segments);
+	free(trace_ptr->internal->syscalls);
+	free(trace_ptr->internal->orders);
+	free(trace_ptr->internal->bb_counts);
+	free(trace_ptr->internal->memdescs);
+	free(trace_ptr->internal->modules);
+	free(trace_ptr->internal->regfile_cache);
+	free(trace_ptr->internal->bb_table);
+	free(trace_ptr->internal->bb_index);
+	free(trace_ptr->internal->branch_table);
+	free(trace_ptr->internal->branch_index);
+	free(trace_ptr->internal->branch_refs);
 	free(trace_ptr->internal->bytes_map_buf);
 	free(trace_ptr->internal);
 	free(trace_ptr);
 }
 
-void write_metadata(peekaboo_trace_t *trace_ptr, enum ARCH arch, uint32_t version)
+// Fills in the arch, version and storage options. Optional fields are zeroed for the tracer to set.
+void init_metadata(metadata_hdr_t *metadata, enum ARCH arch, uint32_t version)
 {
-	metadata_hdr_t metadata;
-	metadata.arch = arch;
-	metadata.version = version;
+	memset(metadata, 0, sizeof(metadata_hdr_t));
+	metadata->arch = arch;
+	metadata->version = version;
 	if (arch == ARCH_AMD64)
 	{
-		#ifdef _STORE_SIMD
-			metadata.storage_options.amd64.has_simd = 1;
-		#else
-			metadata.storage_options.amd64.has_simd = 0;
-		#endif
-		#ifdef _STORE_FXSAVE
-			metadata.storage_options.amd64.has_fxsave = 1;
-		#else
-			metadata.storage_options.amd64.has_fxsave = 0;
-		#endif
-	}
-	fwrite(&metadata, sizeof(metadata_hdr_t), 1, trace_ptr->metafile);
+		// Everything by default. The tracer narrows it down with -regs.
+		regfile_layout_amd64_t layout;
+		metadata->storage_options.amd64.has_simd = 1;
+		metadata->storage_options.amd64.has_fxsave = 1;
+		amd64_regfile_layout(&metadata->storage_options.amd64, &layout);
+		metadata->regfile_size = layout.size;
+	}
+}
+
+void write_metadata(peekaboo_trace_t *trace_ptr, metadata_hdr_t *metadata)
+{
+	fwrite(metadata, sizeof(metadata_hdr_t), 1, trace_ptr->metafile);
 	fflush(trace_ptr->metafile);
 	fclose(trace_ptr->metafile);
 }
@@ -426,9 +1810,13 @@ void write_metadata(peekaboo_trace_t *trace_ptr, enum ARCH arch, uint32_t versio
 peekaboo_insn_t *get_peekaboo_insn(const size_t id, peekaboo_trace_t *trace)
 {
 	// insn is the peekaboo instruction record
+	if (trace->internal->live) return live_get_insn(id, trace);
 	peekaboo_insn_t *insn = malloc(sizeof(peekaboo_insn_t));
 	size_t regfile_size = get_regfile_size(trace);
-	insn->regfile = malloc(regfile_size);
+	// AMD64 records only have the stored register classes. insn->regfile always has all of them.
+	const bool unpack = trace->internal->arch == ARCH_AMD64;
+	const size_t insn_regfile_size = unpack ? sizeof(regfile_amd64_t) : regfile_size;
+	insn->regfile = malloc(insn_regfile_size);
 	insn->arch = trace->internal->arch;
 
 	
@@ -441,6 +1829,16 @@ peekaboo_insn_t *get_peekaboo_insn(const size_t id, peekaboo_trace_t *trace)
 	insn->size = bytes_map->size;
 	memcpy(insn->rawbytes, bytes_map->rawbytes, 16);
 
+	// A control flow trace has nothing but the instructions
+	if (trace->internal->flags & META_FLAG_BRANCH_TRACE)
+	{
+		insn->num_mem = 0;
+		insn->mem_ext = NULL;
+		insn->regderef = NULL;
+		memset(insn->regfile, 0, insn_regfile_size);
+		return insn;
+	}
+
 	// get the number of mem operands
 	insn->num_mem = get_num_mem(id, trace);
 	if (insn->num_mem > 8) PEEKABOO_DIE("libpeekaboo: Error. Instruction (ID:%ld) at 0x%"PRIx64" has more than 8 memory ops. Terminated!\n", id, insn->addr);
@@ -448,7 +1846,21 @@ peekaboo_insn_t *get_peekaboo_insn(const size_t id, peekaboo_trace_t *trace)
 	size_t memfile_offset;
 	size_t fread_bytes = fread(&memfile_offset, sizeof(size_t), 1, trace->memrefs_offsets);
 	errno = 0;
-	if (memfile_offset != (size_t) -1)
+	if (memfile_offset != (size_t) -1 && (trace->internal->flags & META_FLAG_MEMDESC))
+	{
+		// Only the addresses are in memfile
+		memdesc_t *memdesc = find_memdesc(insn->addr, trace);
+		fseek(trace->memfile, memfile_offset, SEEK_SET);
+		for (uint32_t idx = 0; idx<insn->num_mem; idx++)
+		{
+			memset(&insn->mem[idx], 0, sizeof(memfile_t));
+			fread_bytes = fread(&insn->mem[idx].addr, sizeof(uint64_t), 1, trace->memfile);
+			insn->mem[idx].size = memdesc->sizes[idx];
+			insn->mem[idx].status = (memdesc->writes >> idx) & 1;
+			insn->mem[idx].pc = insn->addr;
+		}
+	}
+	else if (memfile_offset != (size_t) -1)
 	{
 		fseek(trace->memfile, memfile_offset, SEEK_SET);
 		const size_t memfile_size = (trace->internal->version < 3) ? (sizeof(uint64_t) * 3) : sizeof(memfile_t);
@@ -462,9 +1874,42 @@ peekaboo_insn_t *get_peekaboo_insn(const size_t id, peekaboo_trace_t *trace)
 		}
 	}
 
+	// Wide operand values are in memfile.ext
+	insn->mem_ext = NULL;
+	if (trace->memfile_ext && memfile_offset != (size_t) -1)
+	{
+		for (uint32_t idx = 0; idx<insn->num_mem; idx++)
+		{
+			uint32_t ext_size = memfile_ext_size(insn->mem[idx].size);
+			if (!ext_size) continue;
+			if (insn->mem_ext == NULL) insn->mem_ext = calloc(8, MEMFILE_EXT_MAX_SIZE);
+			fseek(trace->memfile_ext, insn->mem[idx].value, SEEK_SET);
+			fread_bytes = fread(insn->mem_ext[idx], ext_size, 1, trace->memfile_ext);
+		}
+	}
+
 	// read the regfile...
-	fseek(trace->regfile, (id-1) * regfile_size, SEEK_SET);
-	fread_bytes = fread(insn->regfile, regfile_size, 1, trace->regfile);
+	uint8_t record[regfile_size];
+	void *regfile = unpack ? record : insn->regfile;
+	if (trace->internal->flags & META_FLAG_REGFILE_DELTA)
+	{
+		read_delta_regfile(id, trace, regfile);
+	}
+	else
+	{
+		fseek(trace->regfile, (id-1) * regfile_size, SEEK_SET);
+		fread_bytes = fread(regfile, regfile_size, 1, trace->regfile);
+	}
+	if (unpack) amd64_regfile_unpack(&trace->internal->regfile_layout, record, insn->regfile);
+
+	// ...and what its GPRs point to, if the trace has it
+	insn->regderef = NULL;
+	if (trace->regderef)
+	{
+		insn->regderef = malloc(sizeof(regderef_amd64_t));
+		fseek(trace->regderef, (id-1) * sizeof(regderef_amd64_t), SEEK_SET);
+		fread_bytes = fread(insn->regderef, sizeof(regderef_amd64_t), 1, trace->regderef);
+	}
 
 	// done! return
 	return insn;
@@ -489,6 +1934,290 @@ void regfile_pp(peekaboo_insn_t *insn)
 	}
 }
 
+void regderef_pp(peekaboo_insn_t *insn)
+{
+	if (insn->regderef == NULL) return;
+	switch (insn->arch)
+	{
+		case ARCH_AMD64:
+			amd64_regderef_pp(insn->regfile, insn->regderef);
+			break;
+		default:
+			PEEKABOO_DIE("libpeekaboo: Regderef is not supported for this architecture!\n");
+			break;
+	}
+}
+
+void *get_mem_value(peekaboo_insn_t *insn, uint32_t mem_idx, peekaboo_trace_t *trace)
+{
+	memfile_t *mem = &insn->mem[mem_idx];
+	if (!(trace->internal->flags & META_FLAG_MEMVAL)) return NULL;
+	if (mem->size <= 8) return &mem->value;
+	if (insn->mem_ext && memfile_ext_size(mem->size)) return insn->mem_ext[mem_idx];
+	return NULL;
+}
+
+size_t get_num_segments(peekaboo_trace_t *trace)
+{
+	return trace->internal->num_segments;
+}
+
+segment_t *get_segment(size_t idx, peekaboo_trace_t *trace)
+{
+	if (idx >= trace->internal->num_segments) return NULL;
+	return &trace->internal->segments[idx];
+}
+
+size_t find_segment(size_t id, peekaboo_trace_t *trace)
+{
+	segment_t *segments = trace->internal->segments;
+	size_t lo = 0, hi = trace->internal->num_segments;
+	// Last segment whose first instruction is not after id
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (segments[mid].first_insn < id)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Global order. Each thread's stamps cut its instructions into runs. A heap
+ * of the threads, keyed by the clock of the run each one is in, picks the
+ * thread whose run started first.
+ */
+struct merge_thread {
+	peekaboo_trace_t *trace;
+	uint32_t tid;
+	size_t order;		/* Stamp of the run id is in */
+	size_t id;		/* Next instruction */
+};
+
+struct peekaboo_merge {
+	struct merge_thread *threads;
+	size_t num_threads;
+	struct merge_thread **heap;
+	size_t heap_size;
+	merged_insn_t insn;
+};
+
+static uint64_t merge_clock(struct merge_thread *thread)
+{
+	peekaboo_internal_t *internal = thread->trace->internal;
+	return internal->num_orders ? internal->orders[thread->order].clock : 0;
+}
+
+static bool merge_before(struct merge_thread *a, struct merge_thread *b)
+{
+	uint64_t clock_a = merge_clock(a), clock_b = merge_clock(b);
+	return clock_a < clock_b || (clock_a == clock_b && a->tid < b->tid);
+}
+
+static void merge_sift_down(peekaboo_merge_t *merge, size_t pos)
+{
+	struct merge_thread **heap = merge->heap;
+	while (true)
+	{
+		size_t first = pos, child = 2 * pos + 1;
+		if (child < merge->heap_size && merge_before(heap[child], heap[first])) first = child;
+		if (child + 1 < merge->heap_size && merge_before(heap[child + 1], heap[first])) first = child + 1;
+		if (first == pos) return;
+		struct merge_thread *tmp = heap[pos];
+		heap[pos] = heap[first];
+		heap[first] = tmp;
+		pos = first;
+	}
+}
+
+// Moves on to the run of the thread's next instruction
+static void merge_find_run(struct merge_thread *thread)
+{
+	peekaboo_internal_t *internal = thread->trace->internal;
+	while (thread->order + 1 < internal->num_orders && internal->orders[thread->order + 1].insn <= thread->id)
+		thread->order++;
+}
+
+peekaboo_merge_t *open_merge(char *dir_path)
+{
+	char path[MAX_PATH];
+	struct dirent *entry;
+	size_t capacity = 16, x;
+
+	DIR *dir = opendir(dir_path);
+	if (dir == NULL) PEEKABOO_DIE("libpeekaboo: Unable to open %s\n", dir_path);
+	peekaboo_merge_t *merge = malloc(sizeof(peekaboo_merge_t));
+	memset(merge, 0, sizeof(peekaboo_merge_t));
+	merge->threads = malloc(capacity * sizeof(struct merge_thread));
+
+	// Every thread has a directory named after its tid
+	while ((entry = readdir(dir)) != NULL)
+	{
+		char *end;
+		uint32_t tid = strtoul(entry->d_name, &end, 10);
+		if (*end || end == entry->d_name) continue;
+		int len = snprintf(path, MAX_PATH, "%s/%s/metafile", dir_path, entry->d_name);
+		if (len >= MAX_PATH)
+			PEEKABOO_DIE("libpeekaboo: Path too long for thread %s in %s\n", entry->d_name, dir_path);
+		if (access(path, F_OK) == -1) continue;
+
+		if (merge->num_threads == capacity)
+		{
+			capacity *= 2;
+			merge->threads = realloc(merge->threads, capacity * sizeof(struct merge_thread));
+		}
+		struct merge_thread *thread = &merge->threads[merge->num_threads++];
+		path[len - strlen("/metafile")] = '\0';	// Back to the directory of the thread
+		thread->trace = malloc(sizeof(peekaboo_trace_t));
+		load_trace(path, thread->trace);
+		if (!(thread->trace->internal->flags & META_FLAG_ORDER))
+			PEEKABOO_DIE("libpeekaboo: Thread %u has no global order. Trace with -order.\n", tid);
+		thread->tid = tid;
+		thread->order = 0;
+		thread->id = 1;
+		merge_find_run(thread);
+	}
+	closedir(dir);
+	if (!merge->num_threads) PEEKABOO_DIE("libpeekaboo: No thread traces in %s\n", dir_path);
+
+	merge->heap = malloc(merge->num_threads * sizeof(struct merge_thread *));
+	for (x=0; x<merge->num_threads; x++)
+		if (get_num_insn(merge->threads[x].trace))
+			merge->heap[merge->heap_size++] = &merge->threads[x];
+	for (x=merge->heap_size/2; x-->0; )
+		merge_sift_down(merge, x);
+	fprintf(stderr, "Merging %lu threads.\n", merge->num_threads);
+	return merge;
+}
+
+merged_insn_t *next_merged_insn(peekaboo_merge_t *merge)
+{
+	if (!merge->heap_size) return NULL;
+	struct merge_thread *thread = merge->heap[0];
+	merge->insn.trace = thread->trace;
+	merge->insn.tid = thread->tid;
+	merge->insn.id = thread->id++;
+
+	if (thread->id > get_num_insn(thread->trace))
+		merge->heap[0] = merge->heap[--merge->heap_size];
+	else
+		merge_find_run(thread);
+	merge_sift_down(merge, 0);
+	return &merge->insn;
+}
+
+void close_merge(peekaboo_merge_t *merge)
+{
+	size_t x;
+	for (x=0; x<merge->num_threads; x++)
+		free_peekaboo_trace(merge->threads[x].trace);
+	free(merge->threads);
+	free(merge->heap);
+	free(merge);
+}
+
+size_t get_num_parts(peekaboo_trace_t *trace)
+{
+	return trace->internal->num_parts ? trace->internal->num_parts : 1;
+}
+
+size_t find_part(size_t id, peekaboo_trace_t *trace)
+{
+	part_t *parts = trace->internal->parts;
+	size_t lo = 0, hi = trace->internal->num_parts;
+	// A control flow trace has no instruction ids in its parts
+	if (!hi || !parts[0].first_id) return 0;
+	// Last part whose first instruction is not after id
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (parts[mid].first_id <= id)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+size_t get_num_bb_counts(peekaboo_trace_t *trace)
+{
+	return trace->internal->num_bb_counts;
+}
+
+bb_count_t *get_bb_count(size_t idx, peekaboo_trace_t *trace)
+{
+	if (idx >= trace->internal->num_bb_counts) return NULL;
+	return &trace->internal->bb_counts[idx];
+}
+
+size_t get_num_module_events(peekaboo_trace_t *trace)
+{
+	return trace->internal->num_modules;
+}
+
+module_event_t *get_module_event(size_t idx, peekaboo_trace_t *trace)
+{
+	if (idx >= trace->internal->num_modules) return NULL;
+	return &trace->internal->modules[idx];
+}
+
+module_event_t *find_module(uint32_t id, peekaboo_trace_t *trace)
+{
+	size_t x;
+	for (x=0; x<trace->internal->num_modules; x++)
+		if (trace->internal->modules[x].id == id && !(trace->internal->modules[x].flags & MODULE_EVENT_UNLOAD))
+			return &trace->internal->modules[x];
+	return NULL;
+}
+
+size_t get_num_syscalls(peekaboo_trace_t *trace)
+{
+	return trace->internal->num_syscalls;
+}
+
+syscall_t *get_syscall(size_t idx, peekaboo_trace_t *trace)
+{
+	if (idx >= trace->internal->num_syscalls) return NULL;
+	return &trace->internal->syscalls[idx];
+}
+
+mem_access_t *next_mem_access(peekaboo_trace_t *trace)
+{
+	peekaboo_internal_t *internal = trace->internal;
+	mem_access_t *access = &internal->mem_access;
+	if (!trace->memaddrs) return NULL;
+
+	for (;;)
+	{
+		if (internal->memaddr_buf_pos == internal->memaddr_buf_len)
+		{
+			internal->memaddr_buf_len = fread(internal->memaddr_buf, sizeof(memaddr_t), MEMADDR_BUF_LEN, trace->memaddrs);
+			internal->memaddr_buf_pos = 0;
+			if (internal->memaddr_buf_len == 0) return NULL;
+		}
+		memaddr_t *memaddr = &internal->memaddr_buf[internal->memaddr_buf_pos++];
+		if (memaddr->info & MEMADDR_PC)
+		{
+			access->pc = memaddr->addr;
+			continue;
+		}
+		access->pc += memaddr->pc_delta;
+		access->addr = memaddr->addr;
+		access->size = (memaddr->info & MEMADDR_SIZE_MASK) + 1;
+		access->write = (memaddr->info & MEMADDR_WRITE) ? 1 : 0;
+		return access;
+	}
+}
+
+void rewind_mem_access(peekaboo_trace_t *trace)
+{
+	if (!trace->memaddrs) return;
+	rewind(trace->memaddrs);
+	trace->internal->memaddr_buf_len = 0;
+	trace->internal->memaddr_buf_pos = 0;
+	memset(&trace->internal->mem_access, 0, sizeof(mem_access_t));
+}
 
 // Free peekaboo insn ptr. Must be called after get_peekaboo_insn().
 void free_peekaboo_insn(peekaboo_insn_t *insn_ptr)
@@ -500,6 +2229,12 @@ void free_peekaboo_insn(peekaboo_insn_t *insn_ptr)
 			free(insn_ptr->regfile);
 			insn_ptr->regfile = NULL;
 		}
+		if (insn_ptr->regderef != NULL)
+		{
+			free(insn_ptr->regderef);
+			insn_ptr->regderef = NULL;
+		}
+		free(insn_ptr->mem_ext);
 		free(insn_ptr);
 		insn_ptr = NULL;
 	}
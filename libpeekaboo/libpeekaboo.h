@@ -25,7 +25,7 @@
 
 
 #define MAX_PATH (256)
-#define LIBPEEKABOO_VER 004
+#define LIBPEEKABOO_VER 005
 
 #define PEEKABOO_DIE(...) {fprintf(stderr, __VA_ARGS__); exit(1);}
 
@@ -48,16 +48,212 @@ typedef union {
 	uint64_t size;
 }storage_options_t;
 
+/* Bits of metadata_hdr_t.flags. Each marks an optional stream or property of the trace. */
+#define META_FLAG_REGDEREF	(1 << 0)	/* regderef, see regderef_amd64_t */
+#define META_FLAG_REGFILE_DELTA	(1 << 1)	/* regfile is delta encoded, see regfile_delta_encode() */
+#define META_FLAG_BB_TRACE	(1 << 2)	/* insn.trace holds bb_ref_t per basic block instead of insn_ref_t */
+#define META_FLAG_MEMVAL	(1 << 3)	/* memfile_t.value holds real values, see memfile_ext_size() */
+#define META_FLAG_SEGMENTS	(1 << 4)	/* segments, see segment_t */
+#define META_FLAG_COMPRESSED	(1 << 5)	/* insn.trace, regfile, memrefs and memfile are compressed, see compress.h */
+#define META_FLAG_ALIGNED	(1 << 6)	/* All streams start at the first instruction, also in a forked child */
+#define META_FLAG_SYSCALLS	(1 << 7)	/* syscalls, see syscall_t */
+#define META_FLAG_BRANCH_TRACE	(1 << 8)	/* insn.trace holds branch_ref_t per control transfer instead of insn_ref_t */
+#define META_FLAG_MEMADDRS	(1 << 9)	/* memaddrs, see memaddr_t */
+#define META_FLAG_PARTS		(1 << 10)	/* The streams are split into files listed in manifest, see part_t */
+#define META_FLAG_ORDER		(1 << 11)	/* order, see order_t */
+#define META_FLAG_MODULE_PCS	(1 << 12)	/* pcs inside modules are module pcs, see MODULE_PC() */
+#define META_FLAG_BB_COUNTS	(1 << 13)	/* Nothing but the block profile in bbcounts, see bb_count_t */
+#define META_FLAG_MEMDESC	(1 << 14)	/* memfile only has addresses, the rest is in insn.memdesc, see memdesc_t */
+
 typedef struct {
 	uint32_t arch;
 	uint32_t version;
 	storage_options_t storage_options;
+	/* Since version 5 */
+	uint32_t flags;
+	uint32_t keyframe_interval;	/* Regfile keyframe every this many instructions, if delta encoded */
+	uint32_t regfile_size;		/* Bytes per regfile record, see amd64_regfile_layout(). 0 in older traces */
 } metadata_hdr_t;
 
 typedef struct insn_ref {
 	uint64_t pc;
 } insn_ref_t;
 
+/* Basic block trace (META_FLAG_BB_TRACE). insn.trace has one bb_ref_t per
+ * executed block. If a block did not run to its end, e.g. it faulted, the next
+ * bb_ref_t is an early exit marker with the number of its instructions that
+ * did execute.
+ */
+#define BB_REF_EARLY_EXIT 0x80000000
+typedef struct {
+	uint32_t id;		/* Index into insn.bbtable, or BB_REF_EARLY_EXIT | executed instructions */
+} bb_ref_t;
+
+/* Sampled trace (META_FLAG_SEGMENTS). The trace is made of windows with
+ * untraced instructions in between. segments has one segment_t per window. A
+ * window runs up to the first instruction of the next one.
+ */
+typedef struct {
+	uint64_t first_insn;	/* Instructions traced before the window. Its first instruction has id first_insn + 1. */
+	uint64_t global_insn;	/* Instructions run by the process, traced or not, before the window */
+} segment_t;
+
+/* System call trace (META_FLAG_SYSCALLS). syscalls has one syscall_t per
+ * system call of the thread, in order.
+ */
+typedef struct {
+	uint64_t num;		/* System call number */
+	uint64_t args[6];	/* Arguments in the order of the calling convention, e.g. rdi, rsi, rdx, r10, r8, r9 on AMD64 */
+	uint64_t ret;		/* Return value */
+	uint64_t insn_idx;	/* Id the syscall instruction would have in a full trace of the thread */
+	uint32_t tid;
+	uint32_t returned;	/* 0 if the call never returned, e.g. exit */
+} syscall_t;
+
+/* Global order (META_FLAG_ORDER). order has one order_t per stamp the
+ * thread took: when it started, at every flush of insn.trace, and before each
+ * system call and locked instruction. clock is shared by all threads of the
+ * process and its forked children, so the instructions after a stamp ran
+ * after everything other threads did before smaller clocks, give or take the
+ * instruction the stamp is for: it runs after the stamp, and another thread
+ * may stamp and run its own in between.
+ */
+typedef struct {
+	uint64_t insn;		/* Id of the first instruction after the stamp */
+	uint64_t clock;
+} order_t;
+/* Memory address trace (META_FLAG_MEMADDRS). memaddrs has one memaddr_t per
+ * memory access and nothing is recorded per instruction. The pc of an access
+ * is the pc of the record before it plus pc_delta. A MEMADDR_PC record has a
+ * pc in addr instead of an access; one starts every basic block.
+ */
+#define MEMADDR_WRITE		0x80
+#define MEMADDR_PC		0x40
+#define MEMADDR_SIZE_MASK	0x3f	/* Size in bytes - 1. Larger accesses are recorded as 64 bytes. */
+typedef struct __attribute__((packed)) {
+	uint64_t addr;
+	uint8_t info;		/* MEMADDR_WRITE, MEMADDR_PC and the size */
+	uint8_t pc_delta;
+} memaddr_t;
+
+// A memaddr_t as returned by next_mem_access()
+typedef struct {
+	uint64_t pc;
+	uint64_t addr;
+	uint32_t size;
+	uint32_t write;
+} mem_access_t;
+
+/* Trace in parts (META_FLAG_PARTS). The tracer moves a stream on to a new
+ * file every so many bytes or instructions: insn.trace, insn.trace.1,
+ * insn.trace.2, ... and insn.trace.1.seek and so on if compressed. Read one
+ * after the other, the parts are the stream. manifest has one part_t per part
+ * of each stream, in the order they were started.
+ */
+enum PART_STREAM {
+	PART_INSN_TRACE,
+	PART_REGFILE,
+	PART_MEMREFS,
+	PART_MEMFILE,
+	PART_MEMADDRS,
+	PART_NUM_STREAMS
+};
+typedef struct {
+	uint32_t stream;	/* PART_* */
+	uint32_t index;		/* 0 for the file without a number */
+	uint64_t offset;	/* Bytes of the stream before the part, uncompressed */
+	uint64_t first_id;	/* Its first instruction. 0 if the records of the stream are not one per instruction. */
+} part_t;
+/* modules, shared by all threads and processes like insn.bytemap. One
+ * module_event_t per module load and unload, in the order they happened. A
+ * forked child starts with a load of every module it inherited.
+ */
+#define MODULE_EVENT_UNLOAD	(1 << 0)
+#define MODULE_BUILD_ID_MAX	32
+typedef struct {
+	uint64_t base;		/* Lowest address of the module */
+	uint64_t size;		/* Bytes from base to its end */
+	uint32_t pid;
+	uint32_t id;		/* Hash of the build id, or of the path without one. The same in every run. */
+	uint32_t flags;		/* MODULE_EVENT_UNLOAD */
+	uint32_t build_id_size;	/* 0 if the module has no GNU build id */
+	uint8_t build_id[MODULE_BUILD_ID_MAX];
+	char path[MAX_PATH];
+} module_event_t;
+
+/* With META_FLAG_MODULE_PCS, the pc of an instruction inside a module is
+ * stored as its module id and its offset from the module base, so traces of
+ * runs with different load addresses have the same pcs. insn.trace, memfile_t
+ * and insn.bytemap hold module pcs; the rip in regfile stays absolute.
+ */
+#define MODULE_PC_FLAG		(1ULL << 63)
+#define MODULE_PC(id, offset)	(MODULE_PC_FLAG | (uint64_t)(id) << 32 | (uint32_t)(offset))
+#define IS_MODULE_PC(pc)	(((pc) & MODULE_PC_FLAG) != 0)
+#define MODULE_PC_ID(pc)	((uint32_t)((pc) >> 32) & 0x7fffffff)
+#define MODULE_PC_OFFSET(pc)	((uint32_t)(pc))
+
+/* insn.bbtable, shared by all threads and forked processes like insn.bytemap.
+ * Entry x has id x. Processes append their entries in any order.
+ */
+typedef struct {
+	uint64_t pc;		/* First instruction of the block */
+	uint32_t id;
+	uint32_t num_insns;
+} bb_entry_t;
+
+/* Block profile (META_FLAG_BB_COUNTS). Nothing is recorded per instruction.
+ * When a process exits, it appends a bb_count_t for every basic block it ran
+ * to bbcounts, which is shared like insn.bytemap. Blocks are counted per
+ * process, not per thread.
+ */
+typedef struct {
+	uint64_t pc;		/* First instruction of the block */
+	uint64_t count;		/* Times the block ran */
+	uint32_t num_insns;
+	uint32_t pid;		/* 0 once load_trace() has added up the counts of several processes */
+} bb_count_t;
+
+/* Memory operand descriptors (META_FLAG_MEMDESC). The number, sizes and
+ * directions of the memory operands of an instruction are the same every time
+ * it runs, so insn.memdesc, shared like insn.bytemap, has them once per
+ * instruction with memory operands. memfile then has only the uint64_t address
+ * of each operand and memrefs is empty. get_peekaboo_insn() puts the memfile_t
+ * back together.
+ */
+#define MEMDESC_MAX_OPNDS 8
+typedef struct {
+	uint64_t pc;
+	uint32_t num_mem;	/* Memory operands, all of which have an address in memfile */
+	uint32_t writes;	/* Bit x is set if operand x is written */
+	uint32_t sizes[MEMDESC_MAX_OPNDS];	/* In bytes. Only the first MEMDESC_MAX_OPNDS are kept. */
+} memdesc_t;
+
+/* Control flow trace (META_FLAG_BRANCH_TRACE). insn.trace has one
+ * branch_ref_t per executed conditional branch, with where it went, and per
+ * indirect call, jump or return, with its destination. Everything else is
+ * followed with insn.brtable and insn.bytemap. A transfer that is not made by
+ * an instruction, e.g. the start of the thread or a signal, takes two:
+ * BRANCH_REF_ASYNC | the first instruction that did not run (0 if unknown),
+ * then the destination.
+ */
+#define BRANCH_REF_ASYNC (1ULL << 63)
+typedef struct {
+	uint64_t target;
+} branch_ref_t;
+
+/* insn.brtable, shared by all threads like insn.bytemap. One entry per control transfer instruction. */
+enum BRANCH_TYPE {
+	BRANCH_COND = 1,	/* Its branch_ref_t says where it went */
+	BRANCH_DIRECT,		/* Always goes to target */
+	BRANCH_INDIRECT,	/* Its branch_ref_t has the destination */
+};
+typedef struct {
+	uint64_t pc;
+	uint64_t target;	/* Taken target, 0 for BRANCH_INDIRECT */
+	uint32_t type;
+	uint32_t reserved;
+} branch_entry_t;
+
 typedef struct bytes_map {
 	uint64_t pc;
 	uint32_t size;
@@ -75,6 +271,19 @@ typedef struct {
 	uint32_t status; 	/* 0 for Read, 1 for write */
 	uint64_t pc;		/* Ad-hoc fix for alignment to support legacy version traces.*/
 } memfile_t;
+
+/* With META_FLAG_MEMVAL, value is the loaded value of a read before the
+ * instruction and the stored value of a write after it, zero extended.
+ * Operands wider than 8 bytes and up to MEMFILE_EXT_MAX_SIZE bytes keep their
+ * value in memfile.ext instead. There, each of them takes memfile_ext_size()
+ * bytes and value is its offset in the file.
+ */
+#define MEMFILE_EXT_MAX_SIZE 64
+static inline uint32_t memfile_ext_size(uint32_t size)
+{
+	if (size <= 8 || size > MEMFILE_EXT_MAX_SIZE) return 0;
+	return (size + 7) & ~7;
+}
 //---------------------------------------------------------
 
 
@@ -87,6 +296,8 @@ typedef struct {
 	memfile_t mem[8];
 	uint32_t arch;
 	void *regfile;
+	void *regderef;		/* NULL if the trace has no regderef stream */
+	uint8_t (*mem_ext)[MEMFILE_EXT_MAX_SIZE];	/* Values of wide operands in mem. NULL if the trace has no memfile.ext */
 } peekaboo_insn_t;
 
 typedef struct {
@@ -103,8 +314,71 @@ typedef struct {
 	memfile_t *memfile_buf;
 	memref_t *memref_buf;
 	uint32_t version;
+	uint32_t flags;
 
 	storage_options_t storage_options;
+	regfile_layout_amd64_t regfile_layout;	/* AMD64: where the stored register classes are in a record */
+
+	// Delta encoded regfile. regfile_cache holds the state of instruction regfile_cache_id.
+	uint32_t keyframe_interval;
+	void *regfile_cache;
+	size_t regfile_cache_id;
+
+	// Basic block trace. bb_index has the first instruction of every BB_INDEX_INTERVAL-th block.
+	bb_entry_t *bb_table;
+	size_t bb_table_size;
+	size_t num_bb_refs;
+	struct bb_index {
+		size_t ref;		/* Position of the block in insn.trace */
+		size_t start;		/* Its first instruction, counting from 0 */
+	} *bb_index;
+	size_t bb_index_size;
+	struct bb_cursor {
+		size_t ref;
+		size_t start;
+		size_t len;
+		uint32_t bb_id;
+		size_t insn;		/* Instruction whose pc is in pc, counting from 0 */
+		uint64_t pc;
+	} bb_cursor;
+
+	// Control flow trace. branch_index has the state of the decoder every BRANCH_INDEX_INTERVAL instructions.
+	branch_entry_t *branch_table;
+	size_t branch_table_size;
+	size_t num_branch_refs;
+	struct branch_cursor {
+		size_t ref;		/* Next branch_ref_t to use */
+		size_t insn;		/* Instruction whose pc is in pc, counting from 0 */
+		uint64_t pc;
+	} *branch_index, branch_cursor;
+	size_t branch_index_size;
+	branch_ref_t *branch_refs;	/* Cached insn.trace from branch_refs_start */
+	size_t branch_refs_start;
+	size_t num_cached_refs;
+
+	segment_t *segments;
+	size_t num_segments;
+
+	syscall_t *syscalls;
+	size_t num_syscalls;
+	order_t *orders;
+	size_t num_orders;
+	bb_count_t *bb_counts;	/* Hottest first */
+	size_t num_bb_counts;
+	memdesc_t *memdescs;	/* Sorted by pc (META_FLAG_MEMDESC) */
+	size_t num_memdescs;
+
+	// Memory address trace, read ahead through memaddr_buf
+	memaddr_t *memaddr_buf;
+	size_t memaddr_buf_len;
+	size_t memaddr_buf_pos;
+	mem_access_t mem_access;
+	module_event_t *modules;	/* modules of the trace directory */
+	size_t num_modules;
+	part_t *parts;		/* Parts of insn.trace (META_FLAG_PARTS) */
+	size_t num_parts;
+
+	struct live_trace *live;	/* Set by load_live_trace() */
 } peekaboo_internal_t;
 
 typedef struct {
@@ -115,22 +389,67 @@ typedef struct {
 	FILE *memfile;
 	FILE *metafile;
 	FILE *memrefs_offsets;
+	FILE *regderef;
+	FILE *regfile_keyidx;
+	FILE *memfile_ext;
+	FILE *segments;
+	FILE *syscalls;
+	FILE *memaddrs;
+	FILE *order;
 	peekaboo_internal_t *internal;
 } peekaboo_trace_t;
 // end
 
 /*** Tracer Utility ***/
 peekaboo_trace_t *create_trace(char *name);
-void write_metadata(peekaboo_trace_t *, enum ARCH, uint32_t version);
+void init_metadata(metadata_hdr_t *, enum ARCH, uint32_t version);
+void write_metadata(peekaboo_trace_t *, metadata_hdr_t *);
 void close_trace(peekaboo_trace_t *trace);
 
+/*** Regfile delta encoding ***/
+#define REGFILE_SLOT_SIZE 8
+size_t regfile_delta_max_size(size_t regfile_size);
+size_t regfile_delta_encode(const uint8_t *prev, const uint8_t *cur, size_t regfile_size, uint8_t *out);
+
 /*** Trace Reader Utility ***/
 void load_trace(char *, peekaboo_trace_t *trace);
+void load_live_trace(char *path, uint32_t tid, peekaboo_trace_t *trace);	// Follows thread tid, or the first one if 0, of a ring written with -live
+bool has_insn(peekaboo_trace_t *trace, size_t id);	// Waits for instruction id of a live trace. false past the end.
 void free_peekaboo_trace(peekaboo_trace_t *trace_ptr); // Must be called to free trace pointer loaded by load_trace
 peekaboo_insn_t *get_peekaboo_insn(const size_t id, peekaboo_trace_t *trace);
 void free_peekaboo_insn(peekaboo_insn_t *insn_ptr); // Must be called to free instruction pointed returned by get_peekaboo_insn
 uint64_t get_addr(size_t id, peekaboo_trace_t *trace);
+bytes_map_t *find_bytes_map(uint64_t pc, peekaboo_trace_t *trace);	// NULL if pc is not in insn.bytemap
 size_t get_num_insn(peekaboo_trace_t *);
 void regfile_pp(peekaboo_insn_t *insn);
+void regderef_pp(peekaboo_insn_t *insn);
+void *get_mem_value(peekaboo_insn_t *insn, uint32_t mem_idx, peekaboo_trace_t *trace);	// NULL if the value of insn->mem[mem_idx] was not recorded
+size_t get_num_segments(peekaboo_trace_t *trace);	// 0 if the trace is not sampled
+segment_t *get_segment(size_t idx, peekaboo_trace_t *trace);
+size_t find_segment(size_t id, peekaboo_trace_t *trace);	// Index of the segment holding instruction id
+size_t get_num_syscalls(peekaboo_trace_t *trace);	// 0 if the trace has no syscalls stream
+syscall_t *get_syscall(size_t idx, peekaboo_trace_t *trace);
+mem_access_t *next_mem_access(peekaboo_trace_t *trace);	// Next access in memaddrs. NULL at the end, or if the trace has none.
+void rewind_mem_access(peekaboo_trace_t *trace);
+/* Global order (META_FLAG_ORDER). A merge walks the instructions of all
+ * threads of a trace directory in about the order they ran, see order_t.
+ */
+typedef struct {
+	peekaboo_trace_t *trace;	/* Trace of the thread */
+	uint32_t tid;
+	size_t id;			/* Instruction id in the trace */
+} merged_insn_t;
+typedef struct peekaboo_merge peekaboo_merge_t;
+peekaboo_merge_t *open_merge(char *dir_path);	// Loads every thread of a trace directory, e.g. ls-31401
+merged_insn_t *next_merged_insn(peekaboo_merge_t *merge);	// Next instruction of any thread. NULL at the end.
+void close_merge(peekaboo_merge_t *merge);
+size_t get_num_parts(peekaboo_trace_t *trace);	// Files insn.trace is split into. 1 if the trace is not in parts.
+size_t find_part(size_t id, peekaboo_trace_t *trace);	// Part of insn.trace holding instruction id
+size_t get_num_bb_counts(peekaboo_trace_t *trace);	// 0 if the trace is not a block profile
+bb_count_t *get_bb_count(size_t idx, peekaboo_trace_t *trace);	// Hottest first: the most instructions run
+size_t get_num_module_events(peekaboo_trace_t *trace);	// 0 if the trace directory has no modules stream
+module_event_t *get_module_event(size_t idx, peekaboo_trace_t *trace);
+module_event_t *find_module(uint32_t id, peekaboo_trace_t *trace);	// Load of the module with the id, NULL if unknown
+memdesc_t *find_memdesc(uint64_t pc, peekaboo_trace_t *trace);	// NULL if the instruction at pc has no memory operands, or the trace has no insn.memdesc
 
 #endif
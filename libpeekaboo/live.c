@@ -0,0 +1,142 @@
+/* 
+ * Copyright 2019 Chua Zheng Leong
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "live.h"
+
+#define LIVE_ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+
+static int map_ring(int fd, size_t map_size, live_ring_t *ring)
+{
+	void *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) return -1;
+	ring->hdr = base;
+	ring->data = (uint8_t *)base + sizeof(live_ring_hdr_t);
+	ring->map_size = map_size;
+	return 0;
+}
+
+int live_ring_create(const char *path, uint64_t size, uint32_t policy, live_ring_t *ring)
+{
+	uint64_t data_size = 4096;
+	while (data_size < size) data_size <<= 1;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return -1;
+	int failed = ftruncate(fd, sizeof(live_ring_hdr_t) + data_size) || map_ring(fd, sizeof(live_ring_hdr_t) + data_size, ring);
+	close(fd);
+	if (failed) return -1;
+
+	memset(ring->hdr, 0, sizeof(live_ring_hdr_t));
+	ring->hdr->version = LIVE_RING_VERSION;
+	ring->hdr->policy = policy;
+	ring->hdr->size = data_size;
+	// A consumer that finds the magic finds the rest of the header too
+	__atomic_store_n(&ring->hdr->magic, LIVE_RING_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int live_ring_open(const char *path, live_ring_t *ring)
+{
+	struct stat st;
+	int fd = open(path, O_RDWR);
+	if (fd < 0) return -1;
+	int failed = fstat(fd, &st) || st.st_size < (off_t)sizeof(live_ring_hdr_t) || map_ring(fd, st.st_size, ring);
+	close(fd);
+	if (failed) return -1;
+	if (__atomic_load_n(&ring->hdr->magic, __ATOMIC_ACQUIRE) != LIVE_RING_MAGIC ||
+	    ring->hdr->version != LIVE_RING_VERSION ||
+	    sizeof(live_ring_hdr_t) + ring->hdr->size != ring->map_size)
+	{
+		live_ring_unmap(ring);
+		return -1;
+	}
+	return 0;
+}
+
+// Copies size bytes in and out of the data area at pos, wrapping around its end
+static void copy_in(live_ring_t *ring, uint64_t pos, const void *src, size_t size)
+{
+	uint64_t offset = pos & (ring->hdr->size - 1);
+	size_t first = ring->hdr->size - offset < size ? ring->hdr->size - offset : size;
+	memcpy(ring->data + offset, src, first);
+	memcpy(ring->data, (const uint8_t *)src + first, size - first);
+}
+
+static void copy_out(live_ring_t *ring, uint64_t pos, void *dst, size_t size)
+{
+	uint64_t offset = pos & (ring->hdr->size - 1);
+	size_t first = ring->hdr->size - offset < size ? ring->hdr->size - offset : size;
+	memcpy(dst, ring->data + offset, first);
+	memcpy((uint8_t *)dst + first, ring->data, size - first);
+}
+
+bool live_ring_write(live_ring_t *ring, const live_msg_t *msg, const void *payload)
+{
+	live_ring_hdr_t *hdr = ring->hdr;
+	uint64_t head = hdr->head;
+	uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	uint64_t total = sizeof(live_msg_t) + LIVE_ALIGN(msg->size);
+
+	if (hdr->size - (head - tail) < total) return false;
+	copy_in(ring, head, msg, sizeof(live_msg_t));
+	copy_in(ring, head + sizeof(live_msg_t), payload, msg->size);
+	__atomic_store_n(&hdr->head, head + total, __ATOMIC_RELEASE);
+	return true;
+}
+
+void live_ring_close(live_ring_t *ring)
+{
+	__atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+}
+
+bool live_ring_read(live_ring_t *ring, live_msg_t *msg, void **payload, size_t *payload_size)
+{
+	live_ring_hdr_t *hdr = ring->hdr;
+	uint64_t tail = hdr->tail;
+	uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	if (head == tail) return false;
+	copy_out(ring, tail, msg, sizeof(live_msg_t));
+	if (*payload_size < msg->size)
+	{
+		*payload = realloc(*payload, msg->size);
+		*payload_size = msg->size;
+	}
+	copy_out(ring, tail + sizeof(live_msg_t), *payload, msg->size);
+	__atomic_store_n(&hdr->tail, tail + sizeof(live_msg_t) + LIVE_ALIGN(msg->size), __ATOMIC_RELEASE);
+	return true;
+}
+
+bool live_ring_closed(live_ring_t *ring)
+{
+	// closed first: whatever was written before it is in head then
+	if (!__atomic_load_n(&ring->hdr->closed, __ATOMIC_ACQUIRE)) return false;
+	return __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE) == ring->hdr->tail;
+}
+
+void live_ring_unmap(live_ring_t *ring)
+{
+	munmap(ring->hdr, ring->map_size);
+	ring->hdr = NULL;
+	ring->data = NULL;
+}
@@ -0,0 +1,97 @@
+/* 
+ * Copyright 2019 Chua Zheng Leong
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LIBPEEKABOO_LIVE_H__
+#define __LIBPEEKABOO_LIVE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Live traces (-live in the tracer).
+ * The tracer publishes what it would write to the trace files into a ring in
+ * a shared file, e.g. in /dev/shm. The ring has one producer, the tracer, and
+ * one consumer. head and tail count the bytes written and read so far; each
+ * side only writes its own and reads the other one's. A message is a
+ * live_msg_t followed by its payload, padded to 8 bytes, and may wrap around
+ * the end of the data area.
+ */
+#define LIVE_RING_MAGIC 0x4556494c	/* "LIVE" */
+#define LIVE_RING_VERSION 1
+
+// What the tracer does when the ring is full
+enum LIVE_POLICY {
+	LIVE_POLICY_BLOCK,	/* Wait for the consumer */
+	LIVE_POLICY_DROP	/* Drop the message. Its stream gets a gap, see live_msg_t.offset. */
+};
+
+enum LIVE_STREAM {
+	LIVE_STREAM_META,	/* metadata_hdr_t of a new thread */
+	LIVE_STREAM_BYTEMAP,	/* bytes_map_t, for all threads */
+	LIVE_STREAM_INSN,	/* insn_ref_t */
+	LIVE_STREAM_REGFILE,	/* Regfile records */
+	LIVE_STREAM_MEMREFS,	/* memref_t */
+	LIVE_STREAM_MEMFILE,	/* memfile_t */
+	LIVE_STREAM_EXIT,	/* The thread exited. No payload. */
+	LIVE_NUM_STREAMS
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t policy;
+	uint32_t closed;	/* Set by the tracer when the process exits */
+	uint64_t size;		/* Bytes in the data area, a power of 2 */
+	uint64_t dropped;	/* Payload bytes dropped with LIVE_POLICY_DROP */
+	uint8_t padding_1[32];
+	uint64_t head;		/* Bytes written so far. Only the tracer writes it. */
+	uint8_t padding_2[56];
+	uint64_t tail;		/* Bytes read so far. Only the consumer writes it. */
+	uint8_t padding_3[56];
+} live_ring_hdr_t;
+
+typedef struct {
+	uint32_t tid;
+	uint32_t stream;	/* LIVE_STREAM_* */
+	uint64_t size;		/* Payload bytes */
+	uint64_t offset;	/* Bytes of the stream of the thread before this message, dropped ones included */
+	uint64_t aux;		/* LIVE_STREAM_MEMREFS: memfile_t records before this message */
+} live_msg_t;
+
+typedef struct {
+	live_ring_hdr_t *hdr;
+	uint8_t *data;
+	size_t map_size;
+} live_ring_t;
+
+// Tracer side. size is rounded up to a power of 2. Returns 0, or -1 on failure.
+int live_ring_create(const char *path, uint64_t size, uint32_t policy, live_ring_t *ring);
+// Writes a message. Returns false, and writes nothing, if it does not fit right now.
+bool live_ring_write(live_ring_t *ring, const live_msg_t *msg, const void *payload);
+// Tells the consumer nothing more will come
+void live_ring_close(live_ring_t *ring);
+
+// Consumer side. Returns 0, or -1 if path is not a ring.
+int live_ring_open(const char *path, live_ring_t *ring);
+/* Reads the next message into msg and its payload into *payload, which is
+ * grown with realloc as needed. Returns false if the ring is empty.
+ */
+bool live_ring_read(live_ring_t *ring, live_msg_t *msg, void **payload, size_t *payload_size);
+bool live_ring_closed(live_ring_t *ring);	// Closed and everything read
+
+void live_ring_unmap(live_ring_t *ring);
+
+#endif
@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stddef.h> /* for offsetof */
@@ -23,57 +24,82 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <elf.h>
+#include <link.h>
 
 #include "dr_api.h"
 #include "drmgr.h"
 #include "drreg.h"
 #include "drutil.h"
 #include "drx.h"
+#include "drbbdup.h"
+#include "hashtable.h"
+#include "drwrap.h"
+#include "drsyms.h"
 #include "dr_defines.h"
 
 #include "libpeekaboo.h"
+#include "compress.h"
+#include "live.h"
+#include "writer.h"
 
 #ifdef X86
 	#ifdef X64
 		char *arch_str = "AMD64";
 		enum ARCH arch = ARCH_AMD64;
 		typedef regfile_amd64_t regfile_t;
-		const storage_option_amd64_t storage_option;
+		// Register classes to store (-regs), and where they go in a record
+		#define HAS_REGFILE_LAYOUT
+		storage_option_amd64_t storage_option = {1, 1};
+		regfile_layout_amd64_t regfile_layout;
+		// GPRs and rflags are stored inline by insert_save_gpr(), so the clean call
+		// only has to take care of the SIMD and FXSAVE parts of the regfile.
+		#define INLINE_GPR_CAPTURE
+		#define REGFILE_MC_FLAGS DR_MC_MULTIMEDIA
+		#define REGFILE_NEEDS_CLEAN_CALL (storage_option.has_simd || storage_option.has_fxsave)
+		static const struct {
+			reg_id_t reg;
+			short offset;
+		} gpr_slots[] = {
+			{DR_REG_RDI, offsetof(amd64_cpu_gr_t, reg_rdi)},
+			{DR_REG_RSI, offsetof(amd64_cpu_gr_t, reg_rsi)},
+			{DR_REG_RSP, offsetof(amd64_cpu_gr_t, reg_rsp)},
+			{DR_REG_RBP, offsetof(amd64_cpu_gr_t, reg_rbp)},
+			{DR_REG_RBX, offsetof(amd64_cpu_gr_t, reg_rbx)},
+			{DR_REG_RDX, offsetof(amd64_cpu_gr_t, reg_rdx)},
+			{DR_REG_RCX, offsetof(amd64_cpu_gr_t, reg_rcx)},
+			{DR_REG_RAX, offsetof(amd64_cpu_gr_t, reg_rax)},
+			{DR_REG_R8, offsetof(amd64_cpu_gr_t, reg_r8)},
+			{DR_REG_R9, offsetof(amd64_cpu_gr_t, reg_r9)},
+			{DR_REG_R10, offsetof(amd64_cpu_gr_t, reg_r10)},
+			{DR_REG_R11, offsetof(amd64_cpu_gr_t, reg_r11)},
+			{DR_REG_R12, offsetof(amd64_cpu_gr_t, reg_r12)},
+			{DR_REG_R13, offsetof(amd64_cpu_gr_t, reg_r13)},
+			{DR_REG_R14, offsetof(amd64_cpu_gr_t, reg_r14)},
+			{DR_REG_R15, offsetof(amd64_cpu_gr_t, reg_r15)},
+		};
+		#define NUM_GPR_SLOTS (sizeof(gpr_slots)/sizeof(gpr_slots[0]))
+
+		// Only AMD64 records what its GPRs point to, and memory values
+		#define HAS_REGDEREF
+		typedef regderef_amd64_t regderef_t;
+		#define HAS_MEMVAL
+		#define HAS_BRANCH_TRACE
+
 		void copy_regfile(regfile_t *regfile_ptr, dr_mcontext_t *mc)
 		{
-			regfile_ptr->gpr.reg_rdi = mc->rdi;
-			regfile_ptr->gpr.reg_rsi = mc->rsi;
-			regfile_ptr->gpr.reg_rsp = mc->rsp;
-			regfile_ptr->gpr.reg_rbp = mc->rbp;
-			regfile_ptr->gpr.reg_rbx = mc->rbx;
-			regfile_ptr->gpr.reg_rdx = mc->rdx;
-			regfile_ptr->gpr.reg_rcx = mc->rcx;
-			regfile_ptr->gpr.reg_rax = mc->rax;
-			regfile_ptr->gpr.reg_r8 = mc->r8;
-			regfile_ptr->gpr.reg_r9 = mc->r9;
-			regfile_ptr->gpr.reg_r10 = mc->r10;
-			regfile_ptr->gpr.reg_r11 = mc->r11;
-			regfile_ptr->gpr.reg_r12 = mc->r12;
-			regfile_ptr->gpr.reg_r13 = mc->r13;
-			regfile_ptr->gpr.reg_r14 = mc->r14;
-			regfile_ptr->gpr.reg_r15 = mc->r15;
-			regfile_ptr->gpr.reg_rflags = mc->rflags;
-			// KH: It actually stores 0 into gpr.reg_rip
-			regfile_ptr->gpr.reg_rip = (uint64_t) mc->xip;
-			//printf("czl:%p\n", regfile_ptr->gpr.reg_rip);
-            
-            // Read and log memory contents at register addresses
-            log_registers_and_memory(regfile_ptr);
+			byte *record = (byte *)regfile_ptr;
 
 			// here, we cast the simd structure into an array of uint256_t
-			#ifdef _STORE_SIMD
-			memcpy(&regfile_ptr->simd, mc->ymm, sizeof(regfile_ptr->simd.ymm0)*MCXT_NUM_SIMD_SLOTS);
-			#endif
+			if (storage_option.has_simd)
+				memcpy(record + regfile_layout.simd_offset, mc->ymm, sizeof(regfile_ptr->simd.ymm0)*MCXT_NUM_SIMD_SLOTS);
 
 			// here we'll call fxsave, that saves into the fxsave area.
-			#ifdef _STORE_FXSAVE
-			proc_save_fpstate((byte *)&regfile_ptr->fxsave);
-			#endif
+			// Every class is a multiple of 16 bytes, so it stays aligned.
+			if (storage_option.has_fxsave)
+				proc_save_fpstate(record + regfile_layout.fxsave_offset);
 		}
 	#else
 		char *arch_str = "X86";
@@ -107,11 +133,19 @@
 	#endif
 #endif
 
+#ifndef REGFILE_MC_FLAGS
+	#define REGFILE_MC_FLAGS DR_MC_ALL
+	#define REGFILE_NEEDS_CLEAN_CALL true
+#endif
+
+// Bytes per regfile record. Smaller than regfile_t if -regs leaves classes out.
+static size_t regfile_size = sizeof(regfile_t);
+
 #define MAX_NUM_INS_REFS 8192
 #define INSN_REF_SIZE (sizeof(insn_ref_t) * MAX_NUM_INS_REFS)
 
 #define MAX_NUM_REG_REFS 8192
-#define REG_BUF_SIZE (sizeof(regfile_t) * MAX_NUM_REG_REFS)
+#define REG_BUF_SIZE (regfile_size * MAX_NUM_REG_REFS)
 
 #define MAX_NUM_MEM_REFS 8192
 #define MEM_REFS_SIZE (sizeof(memref_t) * MAX_NUM_MEM_REFS)
@@ -119,63 +153,581 @@
 #define MAX_NUM_MEM_REFS 8192
 #define MEMFILE_SIZE (sizeof(memfile_t) * MAX_NUM_MEM_REFS)
 
-#define MAX_NUM_BYTES_MAP 128
+#define MEMEXT_SIZE (MEMFILE_EXT_MAX_SIZE * MAX_NUM_MEM_REFS)
+
+#define MEMADDR_SIZE (sizeof(memaddr_t) * MAX_NUM_MEM_REFS)
+
+#define MAX_NUM_REGDEREFS 8192
+#define REGDEREF_SIZE (sizeof(regderef_t) * MAX_NUM_REGDEREFS)
+
+/* -flight_recorder <N>: the rings hold N records each, except the memfile ring
+ * which holds FLIGHT_MEMFILE_RATIO memory operands per instruction.
+ */
+#define FLIGHT_MEMFILE_RATIO 2
+/* -flight_recorder: a thread dumps on at most this many signals, so that an
+ * application taking SIGSEGV on purpose (JITs, GC write barriers) does not
+ * flood the trace directory.
+ */
+#define MAX_SIGNAL_DUMPS 4
+
+/* insn.bytemap gets every instruction once. A thread buffers the instructions
+ * new to the process and appends them to the file when the buffer is full.
+ * event_exit() sorts the file by pc.
+ */
+#define MAX_NUM_BYTES_MAP 1024
 #define MAX_BYTES_MAP_SIZE (sizeof(bytes_map_t) * MAX_NUM_BYTES_MAP)
+#define MAX_MEMDESCS_SIZE (sizeof(memdesc_t) * MAX_NUM_BYTES_MAP)
+#define BYTES_MAP_SHARDS 64
+
+
+#define DELTA_BUF_SIZE (regfile_delta_max_size(regfile_size) * 64)
+
+// -order: stamps a thread keeps before appending them to its order file
+#define ORDER_BUF_LEN 256
 
+/* Basic blocks seen by -bb_trace, indexed by id. The chunks are never moved,
+ * so the flush and kernel xfer callbacks can read them without the mutex.
+ */
+#define BB_CHUNK_SIZE 4096
+#define MAX_BB_CHUNKS 4096
+#define BB_ID_NONE 0xffffffff
+
+/* -memval: a memory operand whose value is still to be recorded. Its memfile
+ * entry and memfile.ext record are at these offsets from the buffer pointers.
+ */
+#define MAX_MEM_OPNDS 8
+typedef struct {
+	short entry;
+	short ext;
+	uint32_t size;
+} mem_value_t;
+
+/* Selective tracing. A block outside -module/-range, inside -exclude_module, or
+ * built while no thread is inside -function gets no instrumentation at all.
+ */
+#define MAX_FILTERS 16
+#define MAX_FILTER_NAME 256
+#define MAX_MODULE_RANGES 256
+#define MAX_LOADED_MODULES 1024
+#define BB_SKIPPED ((void *)-1)
+#define BB_COUNTED ((void *)-2)	/* Between -sample_* windows: only counted */
+#define BB_SYSCALLS_ONLY ((void *)-3)	/* -syscalls: only counted by the thread */
+#define BB_BRANCHES_ONLY ((void *)-4)	/* -branch_trace: only its last transfer is recorded */
+#define BB_MEMADDRS_ONLY ((void *)-5)	/* -memaddr: only its memory accesses are recorded */
+#define BB_COUNTS_ONLY ((void *)-6)	/* -bb_counts: a block without instructions, not counted */
+typedef struct {
+	app_pc start;
+	app_pc end;
+} pc_range_t;
+
+typedef struct {
+	app_pc start;
+	app_pc end;
+	bool include;		/* -module, otherwise -exclude_module */
+} module_range_t;
+
+// A module logged into modules. Kept after it is unloaded, so its id stays taken.
+typedef struct {
+	app_pc start;
+	app_pc end;
+	uint64_t hash;		/* What id was made from */
+	uint32_t id;
+	bool loaded;
+	bool relative;		/* -module_pcs: its pcs are stored as module pcs */
+} loaded_module_t;
+
+/* Streams written by write_stream(). -compress writes them in compressed
+ * blocks, each with a seek table. -part_size and -part_insns split them into parts.
+ */
+enum {
+	STREAM_INSN_TRACE = PART_INSN_TRACE,
+	STREAM_REGFILE = PART_REGFILE,
+	STREAM_MEMREFS = PART_MEMREFS,
+	STREAM_MEMFILE = PART_MEMFILE,
+	STREAM_MEMADDRS = PART_MEMADDRS,
+	NUM_STREAMS
+};
 
+static const char *stream_names[NUM_STREAMS] = {"insn.trace", "regfile", "memrefs", "memfile", "memaddrs"};
+
+typedef struct {
+	FILE *seek;
+	uint64_t raw_offset;	/* Uncompressed bytes so far */
+	uint64_t file_offset;	/* Compressed bytes so far in the part */
+	uint32_t stride;	/* Delta filter distance, see compress.h */
+	uint32_t part;		/* Part being written */
+	uint64_t part_offset;	/* raw_offset where it started */
+	uint64_t part_insns;	/* num_refs where it started */
+} stream_t;
+
+/* Passed from the analysis to the insertion phase of a basic block */
 typedef struct {
+	uint32_t bb_id;		/* -bb_trace */
+	uint32_t num_writes;	/* -memval: writes of the previous instruction, recorded before the next one */
+	mem_value_t writes[MAX_MEM_OPNDS];
+} bb_state_t;
+
+typedef struct per_thread {
 	peekaboo_trace_t *peek_trace;
 	uint64_t num_refs;
+
+	/* Delta encoding of the regfile (-keyframe) */
+	regfile_t regfile_prev;
+	uint64_t regfile_count;		/* Regfiles encoded so far */
+	uint64_t regfile_offset;	/* Bytes written to the regfile so far */
+	uint8_t *delta_buf;
+
+	uint32_t last_bb_id;		/* Last block flushed to insn.trace (-bb_trace) */
+	uint64_t memext_offset;		/* Bytes in memfile.ext so far (-memval) */
+
+	bytes_map_t *bytes_map;		/* Instructions not in insn.bytemap yet */
+	uint32_t num_bytes_map;
+	memdesc_t *memdescs;		/* ...and their memory operands not in insn.memdesc yet (-memdesc) */
+	uint32_t num_memdescs;
+
+	uint32_t function_depth;	/* Calls of -function the thread is in */
+	uint32_t sample_epoch;		/* Last window the thread has a segment for (-sample_*) */
+	uint32_t flight_epoch;		/* Last dump request the thread has dumped (-flight_recorder) */
+	uint32_t num_dumps;		/* Dumps before exit so far (-flight_recorder) */
+	uint32_t num_signal_dumps;	/* Those of them taken on a signal */
+
+	syscall_t syscall;		/* Waiting for its return value (-syscalls) */
+	bool syscall_pending;
+
+	stream_t streams[NUM_STREAMS];
+	FILE *manifest;			/* -part_size, -part_insns */
+	char dir[256];
+	compress_work_t *compress_work;
+	uint8_t *compress_buf;
+
+	order_t orders[ORDER_BUF_LEN];	/* -order */
+	uint32_t num_orders;
+
+	uint64_t live_offsets[NUM_STREAMS];	/* Bytes published per stream (-live) */
+	uint64_t live_memfile_records;		/* memfile_t the published memrefs point to */
+
+	uintptr_t *trace_case;		/* The thread's raw TLS slot drbbdup picks the copy by, see set_up_bb_dups() */
+	struct per_thread *next_sampled;	/* -sample_*: the threads whose window bit the sampler sets */
 } per_thread_t;
 
+/* Client options. Given after the client path, e.g. drrun -c libpeekaboo_dr.so -regderef -- ls */
+static struct {
+	bool regderef;		/* -regderef: record what the GPRs point to in a regderef stream */
+	uint32_t keyframe;	/* -keyframe <N>: delta encode the regfile with a full keyframe every N instructions. 0 to disable. */
+	bool bb_trace;		/* -bb_trace: record one id per executed basic block instead of one pc per instruction */
+	bool memval;		/* -memval: record the values read and written by memory operands */
+	uint32_t write_buffers;	/* -write_buffers <N>: WRITER_BLOCK_SIZE blocks queued for the writer thread. 0 to write from the app thread. */
+	char modules[MAX_FILTERS][MAX_FILTER_NAME];		/* -module <name>: only trace these modules */
+	uint32_t num_modules;
+	char exclude_modules[MAX_FILTERS][MAX_FILTER_NAME];	/* -exclude_module <name>: never trace these modules */
+	uint32_t num_exclude_modules;
+	pc_range_t ranges[MAX_FILTERS];		/* -range <start>-<end>: only trace these pcs (hex) */
+	uint32_t num_ranges;
+	char function[MAX_FILTER_NAME];		/* -function [module!]<name>: only trace while a thread is inside the function */
+	uint64_t sample_window;	/* -sample_window <W>: trace windows of W instructions... */
+	uint64_t sample_period;	/* -sample_period <P>: ...one every P instructions */
+	uint32_t sample_ms;	/* -sample_ms <T>: ...or one every T milliseconds */
+	bool compress;		/* -compress: compress insn.trace, regfile, memrefs and memfile in blocks */
+	uint32_t flight_recorder;	/* -flight_recorder <N>: only keep the last N instructions of each thread in memory */
+	bool syscalls;		/* -syscalls: only record the system calls into a syscalls stream */
+	bool branch_trace;	/* -branch_trace: only record where conditional and indirect branches go */
+	bool memaddr;		/* -memaddr: only record the address, size and direction of memory accesses */
+	char live[MAX_FILTER_NAME];	/* -live <path>: publish the trace into a ring in this shared file instead of writing it */
+	uint32_t live_size;	/* -live_size <MB>: size of the ring */
+	bool live_drop;		/* -live_drop: drop what does not fit into the ring instead of waiting */
+	uint64_t part_size;	/* -part_size <MB>: move each stream on to a new file after this many bytes */
+	uint64_t part_insns;	/* -part_insns <N>: ...or after this many instructions */
+	bool order;		/* -order: stamp a global clock into an order stream, see order_t */
+	bool module_pcs;	/* -module_pcs: store pcs inside modules as module id and offset */
+	bool bb_counts;		/* -bb_counts: only count how often each basic block runs, see bb_count_t */
+	bool toggle;		/* -toggle: start with tracing off. A nudge turns it on and off. */
+	int toggle_signal;	/* -toggle_signal <N>: ...and so does this signal, which the application never gets */
+	uint64_t max_insns;	/* -max_insns <N>: stop tracing for good after N traced instructions */
+	bool memdesc;		/* -memdesc: only record operand addresses in memfile, the rest once per instruction in insn.memdesc */
+} options = {.write_buffers = 32, .live_size = 64};
+
 static client_id_t client_id;
 static void *mutex;     /* for multithread support */
-static uint64 num_refs; /* keep a global instruction reference count */
+static uint64 num_refs; /* keep a global instruction reference count. Updated atomically. */
 
 static process_id_t root_pid; /* root process pid */
 static FILE *bytes_map_file;
+static FILE *memdesc_file;	/* -memdesc */
+static hashtable_t bytes_map_pcs[BYTES_MAP_SHARDS];	/* Instructions seen so far. Each shard has its own lock. */
+static FILE *bb_table_file;
+static hashtable_t bb_ids;	/* Start pc -> id + 1 of the basic block */
+static bb_entry_t *bb_chunks[MAX_BB_CHUNKS];	/* Chunks of ids other processes took stay NULL */
+static uint32_t num_bbs;	/* Highest id + 1 this process used */
+static uint32_t *next_bb_id;	/* Shared with forked children, so ids never collide. Updated atomically. */
+static uint64_t *bb_count_chunks[MAX_BB_CHUNKS];	/* -bb_counts: times each block of bb_chunks ran */
+static FILE *bb_counts_file;
+static FILE *branch_table_file;
+static hashtable_t branch_pcs;	/* Control transfers in insn.brtable (-branch_trace) */
 static char trace_dir[256];
+static module_range_t module_ranges[MAX_MODULE_RANGES];	/* Loaded modules named by -module or -exclude_module */
+static uint32_t num_module_ranges;
+static FILE *modules_file;
+static loaded_module_t loaded_modules[MAX_LOADED_MODULES];	/* Every module seen so far. Must hold the mutex. */
+static uint32_t num_loaded_modules;
+static void *module_ranges_lock;	/* Read by every block built with -module or -exclude_module */
+static uint32_t flight_epoch;	/* Dumps requested by nudges so far (-flight_recorder) */
+
+/* -sample_*: the sampler thread opens and closes the windows. Every block has
+ * a traced and an untraced copy (drbbdup), and the thread's trace case picks
+ * the one that runs. -toggle opens and closes them on nudges, and -max_insns
+ * closes the last one.
+ */
+static struct {
+	uint64_t num_insns;	/* Instructions run, traced or counted. Updated by the code cache. */
+	uintptr_t tracing;	/* Inside a window. Copied into the trace case of every thread. */
+	uint32_t epoch;		/* Windows opened so far */
+	uint64_t window_insns;	/* num_insns when the current window opened */
+	uint64_t window_ms;	/* Time the current window opened */
+	uint64_t traced_insns;	/* Instructions in the windows closed so far */
+	bool done;		/* -max_insns is used up. No more windows. */
+	void *lock;		/* Opening and closing windows, and threads */
+	per_thread_t *threads;
+	bool exiting;
+	void *exited_event;
+} sampler = {.tracing = true};
 static int tls_idx;
 
+/* Bits of a thread's trace case. The traced copy of a block runs with both set. */
+#define TRACE_IN_WINDOW		1	/* -sample_*: a window is open */
+#define TRACE_IN_FUNCTION	2	/* -function: the thread is inside the function */
+#define TRACE_CASE		(TRACE_IN_WINDOW | TRACE_IN_FUNCTION)
+static reg_id_t trace_case_seg;
+static uint trace_case_offs;
+static uint64_t *order_clock;	/* -order. Shared with forked children. Updated atomically. */
+
+static live_ring_t live_ring;	/* -live */
+static void *live_mutex;	/* The ring has one producer at a time */
+
 static drx_buf_t *insn_ref_buf;
 static drx_buf_t *bytes_map_buf;
 static drx_buf_t *regfile_buf;
 static drx_buf_t *memrefs_buf;
 static drx_buf_t *memfile_buf;
+static drx_buf_t *regderef_buf;
+static drx_buf_t *memext_buf;
+static drx_buf_t *memaddr_buf;
+
+
+/* -live: publishes a message. Only data streams are dropped with -live_drop;
+ * the consumer cannot do without the metadata, the instructions and the exits.
+ */
+static void live_publish(uint32_t stream, uint64_t offset, uint64_t aux, const void *payload, size_t size)
+{
+	live_msg_t msg = {dr_get_thread_id(dr_get_current_drcontext()), stream, size, offset, aux};
+	bool may_drop = options.live_drop && stream >= LIVE_STREAM_INSN && stream <= LIVE_STREAM_MEMFILE;
+
+	dr_mutex_lock(live_mutex);
+	while (!live_ring_write(&live_ring, &msg, payload))
+	{
+		if (may_drop)
+		{
+			live_ring.hdr->dropped += size;
+			break;
+		}
+		dr_mutex_unlock(live_mutex);
+		dr_sleep(1);
+		dr_mutex_lock(live_mutex);
+	}
+	dr_mutex_unlock(live_mutex);
+}
+
+// Publishes a flushed buffer in messages of whole records
+static void write_live(per_thread_t *data, int idx, const void *buf, size_t size)
+{
+	static const uint32_t live_streams[NUM_STREAMS] = {LIVE_STREAM_INSN, LIVE_STREAM_REGFILE, LIVE_STREAM_MEMREFS, LIVE_STREAM_MEMFILE, LIVE_NUM_STREAMS};
+	size_t record_size = idx == STREAM_REGFILE ? regfile_size : idx == STREAM_MEMREFS ? sizeof(memref_t) : idx == STREAM_MEMFILE ? sizeof(memfile_t) : sizeof(insn_ref_t);
+	size_t max_chunk = live_ring.hdr->size / 4 / record_size * record_size;
+	const uint8_t *ptr = buf;
+
+	while (size)
+	{
+		size_t chunk = size < max_chunk ? size : max_chunk;
+		uint64_t aux = data->live_memfile_records;
+		size_t x;
+		// The consumer finds the memfile_t of an instruction from here, even after a drop
+		if (idx == STREAM_MEMREFS)
+			for (x=0; x<chunk/sizeof(memref_t); x++)
+				data->live_memfile_records += ((const memref_t *)ptr)[x].length;
+		live_publish(live_streams[idx], data->live_offsets[idx], aux, ptr, chunk);
+		data->live_offsets[idx] += chunk;
+		ptr += chunk;
+		size -= chunk;
+	}
+}
+
+// First instruction with a record in the stream from here on. 0 if the records are not one per instruction.
+static uint64_t stream_first_id(per_thread_t *data, int idx)
+{
+	switch (idx)
+	{
+		case STREAM_INSN_TRACE:
+			return options.branch_trace ? 0 : data->num_refs + 1;
+		case STREAM_REGFILE:
+			return options.keyframe ? 0 : data->streams[idx].raw_offset / regfile_size + 1;
+		case STREAM_MEMREFS:
+			return data->streams[idx].raw_offset / sizeof(memref_t) + 1;
+		default:
+			return 0;
+	}
+}
+
+static void write_part(per_thread_t *data, int idx)
+{
+	stream_t *stream = &data->streams[idx];
+	part_t part = {idx, stream->part, stream->part_offset, stream_first_id(data, idx)};
+	writer_write(data->manifest, &part, sizeof(part_t));
+}
+
+// -part_size, -part_insns: whether the stream moves on to a new part before buf
+static bool is_part_full(per_thread_t *data, int idx, const void *buf)
+{
+	stream_t *stream = &data->streams[idx];
+	if (!data->manifest || stream->raw_offset == stream->part_offset) return false;
+	// An early exit marker stays with its block
+	if (idx == STREAM_INSN_TRACE && options.bb_trace && (((const bb_ref_t *)buf)->id & BB_REF_EARLY_EXIT)) return false;
+	return (options.part_size && stream->raw_offset - stream->part_offset >= options.part_size) ||
+	       (options.part_insns && data->num_refs - stream->part_insns >= options.part_insns);
+}
+
+// Opens the next part of the stream. The writer closes the last one once it has written it.
+static FILE *next_part(per_thread_t *data, int idx)
+{
+	stream_t *stream = &data->streams[idx];
+	FILE **files[NUM_STREAMS] = {&data->peek_trace->insn_trace, &data->peek_trace->regfile, &data->peek_trace->memrefs, &data->peek_trace->memfile, &data->peek_trace->memaddrs};
+	char name[256];
+
+	stream->part++;
+	stream->part_offset = stream->raw_offset;
+	stream->part_insns = data->num_refs;
+	stream->file_offset = 0;
+
+	writer_close(*files[idx]);
+	snprintf(name, sizeof(name), "%s.%u", stream_names[idx], stream->part);
+	create_trace_file(data->dir, name, 256, files[idx]);
+	if (*files[idx] == NULL) PEEKABOO_DIE("Peekaboo: Unable to create %s/%s\n", data->dir, name);
+	if (options.compress)
+	{
+		writer_close(stream->seek);
+		snprintf(name, sizeof(name), "%s.%u.seek", stream_names[idx], stream->part);
+		create_trace_file(data->dir, name, 256, &stream->seek);
+		if (stream->seek == NULL) PEEKABOO_DIE("Peekaboo: Unable to create %s/%s\n", data->dir, name);
+	}
+	write_part(data, idx);
+	return *files[idx];
+}
+
+// Writes to one of the NUM_STREAMS streams. With -compress, every block goes into the stream's seek table.
+static void write_stream(per_thread_t *data, int idx, FILE *file, const void *buf, size_t size)
+{
+	if (options.live[0])
+	{
+		write_live(data, idx, buf, size);
+		return;
+	}
+	if (is_part_full(data, idx, buf)) file = next_part(data, idx);
+	if (!options.compress)
+	{
+		writer_write(file, buf, size);
+		data->streams[idx].raw_offset += size;
+		return;
+	}
+
+	stream_t *stream = &data->streams[idx];
+	const uint8_t *ptr = buf;
+	// Blocks start at a record so the delta filter lines up
+	size_t max_block = stream->stride ? COMPRESS_BLOCK_SIZE / stream->stride * stream->stride : COMPRESS_BLOCK_SIZE;
+	while (size)
+	{
+		seek_entry_t entry;
+		memset(&entry, 0, sizeof(seek_entry_t));
+		entry.raw_offset = stream->raw_offset - stream->part_offset;
+		entry.file_offset = stream->file_offset;
+		entry.raw_size = size < max_block ? size : max_block;
+		entry.stride = stream->stride;
+		entry.comp_size = compress_block(ptr, entry.raw_size, entry.stride, data->compress_buf, data->compress_work);
+		writer_write(file, entry.comp_size == entry.raw_size ? ptr : data->compress_buf, entry.comp_size);
+		writer_write(stream->seek, &entry, sizeof(seek_entry_t));
+
+		stream->raw_offset += entry.raw_size;
+		stream->file_offset += entry.comp_size;
+		ptr += entry.raw_size;
+		size -= entry.raw_size;
+	}
+}
+
+static void flush_orders(per_thread_t *data)
+{
+	writer_write(data->peek_trace->order, data->orders, data->num_orders * sizeof(order_t));
+	data->num_orders = 0;
+}
 
+// Stamps the clock before instruction insn of the thread
+static void add_order(per_thread_t *data, uint64_t insn)
+{
+	order_t *order = &data->orders[data->num_orders++];
+	order->insn = insn;
+	order->clock = __atomic_fetch_add(order_clock, 1, __ATOMIC_SEQ_CST);
+	if (data->num_orders == ORDER_BUF_LEN) flush_orders(data);
+}
 
 static void flush_insnrefs(void *drcontext, void *buf_base, size_t size)
 {
 	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
 	size_t count = size / sizeof(insn_ref_t);
 	DR_ASSERT(size % sizeof(insn_ref_t) == 0);
-	fwrite(buf_base, sizeof(insn_ref_t), count, data->peek_trace->insn_trace);
+	write_stream(data, STREAM_INSN_TRACE, data->peek_trace->insn_trace, buf_base, size);
 	data->num_refs += count;
+	if (options.order) add_order(data, data->num_refs + 1);
+}
+
+static bb_entry_t *get_bb(uint32_t bb_id)
+{
+	return &bb_chunks[bb_id / BB_CHUNK_SIZE][bb_id % BB_CHUNK_SIZE];
+}
+
+static uint64_t *get_bb_counter(uint32_t bb_id)
+{
+	return &bb_count_chunks[bb_id / BB_CHUNK_SIZE][bb_id % BB_CHUNK_SIZE];
+}
+
+static void flush_bbrefs(void *drcontext, void *buf_base, size_t size)
+{
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	bb_ref_t *bb_ref = buf_base;
+	size_t count = size / sizeof(bb_ref_t);
+	size_t x;
+	DR_ASSERT(size % sizeof(bb_ref_t) == 0);
+	write_stream(data, STREAM_INSN_TRACE, data->peek_trace->insn_trace, buf_base, size);
+
+	// Count the instructions. An early exit marker takes back what the block before it did not execute.
+	for (x=0; x<count; x++, bb_ref++)
+	{
+		if (bb_ref->id & BB_REF_EARLY_EXIT)
+		{
+			if (data->last_bb_id != BB_ID_NONE)
+				data->num_refs -= get_bb(data->last_bb_id)->num_insns - (bb_ref->id & ~BB_REF_EARLY_EXIT);
+			continue;
+		}
+		data->last_bb_id = bb_ref->id;
+		data->num_refs += get_bb(bb_ref->id)->num_insns;
+	}
+}
+
+static void flush_branchrefs(void *drcontext, void *buf_base, size_t size)
+{
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	DR_ASSERT(size % sizeof(branch_ref_t) == 0);
+	write_stream(data, STREAM_INSN_TRACE, data->peek_trace->insn_trace, buf_base, size);
+}
+
+static void flush_memaddrs(void *drcontext, void *buf_base, size_t size)
+{
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	DR_ASSERT(size % sizeof(memaddr_t) == 0);
+	write_stream(data, STREAM_MEMADDRS, data->peek_trace->memaddrs, buf_base, size);
+}
+
+static void flush_regfile_delta(per_thread_t *data, uint8_t *regfile, size_t count)
+{
+	const size_t max_record_size = regfile_delta_max_size(regfile_size);
+	size_t delta_size = 0;
+	uint64_t keyidx[64];
+	size_t num_keys = 0;
+	size_t x;
+
+	for (x=0; x<count; x++, regfile+=regfile_size)
+	{
+		if (data->regfile_count % options.keyframe == 0)
+		{
+			// Keyframe. Remember where it starts.
+			keyidx[num_keys++] = data->regfile_offset + delta_size;
+			if (num_keys == sizeof(keyidx)/sizeof(keyidx[0]))
+			{
+				writer_write(data->peek_trace->regfile_keyidx, keyidx, sizeof(keyidx));
+				num_keys = 0;
+			}
+			memcpy(data->delta_buf + delta_size, regfile, regfile_size);
+			delta_size += regfile_size;
+		}
+		else
+		{
+			delta_size += regfile_delta_encode((uint8_t *)&data->regfile_prev, regfile, regfile_size, data->delta_buf + delta_size);
+		}
+		memcpy(&data->regfile_prev, regfile, regfile_size);
+		data->regfile_count++;
+
+		if (DELTA_BUF_SIZE - delta_size < max_record_size)
+		{
+			write_stream(data, STREAM_REGFILE, data->peek_trace->regfile, data->delta_buf, delta_size);
+			data->regfile_offset += delta_size;
+			delta_size = 0;
+		}
+	}
+	write_stream(data, STREAM_REGFILE, data->peek_trace->regfile, data->delta_buf, delta_size);
+	data->regfile_offset += delta_size;
+	writer_write(data->peek_trace->regfile_keyidx, keyidx, num_keys * sizeof(uint64_t));
 }
 
 static void flush_regfile(void *drcontext, void *buf_base, size_t size)
 {
 	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
-	size_t count = size / sizeof(regfile_t);
-	DR_ASSERT(size % sizeof(regfile_t) == 0);
-	fwrite(buf_base, sizeof(regfile_t), count, data->peek_trace->regfile);
+	size_t count = size / regfile_size;
+	DR_ASSERT(size % regfile_size == 0);
+	if (options.keyframe)
+		flush_regfile_delta(data, buf_base, count);
+	else
+		write_stream(data, STREAM_REGFILE, data->peek_trace->regfile, buf_base, size);
 }
 
 static void flush_memrefs(void *drcontext, void *buf_base, size_t size)
 {
 	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
-	size_t count = size / sizeof(memref_t);
 	DR_ASSERT(size % sizeof(memref_t) == 0);
-	fwrite(buf_base, sizeof(memref_t), count, data->peek_trace->memrefs);
+	write_stream(data, STREAM_MEMREFS, data->peek_trace->memrefs, buf_base, size);
 }
 
 static void flush_memfile(void *drcontext, void *buf_base, size_t size)
 {
 	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
-	size_t count = size / sizeof(memfile_t);
-	DR_ASSERT(size % sizeof(memfile_t) == 0);
-	fwrite(buf_base, sizeof(memfile_t), count, data->peek_trace->memfile);
+	DR_ASSERT(size % (options.memdesc ? sizeof(uint64_t) : sizeof(memfile_t)) == 0);
+
+	// Wide operands point into memfile.ext. Their records come in the same order.
+	if (options.memval)
+	{
+		memfile_t *mem = buf_base;
+		size_t x;
+		for (x=0; x<size/sizeof(memfile_t); x++, mem++)
+		{
+			uint32_t ext_size = memfile_ext_size(mem->size);
+			if (!ext_size) continue;
+			mem->value = data->memext_offset;
+			data->memext_offset += ext_size;
+		}
+	}
+	write_stream(data, STREAM_MEMFILE, data->peek_trace->memfile, buf_base, size);
+}
+
+#ifdef HAS_MEMVAL
+static void flush_memext(void *drcontext, void *buf_base, size_t size)
+{
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	writer_write(data->peek_trace->memfile_ext, buf_base, size);
+}
+#endif
+
+#ifdef HAS_REGDEREF
+static void flush_regderef(void *drcontext, void *buf_base, size_t size)
+{
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	DR_ASSERT(size % sizeof(regderef_t) == 0);
+	writer_write(data->peek_trace->regderef, buf_base, size);
 }
+#endif
 
 /*
 
@@ -189,105 +741,6 @@ static void flush_map(void *drcontext, void *buf_base, size_t size)
 
 */
 
-void log_registers_and_memory(regfile_t *regfile_ptr)
-{
-    // Array of register names
-    const char *gpr_names[] = {
-        "rdi", "rsi", "rsp", "rbp", "rbx", "rdx", "rcx", "rax",
-        "r8 ", "r9 ", "r10", "r11", "r12", "r13", "r14", "r15",
-        "rflags", "rip"
-    };
-
-    // Array of register values
-    uint64_t gpr_values[] = {
-        regfile_ptr->gpr.reg_rdi,
-        regfile_ptr->gpr.reg_rsi,
-        regfile_ptr->gpr.reg_rsp,
-        regfile_ptr->gpr.reg_rbp,
-        regfile_ptr->gpr.reg_rbx,
-        regfile_ptr->gpr.reg_rdx,
-        regfile_ptr->gpr.reg_rcx,
-        regfile_ptr->gpr.reg_rax,
-        regfile_ptr->gpr.reg_r8,
-        regfile_ptr->gpr.reg_r9,
-        regfile_ptr->gpr.reg_r10,
-        regfile_ptr->gpr.reg_r11,
-        regfile_ptr->gpr.reg_r12,
-        regfile_ptr->gpr.reg_r13,
-        regfile_ptr->gpr.reg_r14,
-        regfile_ptr->gpr.reg_r15,
-        regfile_ptr->gpr.reg_rflags,
-        regfile_ptr->gpr.reg_rip
-    };
-
-    // Number of general-purpose registers
-    int num_regs = sizeof(gpr_values) / sizeof(gpr_values[0]);
-
-    // Print the header
-    printf("\tRegisters and Memory Contents:\n");
-
-    // Iterate over each register
-    for (int i = 0; i < num_regs; i++)
-    {
-        uint64_t reg_value = gpr_values[i];
-        printf("\t  %s: 0x%016" PRIx64, gpr_names[i], reg_value);
-
-        // Skip reading memory for rflags and rip (they are not pointers)
-        if (strcmp(gpr_names[i], "rflags") == 0 || strcmp(gpr_names[i], "rip") == 0)
-        {
-            printf("\n");
-            continue;
-        }
-
-        // Safely read memory at the register value
-        uint64_t mem_value = 0;
-        size_t bytes_read = 0;
-
-        // Use dr_safe_read to prevent crashes
-        if (dr_safe_read((void *)reg_value, sizeof(mem_value), &mem_value, &bytes_read))
-        {
-            printf(" -> Memory[0x%016" PRIx64 "]: 0x%016" PRIx64 "\n", reg_value, mem_value);
-        }
-        else
-        {
-            printf(" -> Memory[0x%016" PRIx64 "]: [Invalid Memory Access]\n", reg_value);
-        }
-    }
-    printf("\n");
-}
-
-
-// KH: This function actually messes up the buffer flush. Need to fix it! 
-static dr_signal_action_t event_signal(void *drcontext, dr_siginfo_t *info)
-{
-	/* Flush data in buffers when receiving SIGINT(2), SIGABRT(6), SIGSEGV(11) */
-	if ((info->sig == SIGINT) || (info->sig == SIGABRT) || (info->sig ==  SIGSEGV))
-	{
-		printf("Peekaboo: Signal %d caught.\n", info->sig);
-		per_thread_t *data;
-		data = drmgr_get_tls_field(drcontext, tls_idx);
-		dr_mutex_lock(mutex);
-
-		flush_insnrefs(drcontext, insn_ref_buf, INSN_REF_SIZE);
-		flush_memfile(drcontext, memfile_buf, MEMFILE_SIZE);
-		flush_memrefs(drcontext, memrefs_buf, MEM_REFS_SIZE);
-		flush_regfile(drcontext, regfile_buf, REG_BUF_SIZE);
-
-		fflush(data->peek_trace->insn_trace);
-		fflush(data->peek_trace->bytes_map);
-		fflush(data->peek_trace->regfile);
-		fflush(data->peek_trace->memfile);
-		fflush(data->peek_trace->memrefs);
-		fflush(data->peek_trace->metafile);
-			
-		dr_mutex_unlock(mutex);
-	}
-
-	/* Deliver the signal to app */
-	return DR_SIGNAL_DELIVER;
-}
-
-
 static void save_regfile()
 {
 	void *drcontext = dr_get_current_drcontext();
@@ -295,7 +748,7 @@ static void save_regfile()
 	regfile_ptr = (regfile_t *) drx_buf_get_buffer_ptr(drcontext, regfile_buf);
 
 	
-	dr_mcontext_t mc = {sizeof(mc), DR_MC_ALL};
+	dr_mcontext_t mc = {sizeof(mc), REGFILE_MC_FLAGS};
 	dr_get_mcontext(drcontext, &mc);
 	copy_regfile(regfile_ptr, &mc);
 
@@ -311,155 +764,1952 @@ static void save_regfile()
 	// printf("memref_count:%llu\n", size/sizeof(mem_ref_t));
 }
 
-static void instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write)
+#ifdef HAS_REGDEREF
+/* Reads the 8 bytes each GPR of the current regfile record points to. The
+ * GPRs must have been stored into the record already.
+ */
+static void save_regderef()
 {
-	/* We need two scratch registers */
-	reg_id_t reg_ptr, reg_tmp;
-	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) !=
-			DRREG_SUCCESS ||
-			drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) !=
-			DRREG_SUCCESS) {
-		DR_ASSERT(false); /* cannot recover */
-		return;
-	}
-
-	uint32_t size = drutil_opnd_mem_size_in_bytes(ref, where);
-	drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg_tmp, reg_ptr);
+	void *drcontext = dr_get_current_drcontext();
+	regfile_t *regfile_ptr = (regfile_t *) drx_buf_get_buffer_ptr(drcontext, regfile_buf);
+	regderef_t *regderef_ptr = (regderef_t *) drx_buf_get_buffer_ptr(drcontext, regderef_buf);
+	uint64_t *gpr = (uint64_t *) &regfile_ptr->gpr;
 
-	drx_buf_insert_load_buf_ptr(drcontext, memfile_buf, ilist, where, reg_ptr);
-	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, DR_REG_NULL, opnd_create_reg(reg_tmp), OPSZ_PTR, offsetof(memfile_t, addr)); 
-	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(0), OPSZ_8, offsetof(memfile_t, value));
-	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(size), OPSZ_4, offsetof(memfile_t, size));
-	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(write?1:0), OPSZ_4, offsetof(memfile_t, status));
-	
-	app_pc pc = instr_get_app_pc(where);
-	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(pc), OPSZ_8, offsetof(memfile_t, pc));
-	
-	drx_buf_insert_update_buf_ptr(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, sizeof(memfile_t));
+	regderef_ptr->valid = 0;
+	regderef_ptr->reserved = 0;
+	for (int x=0; x<AMD64_NUM_DEREF_GPRS; x++)
+	{
+		// Use dr_safe_read to prevent crashes
+		if (dr_safe_read((void *)gpr[x], sizeof(uint64_t), &regderef_ptr->value[x], NULL))
+			regderef_ptr->valid |= 1 << x;
+		else
+			regderef_ptr->value[x] = 0;
+	}
+}
+#endif
 
-	//printf("sizesize:%d\n", size);
-	//disassemble_with_info(drcontext, instr_get_app_pc(where), 0, true, true);
+#ifdef INLINE_GPR_CAPTURE
+/* Stores the app's GPRs and rflags into the current regfile record with inline
+ * stores, so that no context switch is needed for them. reg_ptr must already
+ * hold the regfile buffer pointer.
+ */
+static void insert_save_gpr(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t reg_ptr, reg_id_t reg_tmp)
+{
+	const short gpr_base = offsetof(regfile_amd64_t, gpr);
+	int x;
+
+	/* drreg restores the registers other passes on this instruction reserved
+	 * lazily, and our scratch registers hold the buffer pointer and junk. Ask
+	 * drreg for the app value of every GPR. A dead register has no app value
+	 * to restore; store 0.
+	 */
+	for (x=0; x<NUM_GPR_SLOTS; x++)
+	{
+		reg_id_t reg = gpr_slots[x].reg;
+		short offset = gpr_base + gpr_slots[x].offset;
+		if (drreg_get_app_value(drcontext, ilist, where, reg, reg_tmp) == DRREG_SUCCESS)
+			drx_buf_insert_buf_store(drcontext, regfile_buf, ilist, where, reg_ptr, DR_REG_NULL, opnd_create_reg(reg_tmp), OPSZ_8, offset);
+		else
+			drx_buf_insert_buf_store(drcontext, regfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(0), OPSZ_8, offset);
+	}
 
-	if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
-	    drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+	// rflags: pushf/pop below the red zone. lea and pop leave the flags untouched.
+	if (drreg_restore_app_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
 		DR_ASSERT(false);
+	instrlist_meta_preinsert(ilist, where, INSTR_CREATE_lea(drcontext, opnd_create_reg(DR_REG_XSP), opnd_create_base_disp(DR_REG_XSP, DR_REG_NULL, 0, -128, OPSZ_lea)));
+	instrlist_meta_preinsert(ilist, where, INSTR_CREATE_pushf(drcontext));
+	instrlist_meta_preinsert(ilist, where, INSTR_CREATE_pop(drcontext, opnd_create_reg(reg_tmp)));
+	instrlist_meta_preinsert(ilist, where, INSTR_CREATE_lea(drcontext, opnd_create_reg(DR_REG_XSP), opnd_create_base_disp(DR_REG_XSP, DR_REG_NULL, 0, 128, OPSZ_lea)));
+	drx_buf_insert_buf_store(drcontext, regfile_buf, ilist, where, reg_ptr, DR_REG_NULL, opnd_create_reg(reg_tmp), OPSZ_8, gpr_base + offsetof(amd64_cpu_gr_t, reg_rflags));
 }
+#endif
 
-static void instrument_insn(void *drcontext, instrlist_t *ilist, instr_t *where, int mem_count)
+#ifdef HAS_MEMVAL
+/* Loads size bytes at [base + disp] into reg, zero extended. Sizes that are
+ * not 1, 2, 4 or 8 are not loaded; reg gets 0 so nothing past the operand is
+ * read. A load from app memory that may fault passes its app pc, so the fault
+ * shows up as the app instruction's.
+ */
+static void insert_load_value(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t reg, reg_id_t base, int disp, uint32_t size, app_pc fault_pc)
 {
-	reg_id_t reg_ptr, reg_tmp;
-	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
-	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS)
+	instr_t *load;
+	switch (size)
 	{
-		DR_ASSERT(false);
+		case 1:
+			load = INSTR_CREATE_movzx(drcontext, opnd_create_reg(reg), OPND_CREATE_MEM8(base, disp));
+			break;
+		case 2:
+			load = INSTR_CREATE_movzx(drcontext, opnd_create_reg(reg), OPND_CREATE_MEM16(base, disp));
+			break;
+		case 4:
+			load = INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_resize_to_opsz(reg, OPSZ_4)), OPND_CREATE_MEM32(base, disp));
+			break;
+		case 8:
+			load = INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg), OPND_CREATE_MEM64(base, disp));
+			break;
+		default:
+			instrlist_meta_preinsert(ilist, where, INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg), OPND_CREATE_INT32(0)));
+			return;
+	}
+	if (fault_pc == NULL)
+	{
+		instrlist_meta_preinsert(ilist, where, load);
 		return;
 	}
+	instr_set_translation(load, fault_pc);
+	instrlist_meta_fault_preinsert(ilist, where, load);
+}
 
-	int insn_len = instr_length(drcontext, where);
-	app_pc pc = instr_get_app_pc(where);
-
-	// instrument update to insn_ref, pushes a 32/64-bit pc into the buffer
-	drx_buf_insert_load_buf_ptr(drcontext, insn_ref_buf, ilist, where, reg_ptr);
-	#ifdef X64
-		drx_buf_insert_buf_store(drcontext, insn_ref_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(pc), OPSZ_8, 0);
-	#else
-		drx_buf_insert_buf_store(drcontext, insn_ref_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(pc), OPSZ_4, 0);
-	#endif
-	drx_buf_insert_update_buf_ptr(drcontext, insn_ref_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(insn_ref_t));
-
-	// ZL: insert a write 0 into the stream using dynamorio sanctioned instruction to trigger the flushing of file from trace buffer.
-	drx_buf_insert_load_buf_ptr(drcontext, regfile_buf, ilist, where, reg_ptr);
-	drx_buf_insert_buf_store(drcontext, regfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(0), OPSZ_4, 0);
-
-	// ZL: insert write to store mem_count into memrefs
-	drx_buf_insert_load_buf_ptr(drcontext, memrefs_buf, ilist, where, reg_ptr);
-	drx_buf_insert_buf_store(drcontext, memrefs_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(mem_count), OPSZ_4, offsetof(memref_t, length));
-	drx_buf_insert_update_buf_ptr(drcontext, memrefs_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(memref_t));
+/* Records the values of memory operands whose memfile entries and memfile.ext
+ * records are right behind the buffer pointers. The addresses are taken from
+ * the entries. Wide values are copied 8 bytes at a time, the last 8 from
+ * addr + size - 8 so nothing past the operand is read.
+ */
+static void insert_save_values(void *drcontext, instrlist_t *ilist, instr_t *where, mem_value_t *values, uint32_t num_values, app_pc fault_pc)
+{
+	reg_id_t reg_ptr, reg_addr, reg_ext;
+	uint32_t x, offset;
+	if (num_values == 0) return;
 
-	// instruments a clean call to save the register info
-	dr_insert_clean_call(drcontext, ilist, where, (void *)save_regfile, false, 0);
-	drx_buf_insert_load_buf_ptr(drcontext, regfile_buf, ilist, where, reg_ptr);
+	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_addr) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ext) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false);
+		return;
+	}
 
-	// KH: We save app_pc+instr_len into reg_rip, though it is not the actually rip.  
-	#ifdef X86
-		#ifdef X64
-			drx_buf_insert_buf_store(drcontext, regfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(pc + insn_len), OPSZ_8, offsetof(regfile_amd64_t, gpr) + offsetof(amd64_cpu_gr_t, reg_rip));
-		#else
-		// We currently don't have eip reg for 32bit X86
-		#endif
-	#endif
-	
-	drx_buf_insert_update_buf_ptr(drcontext, regfile_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(regfile_t));
+	for (x=0; x<num_values; x++)
+	{
+		short entry = values[x].entry;
+		uint32_t size = values[x].size;
 
+		drx_buf_insert_load_buf_ptr(drcontext, memfile_buf, ilist, where, reg_ptr);
+		instrlist_meta_preinsert(ilist, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_addr), OPND_CREATE_MEM64(reg_ptr, entry + offsetof(memfile_t, addr))));
+		if (memfile_ext_size(size))
+		{
+			drx_buf_insert_load_buf_ptr(drcontext, memext_buf, ilist, where, reg_ext);
+			for (offset=0; offset<size; offset+=8)
+			{
+				if (offset + 8 > size) offset = size - 8;
+				insert_load_value(drcontext, ilist, where, reg_ptr, reg_addr, offset, 8, fault_pc);
+				drx_buf_insert_buf_store(drcontext, memext_buf, ilist, where, reg_ext, DR_REG_NULL, opnd_create_reg(reg_ptr), OPSZ_8, values[x].ext + offset);
+			}
+		}
+		else
+		{
+			insert_load_value(drcontext, ilist, where, reg_addr, reg_addr, 0, size, fault_pc);
+			drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, DR_REG_NULL, opnd_create_reg(reg_addr), OPSZ_8, entry + offsetof(memfile_t, value));
+		}
+	}
 
 	if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
-	    drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+	    drreg_unreserve_register(drcontext, ilist, where, reg_addr) != DRREG_SUCCESS ||
+	    drreg_unreserve_register(drcontext, ilist, where, reg_ext) != DRREG_SUCCESS)
 		DR_ASSERT(false);
 }
+#endif
+
+/* modules gets a module_event_t per load and unload. The id of a module is a
+ * hash of its GNU build id, or of its path if it has none, so it is the same
+ * in every run.
+ */
+static void read_build_id(const module_data_t *info, module_event_t *event)
+{
+	ElfW(Ehdr) ehdr;
+	ElfW(Phdr) phdr;
+	ElfW(Addr) base = ~(ElfW(Addr))0;
+	size_t x;
+
+	if (!dr_safe_read(info->start, sizeof(ehdr), &ehdr, NULL) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0) return;
+	// The module starts at its lowest segment. Non-PIE executables have absolute vaddrs.
+	for (x=0; x<ehdr.e_phnum; x++)
+		if (dr_safe_read(info->start + ehdr.e_phoff + x * sizeof(phdr), sizeof(phdr), &phdr, NULL) && phdr.p_type == PT_LOAD && phdr.p_vaddr < base)
+			base = phdr.p_vaddr & ~(ElfW(Addr))(dr_page_size() - 1);
+	for (x=0; x<ehdr.e_phnum; x++)
+	{
+		if (!dr_safe_read(info->start + ehdr.e_phoff + x * sizeof(phdr), sizeof(phdr), &phdr, NULL) || phdr.p_type != PT_NOTE) continue;
+		app_pc note = info->start + (phdr.p_vaddr - base);
+		app_pc note_end = note + phdr.p_memsz;
+		ElfW(Nhdr) nhdr;
+		while (note + sizeof(nhdr) <= note_end && dr_safe_read(note, sizeof(nhdr), &nhdr, NULL))
+		{
+			app_pc desc = note + sizeof(nhdr) + ((nhdr.n_namesz + 3) & ~3);
+			if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 && nhdr.n_descsz <= MODULE_BUILD_ID_MAX &&
+			    dr_safe_read(desc, nhdr.n_descsz, event->build_id, NULL))
+			{
+				event->build_id_size = nhdr.n_descsz;
+				return;
+			}
+			note = desc + ((nhdr.n_descsz + 3) & ~3);
+		}
+	}
+}
+
+// Fills in the event of a module. Returns the 64-bit hash its id is made from.
+static uint64_t init_module_event(const module_data_t *info, uint32_t flags, module_event_t *event)
+{
+	const char *name = info->full_path ? info->full_path : dr_module_preferred_name(info);
+	const uint8_t *key;
+	size_t key_size, x;
+	uint64_t hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	memset(event, 0, sizeof(module_event_t));
+	event->base = (uint64_t)(ptr_uint_t)info->start;
+	event->size = info->end - info->start;
+	event->pid = dr_get_process_id();
+	event->flags = flags;
+	if (name) strncpy(event->path, name, sizeof(event->path) - 1);
+	read_build_id(info, event);
+
+	key = event->build_id_size ? event->build_id : (const uint8_t *)event->path;
+	key_size = event->build_id_size ? event->build_id_size : strlen(event->path);
+	for (x=0; x<key_size; x++)
+		hash = (hash ^ key[x]) * 0x100000001b3ULL;
+	event->id = (uint32_t)(hash ^ (hash >> 32)) & 0x7fffffff;
+	return hash;
+}
 
+// A forked child shares the file like insn.bytemap
+static void write_module_event(module_event_t *event)
+{
+	flock(fileno(modules_file), LOCK_EX);
+	fwrite(event, sizeof(module_event_t), 1, modules_file);
+	fflush(modules_file);
+	flock(fileno(modules_file), LOCK_UN);
+}
 
-static dr_emit_flags_t save_bb_rawbytes(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data)
+static void add_loaded_module(const module_data_t *info)
 {
-	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
-	bytes_map_t bytes_map[MAX_NUM_BYTES_MAP];
-	uint idx=0;
-	instr_t *insn;
+	module_event_t event;
+	uint64_t hash = init_module_event(info, 0, &event);
+	loaded_module_t *module = NULL;
+	bool collides = false;
+	uint32_t x;
 
-	for (insn = instrlist_first_app(bb), idx=0; insn && idx < MAX_NUM_BYTES_MAP; insn=instr_get_next_app(insn), idx++)
+	dr_mutex_lock(mutex);
+	for (x=0; x<num_loaded_modules; x++)
+	{
+		if (loaded_modules[x].id != event.id) continue;
+		if (loaded_modules[x].hash != hash)
+			collides = true;
+		else if (!loaded_modules[x].loaded)
+			module = &loaded_modules[x];
+	}
+	// Module pcs of the two could not be told apart, so the newcomer keeps absolute pcs
+	if (collides && options.module_pcs)
+		printf("Peekaboo: Another module has the id of %s. Its pcs stay absolute.\n", event.path);
+	if (module == NULL)
+	{
+		if (num_loaded_modules == MAX_LOADED_MODULES)
+			PEEKABOO_DIE("Peekaboo: More than %d modules are loaded.\n", MAX_LOADED_MODULES);
+		module = &loaded_modules[num_loaded_modules++];
+	}
+	module->start = info->start;
+	module->end = info->end;
+	module->hash = hash;
+	module->id = event.id;
+	module->loaded = true;
+	module->relative = !collides && event.size <= UINT32_MAX;
+	write_module_event(&event);
+	dr_mutex_unlock(mutex);
+}
+
+static void remove_loaded_module(const module_data_t *info)
+{
+	module_event_t event;
+	uint32_t x;
+
+	init_module_event(info, MODULE_EVENT_UNLOAD, &event);
+	dr_mutex_lock(mutex);
+	for (x=0; x<num_loaded_modules; x++)
+		if (loaded_modules[x].loaded && loaded_modules[x].start == info->start)
+		{
+			loaded_modules[x].loaded = false;
+			break;
+		}
+	write_module_event(&event);
+	dr_mutex_unlock(mutex);
+}
+
+// A forked child logs the modules it inherited under its own pid
+static void log_inherited_modules(void)
+{
+	dr_module_iterator_t *iter = dr_module_iterator_start();
+	module_event_t event;
+	while (dr_module_iterator_hasnext(iter))
+	{
+		module_data_t *info = dr_module_iterator_next(iter);
+		init_module_event(info, 0, &event);
+		write_module_event(&event);
+		dr_free_module_data(info);
+	}
+	dr_module_iterator_stop(iter);
+}
+
+// -module_pcs: the pc as the trace stores it. Must hold the mutex.
+static uint64_t stored_pc(app_pc pc)
+{
+	uint32_t x;
+	if (options.module_pcs)
+		for (x=0; x<num_loaded_modules; x++)
+			if (loaded_modules[x].loaded && loaded_modules[x].relative && pc >= loaded_modules[x].start && pc < loaded_modules[x].end)
+				return MODULE_PC(loaded_modules[x].id, pc - loaded_modules[x].start);
+	return (uint64_t)(ptr_uint_t)pc;
+}
+
+static uint64_t trace_pc(app_pc pc)
+{
+	uint64_t stored;
+	if (!options.module_pcs) return (uint64_t)(ptr_uint_t)pc;
+	dr_mutex_lock(mutex);
+	stored = stored_pc(pc);
+	dr_mutex_unlock(mutex);
+	return stored;
+}
+
+// One memfile entry for the memory operand ref of instr, inserted before where
+static void instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *instr, instr_t *where, opnd_t ref, bool write)
+{
+	/* We need two scratch registers */
+	reg_id_t reg_ptr, reg_tmp;
+	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) !=
+			DRREG_SUCCESS ||
+			drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) !=
+			DRREG_SUCCESS) {
+		DR_ASSERT(false); /* cannot recover */
+		return;
+	}
+
+	uint32_t size = drutil_opnd_mem_size_in_bytes(ref, instr);
+	drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg_tmp, reg_ptr);
+
+	drx_buf_insert_load_buf_ptr(drcontext, memfile_buf, ilist, where, reg_ptr);
+	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, DR_REG_NULL, opnd_create_reg(reg_tmp), OPSZ_PTR, offsetof(memfile_t, addr)); 
+	// -memdesc: the rest is in insn.memdesc
+	if (options.memdesc)
+	{
+		drx_buf_insert_update_buf_ptr(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, sizeof(uint64_t));
+		if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+		    drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+			DR_ASSERT(false);
+		return;
+	}
+	// -memval: the value is filled in by insert_save_values(), except for what a call pushes, which is known now
+	uint64_t value = (options.memval && write && instr_is_call(instr)) ? (uint64_t)instr_get_app_pc(instr) + instr_length(drcontext, instr) : 0;
+	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(value), OPSZ_8, offsetof(memfile_t, value));
+	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(size), OPSZ_4, offsetof(memfile_t, size));
+	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(write?1:0), OPSZ_4, offsetof(memfile_t, status));
+	
+	uint64_t pc = trace_pc(instr_get_app_pc(instr));
+	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(pc), OPSZ_8, offsetof(memfile_t, pc));
+	
+	drx_buf_insert_update_buf_ptr(drcontext, memfile_buf, ilist, where, reg_ptr, reg_tmp, sizeof(memfile_t));
+
+	//printf("sizesize:%d\n", size);
+	//disassemble_with_info(drcontext, instr_get_app_pc(instr), 0, true, true);
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+	    drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+}
+
+// -memaddr: one memaddr_t for a memory operand of instr, inserted before where
+static void insert_memaddr(void *drcontext, instrlist_t *ilist, instr_t *instr, instr_t *where, reg_id_t reg_ptr, reg_id_t reg_tmp, opnd_t ref, bool write, uint8_t pc_delta)
+{
+	uint32_t size = drutil_opnd_mem_size_in_bytes(ref, instr);
+	uint8_t info = (write ? MEMADDR_WRITE : 0) | ((size > 64 ? 64 : size ? size : 1) - 1);
+
+	drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg_tmp, reg_ptr);
+	drx_buf_insert_load_buf_ptr(drcontext, memaddr_buf, ilist, where, reg_ptr);
+	drx_buf_insert_buf_store(drcontext, memaddr_buf, ilist, where, reg_ptr, DR_REG_NULL, opnd_create_reg(reg_tmp), OPSZ_PTR, offsetof(memaddr_t, addr));
+	// info and pc_delta in one store
+	drx_buf_insert_buf_store(drcontext, memaddr_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT16(info | pc_delta << 8), OPSZ_2, offsetof(memaddr_t, info));
+	drx_buf_insert_update_buf_ptr(drcontext, memaddr_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(memaddr_t));
+}
+
+static bool accesses_memory(instr_t *instr)
+{
+	return instr_reads_memory(instr) || instr_writes_memory(instr);
+}
+
+/* Memory operands that are really accessed. Those of lea, nops with a ModRM
+ * and prefetches never are, and loading their values could fault.
+ */
+static bool is_mem_src(instr_t *instr, int i)
+{
+	return instr_reads_memory(instr) && !instr_is_prefetch(instr) && opnd_is_memory_reference(instr_get_src(instr, i));
+}
+
+static bool is_mem_dst(instr_t *instr, int i)
+{
+	return instr_writes_memory(instr) && opnd_is_memory_reference(instr_get_dst(instr, i));
+}
+
+/* -memaddr: records the memory accesses of instr and nothing else. The first
+ * instruction of a block that accesses memory records its pc, the ones after
+ * it how far they are from the one before.
+ */
+static void instrument_memaddrs(void *drcontext, instrlist_t *ilist, instr_t *instr, instr_t *where)
+{
+	app_pc pc = instr_get_app_pc(instr);
+	instr_t *prev;
+	int i;
+	for (prev = instr_get_prev_app(instr); prev; prev = instr_get_prev_app(prev))
+		if (accesses_memory(prev)) break;
+
+	reg_id_t reg_ptr, reg_tmp;
+	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false);
+		return;
+	}
+
+	uint8_t pc_delta = 0;
+	if (prev == NULL || pc < instr_get_app_pc(prev) || pc - instr_get_app_pc(prev) > 0xff)
+	{
+		drx_buf_insert_load_buf_ptr(drcontext, memaddr_buf, ilist, where, reg_ptr);
+		drx_buf_insert_buf_store(drcontext, memaddr_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(pc), OPSZ_8, offsetof(memaddr_t, addr));
+		drx_buf_insert_buf_store(drcontext, memaddr_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT16(MEMADDR_PC), OPSZ_2, offsetof(memaddr_t, info));
+		drx_buf_insert_update_buf_ptr(drcontext, memaddr_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(memaddr_t));
+	}
+	else pc_delta = pc - instr_get_app_pc(prev);
+
+	// Only the first access moves the pc
+	if (instr_reads_memory(instr))
+		for (i = 0; i < instr_num_srcs(instr); i++)
+			if (opnd_is_memory_reference(instr_get_src(instr, i)))
+			{
+				insert_memaddr(drcontext, ilist, instr, where, reg_ptr, reg_tmp, instr_get_src(instr, i), false, pc_delta);
+				pc_delta = 0;
+			}
+	if (instr_writes_memory(instr))
+		for (i = 0; i < instr_num_dsts(instr); i++)
+			if (opnd_is_memory_reference(instr_get_dst(instr, i)))
+			{
+				insert_memaddr(drcontext, ilist, instr, where, reg_ptr, reg_tmp, instr_get_dst(instr, i), true, pc_delta);
+				pc_delta = 0;
+			}
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+	    drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+}
+
+static void instrument_insn(void *drcontext, instrlist_t *ilist, instr_t *instr, instr_t *where, int mem_count)
+{
+	reg_id_t reg_ptr, reg_tmp;
+	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false);
+		return;
+	}
+
+	int insn_len = instr_length(drcontext, instr);
+	app_pc pc = instr_get_app_pc(instr);
+
+	// instrument update to insn_ref, pushes a 32/64-bit pc into the buffer.
+	// With -bb_trace, instrument_bb() has recorded the whole block already.
+	if (!options.bb_trace)
+	{
+		drx_buf_insert_load_buf_ptr(drcontext, insn_ref_buf, ilist, where, reg_ptr);
+		#ifdef X64
+			drx_buf_insert_buf_store(drcontext, insn_ref_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(trace_pc(pc)), OPSZ_8, 0);
+		#else
+			drx_buf_insert_buf_store(drcontext, insn_ref_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(pc), OPSZ_4, 0);
+		#endif
+		drx_buf_insert_update_buf_ptr(drcontext, insn_ref_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(insn_ref_t));
+	}
+
+	// ZL: insert a write 0 into the stream using dynamorio sanctioned instruction to trigger the flushing of file from trace buffer.
+	drx_buf_insert_load_buf_ptr(drcontext, regfile_buf, ilist, where, reg_ptr);
+	drx_buf_insert_buf_store(drcontext, regfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(0), OPSZ_4, 0);
+
+	// ZL: insert write to store mem_count into memrefs
+	// With -memdesc, insn.memdesc has it instead
+	if (!options.memdesc)
+	{
+		drx_buf_insert_load_buf_ptr(drcontext, memrefs_buf, ilist, where, reg_ptr);
+		drx_buf_insert_buf_store(drcontext, memrefs_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(mem_count), OPSZ_4, offsetof(memref_t, length));
+		drx_buf_insert_update_buf_ptr(drcontext, memrefs_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(memref_t));
+	}
+
+	#ifdef INLINE_GPR_CAPTURE
+	drx_buf_insert_load_buf_ptr(drcontext, regfile_buf, ilist, where, reg_ptr);
+	insert_save_gpr(drcontext, ilist, where, reg_ptr, reg_tmp);
+	#endif
+
+	// instruments a clean call to save the register info that can't be stored inline
+	if (REGFILE_NEEDS_CLEAN_CALL)
+	{
+		dr_insert_clean_call(drcontext, ilist, where, (void *)save_regfile, false, 0);
+		drx_buf_insert_load_buf_ptr(drcontext, regfile_buf, ilist, where, reg_ptr);
+	}
+
+	#ifdef HAS_REGDEREF
+	if (options.regderef)
+	{
+		// Same trick as above: trigger the flush of the regderef buffer before the clean call writes to it
+		drx_buf_insert_load_buf_ptr(drcontext, regderef_buf, ilist, where, reg_ptr);
+		drx_buf_insert_buf_store(drcontext, regderef_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(0), OPSZ_4, 0);
+		dr_insert_clean_call(drcontext, ilist, where, (void *)save_regderef, false, 0);
+		drx_buf_insert_load_buf_ptr(drcontext, regderef_buf, ilist, where, reg_ptr);
+		drx_buf_insert_update_buf_ptr(drcontext, regderef_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(regderef_t));
+		drx_buf_insert_load_buf_ptr(drcontext, regfile_buf, ilist, where, reg_ptr);
+	}
+	#endif
+
+	// KH: We save app_pc+instr_len into reg_rip, though it is not the actually rip.  
+	#ifdef X86
+		#ifdef X64
+			drx_buf_insert_buf_store(drcontext, regfile_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT64(pc + insn_len), OPSZ_8, offsetof(regfile_amd64_t, gpr) + offsetof(amd64_cpu_gr_t, reg_rip));
+		#else
+		// We currently don't have eip reg for 32bit X86
+		#endif
+	#endif
+	
+	drx_buf_insert_update_buf_ptr(drcontext, regfile_buf, ilist, where, reg_ptr, DR_REG_NULL, regfile_size);
+
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+	    drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+}
+
+
+static void instrument_bb(void *drcontext, instrlist_t *ilist, instr_t *where, uint32_t bb_id)
+{
+	reg_id_t reg_ptr, reg_tmp;
+	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false);
+		return;
+	}
+
+	drx_buf_insert_load_buf_ptr(drcontext, insn_ref_buf, ilist, where, reg_ptr);
+	drx_buf_insert_buf_store(drcontext, insn_ref_buf, ilist, where, reg_ptr, reg_tmp, OPND_CREATE_INT32(bb_id), OPSZ_4, offsetof(bb_ref_t, id));
+	drx_buf_insert_update_buf_ptr(drcontext, insn_ref_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(bb_ref_t));
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+	    drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+}
+
+/* Returns the id of the block starting at pc with num_insns instructions.
+ * New blocks go into insn.bbtable, or get a counter with -bb_counts. Must
+ * hold the mutex. A forked child keeps the ids it inherited and takes new
+ * ones from the clock it shares with the rest of the process tree.
+ */
+static uint32_t lookup_bb(app_pc pc, uint32_t num_insns)
+{
+	uint32_t bb_id = (uint32_t)(ptr_uint_t)hashtable_lookup(&bb_ids, pc);
+	if (bb_id && get_bb(bb_id - 1)->num_insns == num_insns) return bb_id - 1;
+
+	// A new block, or DR rebuilt the block at pc with a different length.
+	bb_id = __atomic_fetch_add(next_bb_id, 1, __ATOMIC_SEQ_CST);
+	if (bb_id / BB_CHUNK_SIZE >= MAX_BB_CHUNKS)
+		PEEKABOO_DIE("Peekaboo: Too many basic blocks for -bb_trace or -bb_counts (%u).\n", bb_id);
+	if (bb_chunks[bb_id / BB_CHUNK_SIZE] == NULL)
+	{
+		bb_chunks[bb_id / BB_CHUNK_SIZE] = dr_global_alloc(sizeof(bb_entry_t) * BB_CHUNK_SIZE);
+		memset(bb_chunks[bb_id / BB_CHUNK_SIZE], 0, sizeof(bb_entry_t) * BB_CHUNK_SIZE);
+		if (options.bb_counts)
+		{
+			bb_count_chunks[bb_id / BB_CHUNK_SIZE] = dr_global_alloc(sizeof(uint64_t) * BB_CHUNK_SIZE);
+			memset(bb_count_chunks[bb_id / BB_CHUNK_SIZE], 0, sizeof(uint64_t) * BB_CHUNK_SIZE);
+		}
+	}
+
+	bb_entry_t *bb = get_bb(bb_id);
+	bb->pc = stored_pc(pc);
+	bb->id = bb_id;
+	bb->num_insns = num_insns;
+	if (options.bb_trace)
+	{
+		// A forked child shares the file. Flush each entry so no child inherits it buffered.
+		flock(fileno(bb_table_file), LOCK_EX);
+		fwrite(bb, sizeof(bb_entry_t), 1, bb_table_file);
+		fflush(bb_table_file);
+		flock(fileno(bb_table_file), LOCK_UN);
+	}
+	if (bb_id >= num_bbs) num_bbs = bb_id + 1;
+	hashtable_add_replace(&bb_ids, pc, (void *)(ptr_uint_t)(bb_id + 1));
+	return bb_id;
+}
+
+// Appends the thread's buffered instructions to insn.bytemap
+static void flush_bytes_map(per_thread_t *data)
+{
+	if (data->num_bytes_map == 0) return;
+	if (options.live[0]) live_publish(LIVE_STREAM_BYTEMAP, 0, 0, data->bytes_map, data->num_bytes_map * sizeof(bytes_map_t));
+	// A forked child shares the file. flock() keeps the appends and the final sort apart.
+	flock(fileno(bytes_map_file), LOCK_EX);
+	fwrite(data->bytes_map, sizeof(bytes_map_t), data->num_bytes_map, bytes_map_file);
+	fflush(bytes_map_file);
+	flock(fileno(bytes_map_file), LOCK_UN);
+	data->num_bytes_map = 0;
+	if (data->num_memdescs == 0) return;
+	flock(fileno(memdesc_file), LOCK_EX);
+	fwrite(data->memdescs, sizeof(memdesc_t), data->num_memdescs, memdesc_file);
+	fflush(memdesc_file);
+	flock(fileno(memdesc_file), LOCK_UN);
+	data->num_memdescs = 0;
+}
+
+/* -memdesc: the memory operands of insn, in the order instrument_mem() records
+ * their addresses. Buffered with its bytes_map_t, so there is always room.
+ */
+static void save_memdesc(per_thread_t *data, instr_t *insn, app_pc pc)
+{
+	memdesc_t memdesc;
+	int i;
+	memset(&memdesc, 0, sizeof(memdesc_t));
+	memdesc.pc = (uint64_t)pc;
+	for (i = 0; i < instr_num_srcs(insn); i++)
+		if (is_mem_src(insn, i))
+		{
+			if (memdesc.num_mem < MEMDESC_MAX_OPNDS)
+				memdesc.sizes[memdesc.num_mem] = drutil_opnd_mem_size_in_bytes(instr_get_src(insn, i), insn);
+			memdesc.num_mem++;
+		}
+	for (i = 0; i < instr_num_dsts(insn); i++)
+		if (is_mem_dst(insn, i))
+		{
+			if (memdesc.num_mem < MEMDESC_MAX_OPNDS)
+			{
+				memdesc.sizes[memdesc.num_mem] = drutil_opnd_mem_size_in_bytes(instr_get_dst(insn, i), insn);
+				memdesc.writes |= 1 << memdesc.num_mem;
+			}
+			memdesc.num_mem++;
+		}
+	if (memdesc.num_mem) data->memdescs[data->num_memdescs++] = memdesc;
+}
+
+static void save_bytes_map(void *drcontext, per_thread_t *data, instr_t *insn)
+{
+	app_pc pc = (app_pc)trace_pc(instr_get_app_pc(insn));
+	// hashtable_add() fails if another thread got the pc first
+	if (!hashtable_add(&bytes_map_pcs[((ptr_uint_t)pc >> 2) % BYTES_MAP_SHARDS], pc, (void *)1)) return;
+
+	if (data->num_bytes_map == MAX_NUM_BYTES_MAP) flush_bytes_map(data);
+	bytes_map_t *bytes_map = &data->bytes_map[data->num_bytes_map++];
+
+	uint32_t length = instr_length(drcontext, insn);
+	DR_ASSERT(length <= 16);
+	bytes_map->pc = (uint64_t)pc;
+
+	bytes_map->size = length;
+    	
+	int x;
+	for (x=0; x<length; x++)
+	{
+		bytes_map->rawbytes[x] = instr_get_raw_byte(insn, x);
+	}
+	if (options.memdesc) save_memdesc(data, insn, pc);
+}
+
+static int compare_bytes_map(const void *a, const void *b)
+{
+	uint64_t pc_a = ((const bytes_map_t *)a)->pc, pc_b = ((const bytes_map_t *)b)->pc;
+	return (pc_a > pc_b) - (pc_a < pc_b);
+}
+
+// Sorts insn.bytemap by pc and drops the instructions a forked child wrote again
+static void sort_bytes_map(void)
+{
+	int fd = fileno(bytes_map_file);
+	flock(fd, LOCK_EX);
+	fflush(bytes_map_file);
+	fseek(bytes_map_file, 0, SEEK_END);
+	size_t num_maps = ftell(bytes_map_file) / sizeof(bytes_map_t);
+	size_t alloc_size = num_maps * sizeof(bytes_map_t);
+	bytes_map_t *bytes_map = num_maps ? dr_global_alloc(alloc_size) : NULL;
+	size_t x, num_unique = 0;
+	char name[256];
+
+	snprintf(name, 256, "%s/insn.bytemap", trace_dir);
+	FILE *reader = fopen(name, "rb");
+	if (bytes_map && reader && fread(bytes_map, sizeof(bytes_map_t), num_maps, reader) == num_maps)
+	{
+		qsort(bytes_map, num_maps, sizeof(bytes_map_t), compare_bytes_map);
+		for (x=0; x<num_maps; x++)
+			if (num_unique == 0 || bytes_map[x].pc != bytes_map[num_unique-1].pc)
+				bytes_map[num_unique++] = bytes_map[x];
+		rewind(bytes_map_file);
+		fwrite(bytes_map, sizeof(bytes_map_t), num_unique, bytes_map_file);
+		fflush(bytes_map_file);
+		if (ftruncate(fd, num_unique * sizeof(bytes_map_t))) {}
+	}
+	if (reader) fclose(reader);
+	if (bytes_map) dr_global_free(bytes_map, alloc_size);
+	flock(fd, LOCK_UN);
+}
+
+#define LIVE_REPLAY_BATCH 1024
+
+/* -live: a forked child has a ring of its own, and never saves again the
+ * instructions it inherited in bytes_map_pcs. Publishes them from insn.bytemap,
+ * where -live has flushed them before they ran.
+ */
+static void live_replay_bytes_map(void)
+{
+	bytes_map_t *batch = dr_global_alloc(sizeof(bytes_map_t) * LIVE_REPLAY_BATCH);
+	bytes_map_t entry;
+	hashtable_t replayed;
+	uint32_t num_batch = 0;
+	char name[256];
+
+	snprintf(name, 256, "%s/insn.bytemap", trace_dir);
+	FILE *reader = fopen(name, "rb");
+	if (reader == NULL) PEEKABOO_DIE("Peekaboo: Unable to read %s for the live ring.\n", name);
+	// Other processes append too, and an ancestor's pcs were inherited along the way
+	hashtable_init(&replayed, 10, HASH_INTPTR, false);
+	flock(fileno(bytes_map_file), LOCK_SH);
+	while (fread(&entry, sizeof(bytes_map_t), 1, reader) == 1)
+	{
+		app_pc pc = (app_pc)entry.pc;
+		if (hashtable_lookup(&bytes_map_pcs[((ptr_uint_t)pc >> 2) % BYTES_MAP_SHARDS], pc) == NULL) continue;
+		if (!hashtable_add(&replayed, pc, (void *)1)) continue;
+		batch[num_batch++] = entry;
+		if (num_batch < LIVE_REPLAY_BATCH) continue;
+		live_publish(LIVE_STREAM_BYTEMAP, 0, 0, batch, num_batch * sizeof(bytes_map_t));
+		num_batch = 0;
+	}
+	flock(fileno(bytes_map_file), LOCK_UN);
+	if (num_batch) live_publish(LIVE_STREAM_BYTEMAP, 0, 0, batch, num_batch * sizeof(bytes_map_t));
+	fclose(reader);
+	hashtable_delete(&replayed);
+	dr_global_free(batch, sizeof(bytes_map_t) * LIVE_REPLAY_BATCH);
+}
+
+// -bb_counts: appends the blocks the process ran to bbcounts
+static void write_bb_counts(void)
+{
+	bb_count_t bb_count;
+	uint64_t num_insns = 0;
+	uint32_t x, num_run = 0;
+
+	flock(fileno(bb_counts_file), LOCK_EX);
+	for (x=0; x<num_bbs; x++)
+	{
+		if (bb_count_chunks[x / BB_CHUNK_SIZE] == NULL || *get_bb_counter(x) == 0) continue;
+		bb_count.pc = get_bb(x)->pc;
+		bb_count.count = *get_bb_counter(x);
+		bb_count.num_insns = get_bb(x)->num_insns;
+		bb_count.pid = dr_get_process_id();
+		fwrite(&bb_count, sizeof(bb_count_t), 1, bb_counts_file);
+		num_insns += bb_count.count * bb_count.num_insns;
+		num_run++;
+	}
+	fflush(bb_counts_file);
+	flock(fileno(bb_counts_file), LOCK_UN);
+	printf("Peekaboo: %u basic blocks ran %"PRIu64" instructions.\n", num_run, num_insns);
+}
+
+static bool is_filtering(void)
+{
+	return options.num_modules || options.num_exclude_modules || options.num_ranges || options.function[0];
+}
+
+static bool has_filter_name(char names[][MAX_FILTER_NAME], uint32_t num_names, const char *name)
+{
+	uint32_t x;
+	for (x=0; x<num_names; x++)
+		if (strcmp(names[x], name) == 0) return true;
+	return false;
+}
+
+static bool should_trace_bb(app_pc pc)
+{
+	bool trace = options.num_modules == 0 && options.num_ranges == 0;
+	uint32_t x;
+
+	for (x=0; x<options.num_ranges; x++)
+		if (pc >= options.ranges[x].start && pc < options.ranges[x].end) trace = true;
+	if (options.num_modules == 0 && options.num_exclude_modules == 0) return trace;
+
+	dr_rwlock_read_lock(module_ranges_lock);
+	for (x=0; x<num_module_ranges; x++)
+	{
+		if (pc < module_ranges[x].start || pc >= module_ranges[x].end) continue;
+		if (!module_ranges[x].include)
+		{
+			trace = false;
+			break;
+		}
+		trace = true;
+	}
+	dr_rwlock_read_unlock(module_ranges_lock);
+	return trace;
+}
+
+/* -function: a thread is traced from entering the function until it leaves
+ * it. Its trace case switches the blocks it runs to their traced copies, so
+ * nothing is flushed. The block that calls the wrappers runs the copy it
+ * started with.
+ */
+static void function_enter(void *wrapcxt, void **user_data)
+{
+	per_thread_t *data = drmgr_get_tls_field(drwrap_get_drcontext(wrapcxt), tls_idx);
+	if (data->function_depth++ == 0) __atomic_fetch_or(data->trace_case, TRACE_IN_FUNCTION, __ATOMIC_RELAXED);
+}
+
+static void function_leave(void *wrapcxt, void *user_data)
+{
+	// wrapcxt is NULL if the function was left by a longjmp or an exception
+	void *drcontext = wrapcxt ? drwrap_get_drcontext(wrapcxt) : dr_get_current_drcontext();
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	if (data->function_depth == 0) return;
+	if (--data->function_depth == 0) __atomic_fetch_and(data->trace_case, ~(uintptr_t)TRACE_IN_FUNCTION, __ATOMIC_RELAXED);
+}
+
+static void wrap_function(const module_data_t *info, const char *name)
+{
+	const char *func = strchr(options.function, '!');
+	if (func)
+	{
+		size_t len = func - options.function;
+		if (strncmp(options.function, name, len) != 0 || name[len] != '\0') return;
+		func++;
+	}
+	else func = options.function;
+
+	// Exported functions first, then the symbol table
+	app_pc pc = (app_pc)dr_get_proc_address(info->handle, func);
+	if (pc == NULL && info->full_path != NULL)
+	{
+		char symbol[MAX_FILTER_NAME * 2];
+		size_t modoffs;
+		snprintf(symbol, sizeof(symbol), "%s!%s", name, func);
+		if (drsym_lookup_symbol(info->full_path, symbol, &modoffs, DRSYM_DEFAULT_FLAGS) == DRSYM_SUCCESS)
+			pc = info->start + modoffs;
+	}
+	if (pc == NULL) return;
+
+	printf("Peekaboo: Tracing inside %s!%s at %p.\n", name, func, pc);
+	if (!drwrap_wrap(pc, function_enter, function_leave))
+		DR_ASSERT(false);
+}
+
+static void event_module_load(void *drcontext, const module_data_t *info, bool loaded)
+{
+	add_loaded_module(info);
+	const char *name = dr_module_preferred_name(info);
+	if (name == NULL) return;
+
+	bool include = has_filter_name(options.modules, options.num_modules, name);
+	bool exclude = has_filter_name(options.exclude_modules, options.num_exclude_modules, name);
+	if (include || exclude)
+	{
+		dr_rwlock_write_lock(module_ranges_lock);
+		if (num_module_ranges == MAX_MODULE_RANGES)
+			PEEKABOO_DIE("Peekaboo: More than %d filtered modules are loaded.\n", MAX_MODULE_RANGES);
+		module_ranges[num_module_ranges].start = info->start;
+		module_ranges[num_module_ranges].end = info->end;
+		module_ranges[num_module_ranges].include = !exclude;
+		num_module_ranges++;
+		dr_rwlock_write_unlock(module_ranges_lock);
+	}
+
+	if (options.function[0]) wrap_function(info, name);
+}
+
+static void event_module_unload(void *drcontext, const module_data_t *info)
+{
+	uint32_t x;
+	remove_loaded_module(info);
+	dr_rwlock_write_lock(module_ranges_lock);
+	for (x=0; x<num_module_ranges; x++)
+	{
+		if (module_ranges[x].start == info->start)
+		{
+			module_ranges[x] = module_ranges[--num_module_ranges];
+			break;
+		}
+	}
+	dr_rwlock_write_unlock(module_ranges_lock);
+}
+
+static bool is_sampling(void)
+{
+	return options.sample_window || options.toggle || options.max_insns;
+}
+
+// Blocks get a traced and an untraced copy, picked by the thread's trace case
+static bool has_trace_cases(void)
+{
+	return is_sampling() || options.function[0];
+}
+
+/* The first and last instructions of the block being instrumented. With trace
+ * cases, bb holds both copies of the block, so drbbdup knows where they are.
+ */
+static bool is_first_instr(void *drcontext, instr_t *instr)
+{
+	bool first = false;
+	if (!has_trace_cases()) return drmgr_is_first_instr(drcontext, instr);
+	if (drbbdup_is_first_instr(drcontext, instr, &first) != DRBBDUP_SUCCESS) DR_ASSERT(false);
+	return first;
+}
+
+static bool is_last_instr(void *drcontext, instr_t *instr)
+{
+	bool last = false;
+	if (!has_trace_cases()) return drmgr_is_last_instr(drcontext, instr);
+	if (drbbdup_is_last_instr(drcontext, instr, &last) != DRBBDUP_SUCCESS) DR_ASSERT(false);
+	return last;
+}
+
+// Windows are opened and closed with sampler.lock held. Either does nothing if the window already is.
+static void open_window(void)
+{
+	per_thread_t *data;
+	if (sampler.tracing || sampler.done) return;
+	sampler.window_insns = __atomic_load_n(&sampler.num_insns, __ATOMIC_RELAXED);
+	sampler.window_ms = dr_get_milliseconds();
+	__atomic_store_n(&sampler.epoch, sampler.epoch + 1, __ATOMIC_RELAXED);
+	sampler.tracing = true;
+	for (data = sampler.threads; data; data = data->next_sampled)
+		__atomic_fetch_or(data->trace_case, TRACE_IN_WINDOW, __ATOMIC_RELAXED);
+}
+
+static void close_window(void)
+{
+	per_thread_t *data;
+	if (!sampler.tracing) return;
+	sampler.traced_insns += __atomic_load_n(&sampler.num_insns, __ATOMIC_RELAXED) - sampler.window_insns;
+	if (options.max_insns && sampler.traced_insns >= options.max_insns)
+	{
+		sampler.done = true;
+		printf("Peekaboo: %"PRIu64" instructions traced. Tracing stops for good.\n", sampler.traced_insns);
+	}
+	sampler.tracing = false;
+	for (data = sampler.threads; data; data = data->next_sampled)
+		__atomic_fetch_and(data->trace_case, ~(uintptr_t)TRACE_IN_WINDOW, __ATOMIC_RELAXED);
+}
+
+/* Points the thread at its trace case and sets the bits it starts with. The
+ * sampler keeps the window bit of every thread it knows of up to date.
+ */
+static void start_trace_case(per_thread_t *data)
+{
+	uintptr_t trace_case = options.function[0] && data->function_depth == 0 ? 0 : TRACE_IN_FUNCTION;
+	data->trace_case = (uintptr_t *)((byte *)dr_get_dr_segment_base(trace_case_seg) + trace_case_offs);
+	if (!is_sampling())
+	{
+		*data->trace_case = trace_case | TRACE_IN_WINDOW;
+		return;
+	}
+	dr_mutex_lock(sampler.lock);
+	*data->trace_case = trace_case | (sampler.tracing ? TRACE_IN_WINDOW : 0);
+	data->next_sampled = sampler.threads;
+	sampler.threads = data;
+	dr_mutex_unlock(sampler.lock);
+}
+
+static void stop_trace_case(per_thread_t *data)
+{
+	per_thread_t **link;
+	if (!is_sampling()) return;
+	dr_mutex_lock(sampler.lock);
+	for (link = &sampler.threads; *link; link = &(*link)->next_sampled)
+		if (*link == data)
+		{
+			*link = data->next_sampled;
+			break;
+		}
+	dr_mutex_unlock(sampler.lock);
+}
+
+/* -toggle: a nudge (drnudgeunix -pid <pid> -client 0 0) or -toggle_signal
+ * turns tracing on or off. The next block each thread runs after turning it
+ * on starts a segment.
+ */
+static void toggle_tracing(void)
+{
+	dr_mutex_lock(sampler.lock);
+	if (sampler.tracing)
+		close_window();
+	else
+		open_window();
+	printf("Peekaboo: Tracing %s.\n", sampler.tracing ? "on" : sampler.done ? "stays off, -max_insns is used up" : "off");
+	dr_mutex_unlock(sampler.lock);
+}
+
+static void event_toggle_nudge(void *drcontext, uint64 argument)
+{
+	toggle_tracing();
+}
+
+static dr_signal_action_t event_toggle_signal(void *drcontext, dr_siginfo_t *info)
+{
+	if (info->sig != options.toggle_signal) return DR_SIGNAL_DELIVER;
+	toggle_tracing();
+	return DR_SIGNAL_SUPPRESS;
+}
+
+// -toggle alone opens and closes the windows from nudges and needs no thread
+static bool has_sampler_thread(void)
+{
+	return options.sample_window || options.max_insns;
+}
+
+// Checks the window every millisecond. Windows are W instructions give or take a millisecond.
+static void sampler_main(void *arg)
+{
+	// The exit event waits for us, so don't get suspended at exit.
+	dr_client_thread_set_suspendable(false);
+
+	while (!__atomic_load_n(&sampler.exiting, __ATOMIC_RELAXED))
+	{
+		dr_sleep(1);
+		uint64_t num_insns = __atomic_load_n(&sampler.num_insns, __ATOMIC_RELAXED);
+		dr_mutex_lock(sampler.lock);
+		if (sampler.tracing)
+		{
+			uint64_t window = num_insns - sampler.window_insns;
+			if ((options.sample_window && window >= options.sample_window) ||
+			    (options.max_insns && sampler.traced_insns + window >= options.max_insns))
+				close_window();
+		}
+		else if (options.sample_ms)
+		{
+			if (dr_get_milliseconds() - sampler.window_ms >= options.sample_ms) open_window();
+		}
+		else if (options.sample_period && num_insns - sampler.window_insns >= options.sample_period) open_window();
+		dr_mutex_unlock(sampler.lock);
+	}
+	dr_event_signal(sampler.exited_event);
+}
+
+static void start_sampler(void)
+{
+	sampler.exiting = false;
+	sampler.exited_event = dr_event_create();
+	if (!dr_create_client_thread(sampler_main, NULL))
+		PEEKABOO_DIE("Peekaboo: Unable to start the sampler thread.\n");
+}
+
+static void stop_sampler(void)
+{
+	__atomic_store_n(&sampler.exiting, true, __ATOMIC_RELAXED);
+	dr_event_wait(sampler.exited_event);
+	dr_event_destroy(sampler.exited_event);
+}
+
+/* Called by the first block a thread runs in a new window. Starts a segment
+ * with everything traced so far in front of it.
+ */
+static void start_segment(void)
+{
+	void *drcontext = dr_get_current_drcontext();
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	byte *base = drx_buf_get_buffer_base(drcontext, insn_ref_buf);
+	byte *ptr = drx_buf_get_buffer_ptr(drcontext, insn_ref_buf);
+
+	// num_refs only counts flushed instructions
+	if (options.bb_trace)
+		flush_bbrefs(drcontext, base, ptr - base);
+	else
+		flush_insnrefs(drcontext, base, ptr - base);
+	drx_buf_set_buffer_ptr(drcontext, insn_ref_buf, base);
+
+	segment_t segment;
+	segment.first_insn = data->num_refs;
+	segment.global_insn = __atomic_load_n(&sampler.num_insns, __ATOMIC_RELAXED);
+	data->sample_epoch = __atomic_load_n(&sampler.epoch, __ATOMIC_RELAXED);
+	writer_write(data->peek_trace->segments, &segment, sizeof(segment_t));
+}
+
+/* Calls callee when the uint32_t at offset in the thread's per_thread_t differs
+ * from *epoch. The callee catches up.
+ */
+static void insert_epoch_check(void *drcontext, instrlist_t *ilist, instr_t *where, int offset, uint32_t *epoch, void *callee)
+{
+	reg_id_t reg_data, reg_epoch;
+	if (drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_data) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_epoch) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false);
+		return;
+	}
+
+	instr_t *skip = INSTR_CREATE_label(drcontext);
+	drmgr_insert_read_tls_field(drcontext, tls_idx, ilist, where, reg_data);
+	instrlist_meta_preinsert(ilist, where, XINST_CREATE_load(drcontext, opnd_create_reg(reg_resize_to_opsz(reg_data, OPSZ_4)),
+				OPND_CREATE_MEM32(reg_data, offset)));
+	instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)epoch, opnd_create_reg(reg_epoch), ilist, where, NULL, NULL);
+	instrlist_meta_preinsert(ilist, where, XINST_CREATE_load(drcontext, opnd_create_reg(reg_resize_to_opsz(reg_epoch, OPSZ_4)),
+				OPND_CREATE_MEM32(reg_epoch, 0)));
+	instrlist_meta_preinsert(ilist, where, XINST_CREATE_cmp(drcontext, opnd_create_reg(reg_resize_to_opsz(reg_data, OPSZ_4)),
+				opnd_create_reg(reg_resize_to_opsz(reg_epoch, OPSZ_4))));
+	instrlist_meta_preinsert(ilist, where, XINST_CREATE_jump_cond(drcontext, DR_PRED_EQ, opnd_create_instr(skip)));
+	dr_insert_clean_call(drcontext, ilist, where, callee, false, 0);
+	instrlist_meta_preinsert(ilist, where, skip);
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg_data) != DRREG_SUCCESS ||
+	    drreg_unreserve_register(drcontext, ilist, where, reg_epoch) != DRREG_SUCCESS ||
+	    drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+}
+
+/* -sample_*: counts the num_insns instructions of the block before where, its
+ * first one. A traced block first starts a segment if the thread has none for
+ * the current window.
+ */
+static void instrument_sample(void *drcontext, instrlist_t *ilist, instr_t *where, uint32_t num_insns, bool tracing)
+{
+	if (tracing)
+		insert_epoch_check(drcontext, ilist, where, offsetof(per_thread_t, sample_epoch), &sampler.epoch, (void *)start_segment);
+
+	drx_insert_counter_update(drcontext, ilist, where, SPILL_SLOT_MAX + 1, &sampler.num_insns, num_insns,
+				  IF_X64_ELSE(DRX_COUNTER_64BIT, 0) | DRX_COUNTER_LOCK);
+}
+
+/* Creates the trace files of the thread in dir, which must not exist yet, and
+ * resets what is counted per trace.
+ */
+static void open_thread_trace(void *drcontext, per_thread_t *data, char *dir)
+{
+	data->num_refs = 0;
+	data->regfile_count = 0;
+	data->regfile_offset = 0;
+	data->last_bb_id = BB_ID_NONE;
+	data->memext_offset = 0;
+	data->peek_trace = create_trace(dir);
+
+	if (data->peek_trace == NULL)
+	{
+		PEEKABOO_DIE("libpeekaboo: Unable to create directory %s.\n", dir);
+	}
+
+	data->peek_trace->bytes_map = bytes_map_file;
+
+	metadata_hdr_t metadata;
+	init_metadata(&metadata, arch, LIBPEEKABOO_VER);
+	#ifdef HAS_REGFILE_LAYOUT
+	metadata.storage_options.amd64 = storage_option;
+	metadata.regfile_size = regfile_size;
+	#endif
+	// A forked child starts with empty buffers, see reset_buffers()
+	metadata.flags |= META_FLAG_ALIGNED;
+	if (options.regderef)
+	{
+		create_trace_file(dir, "regderef", 256, &data->peek_trace->regderef);
+		metadata.flags |= META_FLAG_REGDEREF;
+	}
+	if (options.keyframe)
+	{
+		create_trace_file(dir, "regfile.keyidx", 256, &data->peek_trace->regfile_keyidx);
+		metadata.flags |= META_FLAG_REGFILE_DELTA;
+		metadata.keyframe_interval = options.keyframe;
+	}
+	if (options.bb_trace) metadata.flags |= META_FLAG_BB_TRACE;
+	if (options.branch_trace) metadata.flags |= META_FLAG_BRANCH_TRACE;
+	if (options.module_pcs) metadata.flags |= META_FLAG_MODULE_PCS;
+	if (options.bb_counts) metadata.flags |= META_FLAG_BB_COUNTS;
+	if (options.memdesc) metadata.flags |= META_FLAG_MEMDESC;
+	if (options.memval)
+	{
+		create_trace_file(dir, "memfile.ext", 256, &data->peek_trace->memfile_ext);
+		metadata.flags |= META_FLAG_MEMVAL;
+	}
+	if (is_sampling())
+	{
+		create_trace_file(dir, "segments", 256, &data->peek_trace->segments);
+		metadata.flags |= META_FLAG_SEGMENTS;
+	}
+	if (options.syscalls)
+	{
+		create_trace_file(dir, "syscalls", 256, &data->peek_trace->syscalls);
+		metadata.flags |= META_FLAG_SYSCALLS;
+	}
+	if (options.memaddr)
+	{
+		create_trace_file(dir, "memaddrs", 256, &data->peek_trace->memaddrs);
+		metadata.flags |= META_FLAG_MEMADDRS;
+	}
+	memset(data->streams, 0, sizeof(data->streams));
+	if (options.compress)
+	{
+		char name[256];
+		int x;
+		for (x=0; x<NUM_STREAMS; x++)
+			if (x != STREAM_MEMADDRS || options.memaddr)
+			{
+				snprintf(name, sizeof(name), "%s.seek", stream_names[x]);
+				create_trace_file(dir, name, 256, &data->streams[x].seek);
+			}
+		// Delta filter whole records of fixed size
+		data->streams[STREAM_INSN_TRACE].stride = options.bb_trace ? 0 : sizeof(insn_ref_t);
+		data->streams[STREAM_REGFILE].stride = options.keyframe || regfile_size % 8 ? 0 : regfile_size;
+		data->streams[STREAM_MEMFILE].stride = options.memdesc ? sizeof(uint64_t) : sizeof(memfile_t);
+		metadata.flags |= META_FLAG_COMPRESSED;
+	}
+	if (options.order)
+	{
+		create_trace_file(dir, "order", 256, &data->peek_trace->order);
+		metadata.flags |= META_FLAG_ORDER;
+		data->num_orders = 0;
+		add_order(data, 1);
+	}
+	data->manifest = NULL;
+	if (options.part_size || options.part_insns)
+	{
+		int x;
+		strncpy(data->dir, dir, sizeof(data->dir) - 1);
+		create_trace_file(dir, "manifest", 256, &data->manifest);
+		for (x=0; x<NUM_STREAMS; x++)
+			if (x != STREAM_MEMADDRS || options.memaddr) write_part(data, x);
+		metadata.flags |= META_FLAG_PARTS;
+	}
+	write_metadata(data->peek_trace, &metadata);
+	if (options.live[0])
+	{
+		memset(data->live_offsets, 0, sizeof(data->live_offsets));
+		data->live_memfile_records = 0;
+		live_publish(LIVE_STREAM_META, 0, 0, &metadata, sizeof(metadata));
+	}
+}
+
+static void close_thread_trace(per_thread_t *data)
+{
+	if (data->num_orders) flush_orders(data);
+	// Everything must be on disk before the files are closed
+	writer_drain();
+	if (options.compress)
+	{
+		int x;
+		for (x=0; x<NUM_STREAMS; x++)
+			if (data->streams[x].seek) fclose(data->streams[x].seek);
+	}
+	if (data->manifest) fclose(data->manifest);
+	// insn.bytemap is shared and closed by event_exit()
+	data->peek_trace->bytes_map = NULL;
+	close_trace(data->peek_trace);
+	free(data->peek_trace);
+	data->peek_trace = NULL;
+}
+
+// Slot of the ring the next record goes to
+static size_t ring_pos(void *drcontext, drx_buf_t *buf, size_t record_size)
+{
+	byte *base = drx_buf_get_buffer_base(drcontext, buf);
+	byte *ptr = drx_buf_get_buffer_ptr(drcontext, buf);
+	return (ptr - base) / record_size % (drx_buf_get_buffer_size(drcontext, buf) / record_size);
+}
+
+// Passes count records of the ring from slot first on to flush, wrapping around at the end
+static void dump_ring(void *drcontext, drx_buf_t *buf, void (*flush)(void *, void *, size_t), size_t record_size, size_t first, size_t count)
+{
+	byte *base = drx_buf_get_buffer_base(drcontext, buf);
+	size_t num_slots = drx_buf_get_buffer_size(drcontext, buf) / record_size;
+	size_t head = num_slots - first < count ? num_slots - first : count;
+	if (head) flush(drcontext, base + first * record_size, head * record_size);
+	if (count > head) flush(drcontext, base, (count - head) * record_size);
+}
+
+/* -flight_recorder: writes the instructions in the rings to a new trace in
+ * dir. The thread must be between two instructions, where the rings agree
+ * with each other. The rings are left as they are.
+ */
+static void dump_flight(void *drcontext, per_thread_t *data, char *dir)
+{
+	insn_ref_t *insns = drx_buf_get_buffer_base(drcontext, insn_ref_buf);
+	memref_t *memrefs = drx_buf_get_buffer_base(drcontext, memrefs_buf);
+	memfile_t *memfile = drx_buf_get_buffer_base(drcontext, memfile_buf);
+	size_t num_slots = options.flight_recorder;
+	size_t num_mem_slots = num_slots * FLIGHT_MEMFILE_RATIO;
+	size_t end = ring_pos(drcontext, insn_ref_buf, sizeof(insn_ref_t));
+	size_t mem_end = ring_pos(drcontext, memfile_buf, sizeof(memfile_t));
+	// The rings start out zeroed, so the next slot is only set once a ring has wrapped
+	bool wrapped = insns[end].pc != 0;
+	size_t first = wrapped ? end : 0;
+	size_t count = wrapped ? num_slots : end;
+	size_t num_mems = memfile[mem_end].size ? num_mem_slots : mem_end;
+	size_t mem_count = 0;
+	size_t x;
+
+	// Leave out the oldest instructions whose memory operands have been overwritten
+	for (x=count; x>0; x--)
+	{
+		uint32_t length = memrefs[(first + x - 1) % num_slots].length;
+		if (mem_count + length > num_mems) break;
+		mem_count += length;
+	}
+	first = (first + x) % num_slots;
+	count -= x;
+
+	open_thread_trace(drcontext, data, dir);
+	dump_ring(drcontext, insn_ref_buf, flush_insnrefs, sizeof(insn_ref_t), first, count);
+	dump_ring(drcontext, regfile_buf, flush_regfile, regfile_size, first, count);
+	dump_ring(drcontext, memrefs_buf, flush_memrefs, sizeof(memref_t), first, count);
+	dump_ring(drcontext, memfile_buf, flush_memfile, sizeof(memfile_t), (mem_end + num_mem_slots - mem_count) % num_mem_slots, mem_count);
+#ifdef HAS_REGDEREF
+	if (options.regderef)
+		dump_ring(drcontext, regderef_buf, flush_regderef, sizeof(regderef_t), first, count);
+#endif
+	close_thread_trace(data);
+}
+
+// Dumps before exit go to trace_dir/tid-N, so that neither the next one nor the one at exit replaces them
+static void dump_flight_numbered(void *drcontext, per_thread_t *data)
+{
+	char buf[256];
+	snprintf(buf, 256, "%s/%d-%u", trace_dir, dr_get_thread_id(drcontext), ++data->num_dumps);
+	dump_flight(drcontext, data, buf);
+	dr_fprintf(STDERR, "Dumped the last %"PRIu64" instructions to %s\n", data->num_refs, buf);
+}
+
+// Called by the first block a thread runs after a nudge
+static void flight_catch_up(void)
+{
+	void *drcontext = dr_get_current_drcontext();
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	data->flight_epoch = __atomic_load_n(&flight_epoch, __ATOMIC_RELAXED);
+	dr_fprintf(STDERR, "Peekaboo: Dump requested. ");
+	dump_flight_numbered(drcontext, data);
+}
+
+// A nudge asks every thread to dump at the start of its next block
+static void event_nudge(void *drcontext, uint64 argument)
+{
+	__atomic_fetch_add(&flight_epoch, 1, __ATOMIC_RELAXED);
+}
+
+// Slow circular buffers wrap when a store hits their guard page. drx takes care of those faults.
+static bool is_ring_fault(void *drcontext, drx_buf_t *buf, byte *addr)
+{
+	byte *base = drx_buf_get_buffer_base(drcontext, buf);
+	return addr >= base && addr < base + drx_buf_get_buffer_size(drcontext, buf) + dr_page_size();
+}
+
+// Signals are delivered between two instructions, so the rings agree here
+static dr_signal_action_t event_signal(void *drcontext, dr_siginfo_t *info)
+{
+	if (info->sig == SIGSEGV &&
+	    (is_ring_fault(drcontext, insn_ref_buf, info->access_address) ||
+	     is_ring_fault(drcontext, regfile_buf, info->access_address) ||
+	     is_ring_fault(drcontext, memrefs_buf, info->access_address) ||
+	     is_ring_fault(drcontext, memfile_buf, info->access_address) ||
+	     (regderef_buf && is_ring_fault(drcontext, regderef_buf, info->access_address))))
+		return DR_SIGNAL_DELIVER;
+
+	if (info->sig == SIGSEGV || info->sig == SIGBUS || info->sig == SIGILL || info->sig == SIGFPE || info->sig == SIGABRT)
+	{
+		per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+		if (data->num_signal_dumps >= MAX_SIGNAL_DUMPS) return DR_SIGNAL_DELIVER;
+		data->num_signal_dumps++;
+		dr_fprintf(STDERR, "Peekaboo: Signal %d caught. ", info->sig);
+		dump_flight_numbered(drcontext, data);
+		if (data->num_signal_dumps == MAX_SIGNAL_DUMPS)
+			dr_fprintf(STDERR, "Peekaboo: Thread %d will not dump on further signals.\n", dr_get_thread_id(drcontext));
+	}
+	return DR_SIGNAL_DELIVER;
+}
+
+// Runs before drx frees the thread's rings
+static void event_flight_thread_exit(void *drcontext)
+{
+	char buf[256];
+	snprintf(buf, 256, "%s/%d", trace_dir, dr_get_thread_id(drcontext));
+	dump_flight(drcontext, drmgr_get_tls_field(drcontext, tls_idx), buf);
+}
+
+/* -syscalls: adds the instructions of the block to the thread's num_refs. No
+ * lock is needed, only the thread itself updates it.
+ */
+static void instrument_thread_count(void *drcontext, instrlist_t *ilist, instr_t *where)
+{
+	uint32_t num_insns = 0;
+	instr_t *insn;
+	for (insn = instrlist_first_app(ilist); insn; insn = instr_get_next_app(insn)) num_insns++;
+
+	reg_id_t reg_data, reg_count;
+	if (drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_data) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_count) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false);
+		return;
+	}
+
+	drmgr_insert_read_tls_field(drcontext, tls_idx, ilist, where, reg_data);
+	instrlist_meta_preinsert(ilist, where, XINST_CREATE_load(drcontext, opnd_create_reg(reg_count),
+				OPND_CREATE_MEMPTR(reg_data, offsetof(per_thread_t, num_refs))));
+	instrlist_meta_preinsert(ilist, where, XINST_CREATE_add(drcontext, opnd_create_reg(reg_count), OPND_CREATE_INT32(num_insns)));
+	instrlist_meta_preinsert(ilist, where, XINST_CREATE_store(drcontext, OPND_CREATE_MEMPTR(reg_data, offsetof(per_thread_t, num_refs)),
+				opnd_create_reg(reg_count)));
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg_data) != DRREG_SUCCESS ||
+	    drreg_unreserve_register(drcontext, ilist, where, reg_count) != DRREG_SUCCESS ||
+	    drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+}
+
+static void write_syscall(per_thread_t *data)
+{
+	writer_write(data->peek_trace->syscalls, &data->syscall, sizeof(syscall_t));
+	data->syscall_pending = false;
+}
+
+static bool event_filter_syscall(void *drcontext, int sysnum)
+{
+	return true;
+}
+
+static bool event_pre_syscall(void *drcontext, int sysnum)
+{
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	int x;
+	// The last one did not come back, e.g. it was interrupted by a signal
+	if (data->syscall_pending) write_syscall(data);
+
+	memset(&data->syscall, 0, sizeof(syscall_t));
+	data->syscall.num = sysnum;
+	for (x=0; x<6; x++)
+		data->syscall.args[x] = dr_syscall_get_param(drcontext, x);
+	// The block of the syscall is counted already
+	data->syscall.insn_idx = data->num_refs;
+	data->syscall.tid = dr_get_thread_id(drcontext);
+	data->syscall_pending = true;
+	return true;
+}
+
+static void event_post_syscall(void *drcontext, int sysnum)
+{
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	// A forked child comes back from a syscall of its parent's thread
+	if (!data->syscall_pending) return;
+	data->syscall.ret = dr_syscall_get_result(drcontext);
+	data->syscall.returned = 1;
+	write_syscall(data);
+}
+
+/* -branch_trace: adds a control transfer to insn.brtable the first time it is
+ * seen. Far direct jumps and calls are left out; they are not in user code.
+ */
+static void save_branch(instr_t *insn)
+{
+	branch_entry_t branch;
+	memset(&branch, 0, sizeof(branch_entry_t));
+	branch.pc = (uint64_t)instr_get_app_pc(insn);
+	if (instr_is_cbr(insn))
+	{
+		branch.type = BRANCH_COND;
+		branch.target = (uint64_t)instr_get_branch_target_pc(insn);
+	}
+	else if (instr_is_ubr(insn) || instr_is_call_direct(insn))
+	{
+		branch.type = BRANCH_DIRECT;
+		branch.target = (uint64_t)instr_get_branch_target_pc(insn);
+	}
+	else if (instr_is_mbr(insn)) branch.type = BRANCH_INDIRECT;
+	else return;
+
+	dr_mutex_lock(mutex);
+	if (hashtable_add(&branch_pcs, (void *)branch.pc, (void *)1))
+	{
+		// A forked child shares the file, see lookup_bb()
+		flock(fileno(branch_table_file), LOCK_EX);
+		fwrite(&branch, sizeof(branch_entry_t), 1, branch_table_file);
+		fflush(branch_table_file);
+		flock(fileno(branch_table_file), LOCK_UN);
+	}
+	dr_mutex_unlock(mutex);
+}
+
+// Analyses the block for its traced or, with trace cases, its untraced copy
+static dr_emit_flags_t analyze_bb(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, bool tracing, void **user_data)
+{
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	uint32_t num_insns=0;
+	instr_t *insn;
+
+	if (is_filtering() && !should_trace_bb(dr_fragment_app_pc(tag)))
+	{
+		*user_data = BB_SKIPPED;
+		return DR_EMIT_DEFAULT;
+	}
+	if (!tracing)
+	{
+		// Only -sample_* needs to count what runs between the windows
+		*user_data = options.sample_window ? BB_COUNTED : BB_SKIPPED;
+		return DR_EMIT_DEFAULT;
+	}
+	if (options.syscalls)
+	{
+		*user_data = BB_SYSCALLS_ONLY;
+		return DR_EMIT_DEFAULT;
+	}
+
+	// Rebuilds of a block for a trace or for translation have nothing new
+	for (insn = instrlist_first_app(bb); insn; insn=instr_get_next_app(insn), num_insns++)
+	{
+		if (!for_trace && !translating) save_bytes_map(drcontext, data, insn);
+		if (!for_trace && !translating && options.branch_trace && instr_is_cti(insn)) save_branch(insn);
+	}
+	// A live consumer needs the bytes before the block runs
+	if (options.live[0]) flush_bytes_map(data);
+	if (options.branch_trace)
+	{
+		*user_data = BB_BRANCHES_ONLY;
+		return DR_EMIT_DEFAULT;
+	}
+	if (options.memaddr)
+	{
+		*user_data = BB_MEMADDRS_ONLY;
+		return DR_EMIT_DEFAULT;
+	}
+	// -bb_counts: hand the counter of the block over
+	if (options.bb_counts)
+	{
+		*user_data = BB_COUNTS_ONLY;
+		if (num_insns)
+		{
+			dr_mutex_lock(mutex);
+			*user_data = get_bb_counter(lookup_bb(instr_get_app_pc(instrlist_first_app(bb)), num_insns));
+			dr_mutex_unlock(mutex);
+		}
+		return DR_EMIT_DEFAULT;
+	}
+
+	// Hand the block id over to per_insn_instrument()
+	*user_data = NULL;
+	if ((options.bb_trace || options.memval) && num_insns)
+	{
+		bb_state_t *state = dr_thread_alloc(drcontext, sizeof(bb_state_t));
+		memset(state, 0, sizeof(bb_state_t));
+		if (options.bb_trace)
+		{
+			dr_mutex_lock(mutex);
+			state->bb_id = lookup_bb(instr_get_app_pc(instrlist_first_app(bb)), num_insns);
+			dr_mutex_unlock(mutex);
+		}
+		*user_data = state;
+	}
+
+	return DR_EMIT_DEFAULT;
+}
+
+static dr_emit_flags_t save_bb_rawbytes(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data)
+{
+	return analyze_bb(drcontext, tag, bb, for_trace, translating, true, user_data);
+}
+
+/* -bb_trace: a synchronous signal means the block it came from stopped at the
+ * faulting instruction. Append an early exit marker with the number of
+ * instructions of the block that ran, the faulting one included since its
+ * instrumentation ran.
+ */
+static void event_kernel_xfer(void *drcontext, const dr_kernel_xfer_info_t *info)
+{
+	if (info->type != DR_XFER_SIGNAL_DELIVERY || info->source_mcontext == NULL) return;
+	if (info->sig != SIGSEGV && info->sig != SIGBUS && info->sig != SIGILL && info->sig != SIGFPE && info->sig != SIGTRAP) return;
+
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	bb_ref_t *base = drx_buf_get_buffer_base(drcontext, insn_ref_buf);
+	bb_ref_t *ptr = drx_buf_get_buffer_ptr(drcontext, insn_ref_buf);
+	uint32_t bb_id = ptr > base ? ptr[-1].id : data->last_bb_id;
+	if (bb_id == BB_ID_NONE || (bb_id & BB_REF_EARLY_EXIT)) return;
+
+	// Find the faulting instruction in the block
+	bb_entry_t *bb = get_bb(bb_id);
+	app_pc pc = (app_pc)bb->pc;
+	uint32_t count;
+	for (count=1; count<bb->num_insns && pc != info->source_mcontext->pc; count++)
+	{
+		pc = decode_next_pc(drcontext, pc);
+		if (pc == NULL) return;
+	}
+	if (pc != info->source_mcontext->pc || count == bb->num_insns) return;
+
+	if ((byte *)(ptr + 1) > (byte *)base + drx_buf_get_buffer_size(drcontext, insn_ref_buf))
+	{
+		flush_bbrefs(drcontext, base, (byte *)ptr - (byte *)base);
+		ptr = base;
+	}
+	ptr->id = BB_REF_EARLY_EXIT | count;
+	drx_buf_set_buffer_ptr(drcontext, insn_ref_buf, ptr + 1);
+}
+
+/* -branch_trace: appends to the thread's insn.trace from outside the code cache */
+static void append_branch_ref(void *drcontext, uint64_t target)
+{
+	branch_ref_t *base = drx_buf_get_buffer_base(drcontext, insn_ref_buf);
+	branch_ref_t *ptr = drx_buf_get_buffer_ptr(drcontext, insn_ref_buf);
+	if ((byte *)(ptr + 1) > (byte *)base + drx_buf_get_buffer_size(drcontext, insn_ref_buf))
+	{
+		flush_branchrefs(drcontext, base, (byte *)ptr - (byte *)base);
+		ptr = base;
+	}
+	ptr->target = target;
+	drx_buf_set_buffer_ptr(drcontext, insn_ref_buf, ptr + 1);
+}
+
+// A transfer no instruction made. from is the first instruction that did not run, NULL if unknown.
+static void append_async_branch(void *drcontext, app_pc from, app_pc to)
+{
+	append_branch_ref(drcontext, BRANCH_REF_ASYNC | (uint64_t)from);
+	append_branch_ref(drcontext, (uint64_t)to);
+}
+
+/* -branch_trace: signals, returns from them and the like take the thread
+ * somewhere no instruction did.
+ */
+static void event_branch_kernel_xfer(void *drcontext, const dr_kernel_xfer_info_t *info)
+{
+	append_async_branch(drcontext, info->source_mcontext ? info->source_mcontext->pc : NULL, info->target_pc);
+}
+
+#ifdef HAS_BRANCH_TRACE
+static void save_cbr(app_pc pc, app_pc target, app_pc fall_through, int taken, void *user_data)
+{
+	append_branch_ref(dr_get_current_drcontext(), (uint64_t)(taken ? target : fall_through));
+}
+
+static void save_mbr(app_pc pc, app_pc target)
+{
+	append_branch_ref(dr_get_current_drcontext(), (uint64_t)target);
+}
+
+/* -branch_trace: records where a conditional branch goes, or where an indirect
+ * one goes to, before it runs. A jcc picks its taken target or its fall
+ * through with a cmovcc on the same flags, so neither a clean call nor a
+ * branch is needed. jecxz, loop and far transfers are rare and left to DR's
+ * clean calls.
+ */
+static void instrument_branch(void *drcontext, instrlist_t *ilist, instr_t *where)
+{
+	int opcode = instr_get_opcode(where);
+	if (opcode >= OP_jo_short && opcode <= OP_jnle_short) opcode += OP_jo - OP_jo_short;
+	if (instr_is_cbr(where) && (opcode < OP_jo || opcode > OP_jnle))
+	{
+		dr_insert_cbr_instrumentation_ex(drcontext, ilist, where, (void *)save_cbr, OPND_CREATE_INT32(0));
+		return;
+	}
+	if (instr_is_mbr(where) && opcode != OP_ret && opcode != OP_jmp_ind && opcode != OP_call_ind)
+	{
+		dr_insert_mbr_instrumentation(drcontext, ilist, where, (void *)save_mbr, SPILL_SLOT_1);
+		return;
+	}
+
+	reg_id_t reg_ptr, reg_target;
+	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+	    drreg_reserve_register(drcontext, ilist, where, NULL, &reg_target) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false);
+		return;
+	}
+
+	if (instr_is_cbr(where))
+	{
+		app_pc pc = instr_get_app_pc(where);
+		instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)(pc + instr_length(drcontext, where)), opnd_create_reg(reg_target), ilist, where, NULL, NULL);
+		instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)instr_get_branch_target_pc(where), opnd_create_reg(reg_ptr), ilist, where, NULL, NULL);
+		instrlist_meta_preinsert(ilist, where, INSTR_CREATE_cmovcc(drcontext, OP_cmovo + opcode - OP_jo, opnd_create_reg(reg_target), opnd_create_reg(reg_ptr)));
+	}
+	else
+	{
+		// The return address, or the target operand. A load that faults is the branch's fault.
+		opnd_t target = instr_get_target(where);
+		instr_t *load = XINST_CREATE_load(drcontext, opnd_create_reg(reg_target), OPND_CREATE_MEMPTR(reg_target, 0));
+		if (opcode == OP_ret)
+			drreg_get_app_value(drcontext, ilist, where, DR_REG_XSP, reg_target);
+		else if (opnd_is_reg(target))
+		{
+			drreg_get_app_value(drcontext, ilist, where, opnd_get_reg(target), reg_target);
+			instr_destroy(drcontext, load);
+			load = NULL;
+		}
+		else
+			drutil_insert_get_mem_addr(drcontext, ilist, where, target, reg_target, reg_ptr);
+		if (load)
+		{
+			instr_set_translation(load, instr_get_app_pc(where));
+			instrlist_meta_fault_preinsert(ilist, where, load);
+		}
+	}
+
+	drx_buf_insert_load_buf_ptr(drcontext, insn_ref_buf, ilist, where, reg_ptr);
+	drx_buf_insert_buf_store(drcontext, insn_ref_buf, ilist, where, reg_ptr, DR_REG_NULL, opnd_create_reg(reg_target), OPSZ_8, offsetof(branch_ref_t, target));
+	drx_buf_insert_update_buf_ptr(drcontext, insn_ref_buf, ilist, where, reg_ptr, DR_REG_NULL, sizeof(branch_ref_t));
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+	    drreg_unreserve_register(drcontext, ilist, where, reg_target) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+}
+#endif
+
+#ifdef HAS_MEMVAL
+/* Makes room for all memfile entries and memfile.ext records of instr in the
+ * buffers up front, so they are contiguous. Returns the reads in reads, and
+ * leaves the writes in state for the next instruction. Must be called before
+ * instrument_mem() for the first operand.
+ */
+static uint32_t insert_reserve_mem(void *drcontext, instrlist_t *ilist, instr_t *instr, instr_t *where, bb_state_t *state, mem_value_t *reads)
+{
+	uint32_t sizes[MAX_MEM_OPNDS];
+	bool writes[MAX_MEM_OPNDS];
+	uint32_t num_mem = 0, num_reads = 0, ext_total = 0, ext = 0;
+	uint32_t x;
+	int i;
+
+	for (i = 0; i < instr_num_srcs(instr); i++)
+		if (is_mem_src(instr, i) && num_mem < MAX_MEM_OPNDS)
+		{
+			sizes[num_mem] = drutil_opnd_mem_size_in_bytes(instr_get_src(instr, i), instr);
+			writes[num_mem++] = false;
+		}
+	for (i = 0; i < instr_num_dsts(instr); i++)
+		if (is_mem_dst(instr, i) && num_mem < MAX_MEM_OPNDS)
+		{
+			sizes[num_mem] = drutil_opnd_mem_size_in_bytes(instr_get_dst(instr, i), instr);
+			writes[num_mem++] = true;
+		}
+	if (num_mem == 0) return 0;
+	for (x=0; x<num_mem; x++) ext_total += memfile_ext_size(sizes[x]);
+
+	// Same trick as the regfile: a store to the end of the space flushes the buffer if it does not fit
+	reg_id_t reg_ptr;
+	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false);
+		return 0;
+	}
+	drx_buf_insert_load_buf_ptr(drcontext, memfile_buf, ilist, where, reg_ptr);
+	drx_buf_insert_buf_store(drcontext, memfile_buf, ilist, where, reg_ptr, DR_REG_NULL, OPND_CREATE_INT32(0), OPSZ_4, num_mem * sizeof(memfile_t) - 4);
+	// Writes are read back before the next instruction. There is none after a
+	// control transfer or the last instruction of the block; those are 0.
+	// instrument_mem() stores 0 into memfile, and wide ones are zeroed here.
+	// A call's write is known up front.
+	bool can_read_back = !is_last_instr(drcontext, instr) && !instr_is_cti(instr);
+	if (ext_total)
+	{
+		drx_buf_insert_load_buf_ptr(drcontext, memext_buf, ilist, where, reg_ptr);
+		drx_buf_insert_buf_store(drcontext, memext_buf, ilist, where, reg_ptr, DR_REG_NULL, OPND_CREATE_INT32(0), OPSZ_4, ext_total - 4);
+		drx_buf_insert_update_buf_ptr(drcontext, memext_buf, ilist, where, reg_ptr, DR_REG_NULL, ext_total);
+		for (x=0; x<num_mem; x++)
+		{
+			uint32_t offset, ext_size = memfile_ext_size(sizes[x]);
+			if (writes[x] && !can_read_back)
+				for (offset=0; offset<ext_size; offset+=4)
+					drx_buf_insert_buf_store(drcontext, memext_buf, ilist, where, reg_ptr, DR_REG_NULL, OPND_CREATE_INT32(0), OPSZ_4,
+								 (short)(ext + offset) - (short)ext_total);
+			ext += ext_size;
+		}
+		ext = 0;
+	}
+	if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+
+	for (x=0; x<num_mem; x++)
+	{
+		mem_value_t value = {
+			.entry = -(short)((num_mem - x) * sizeof(memfile_t)),
+			.ext = (short)ext - (short)ext_total,
+			.size = sizes[x],
+		};
+		if (!writes[x]) reads[num_reads++] = value;
+		else if (can_read_back) state->writes[state->num_writes++] = value;
+		ext += memfile_ext_size(sizes[x]);
+	}
+	return num_reads;
+}
+#endif
+
+// The block state is freed after its last instruction. drbbdup frees its own, see destroy_case().
+static void free_bb_state(void *drcontext, instr_t *instr, bb_state_t *state)
+{
+	if (state != NULL && !has_trace_cases() && drmgr_is_last_instr(drcontext, instr))
+		dr_thread_free(drcontext, state, sizeof(bb_state_t));
+}
+
+// -order: where other threads may see what the thread did, or the other way round
+static bool is_order_point(instr_t *instr)
+{
+	if (instr_is_syscall(instr)) return true;
+	#ifdef X86
+	// xchg with memory is locked without the prefix
+	return instr_get_prefix_flag(instr, PREFIX_LOCK) || (instr_get_opcode(instr) == OP_xchg && instr_reads_memory(instr));
+	#else
+	return instr_is_exclusive_store(instr);
+	#endif
+}
+
+/* Clean call before an order point. The instruction has the id after what is
+ * in the insn.trace buffer. It runs after the stamp, so another thread may
+ * stamp and run its own order point in between; the order is approximate.
+ */
+static void stamp_order(void)
+{
+	void *drcontext = dr_get_current_drcontext();
+	per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+	size_t buffered = ((byte *)drx_buf_get_buffer_ptr(drcontext, insn_ref_buf) - (byte *)drx_buf_get_buffer_base(drcontext, insn_ref_buf)) / sizeof(insn_ref_t);
+	add_order(data, data->num_refs + buffered + 1);
+}
+
+/* Instruments instr of bb. Analysis looks at instr, instrumentation goes before
+ * where. The two only differ for the last instruction of a drbbdup copy.
+ * num_insns is the length of the block for -sample_*.
+ */
+static void instrument_instr(void *drcontext, instrlist_t *bb, instr_t *instr, instr_t *where, uint32_t num_insns, void *user_data)
+{
+	bb_state_t *state = user_data;
+	if (user_data == BB_SKIPPED) return;
+	drmgr_disable_auto_predication(drcontext, bb);
+	if (user_data == BB_COUNTED)
+	{
+		if (is_first_instr(drcontext, instr)) instrument_sample(drcontext, bb, where, num_insns, false);
+		return;
+	}
+	if (user_data == BB_SYSCALLS_ONLY)
+	{
+		if (is_first_instr(drcontext, instr)) instrument_thread_count(drcontext, bb, where);
+		return;
+	}
+	if (user_data == BB_MEMADDRS_ONLY)
+	{
+		if (instr_is_app(instr) && accesses_memory(instr)) instrument_memaddrs(drcontext, bb, instr, where);
+		return;
+	}
+	if (user_data == BB_COUNTS_ONLY) return;
+	if (options.bb_counts)
+	{
+		if (is_first_instr(drcontext, instr))
+			drx_insert_counter_update(drcontext, bb, where, SPILL_SLOT_MAX + 1, user_data, 1, IF_X64_ELSE(DRX_COUNTER_64BIT, 0) | DRX_COUNTER_LOCK);
+		return;
+	}
+	#ifdef HAS_BRANCH_TRACE
+	if (user_data == BB_BRANCHES_ONLY)
+	{
+		if (instr_is_app(instr) && (instr_is_cbr(instr) || instr_is_mbr(instr))) instrument_branch(drcontext, bb, instr);
+		return;
+	}
+	#endif
+	if (!instr_is_app(instr))
 	{
-		uint32_t length = instr_length(drcontext, insn);
-		DR_ASSERT(length <= 16);
-		bytes_map[idx].pc = (uint64_t)instr_get_app_pc(insn);
-
-		bytes_map[idx].size = length;
-    	
-		int x;
-		for (x=0; x<length; x++)
-		{
-			bytes_map[idx].rawbytes[x] = instr_get_raw_byte(insn, x);
-		}
+		free_bb_state(drcontext, instr, state);
+		return;
 	}
-	dr_mutex_lock(mutex);
-	fwrite(bytes_map, sizeof(bytes_map_t), idx, data->peek_trace->bytes_map);
-	dr_mutex_unlock(mutex);
 
-	return DR_EMIT_DEFAULT;
-}
+	// A new segment must come before anything of the block is buffered
+	if (is_sampling() && is_first_instr(drcontext, instr))
+		instrument_sample(drcontext, bb, where, num_insns, true);
+	if (options.flight_recorder && is_first_instr(drcontext, instr))
+		insert_epoch_check(drcontext, bb, where, offsetof(per_thread_t, flight_epoch), &flight_epoch, (void *)flight_catch_up);
+	if (options.order && is_order_point(instr))
+		dr_insert_clean_call(drcontext, bb, where, (void *)stamp_order, false, 0);
+
+	#ifdef HAS_MEMVAL
+	// What the previous instruction wrote. Must come before anything else touches the memfile buffer.
+	mem_value_t reads[MAX_MEM_OPNDS];
+	uint32_t num_reads = 0;
+	if (options.memval)
+	{
+		insert_save_values(drcontext, bb, where, state->writes, state->num_writes, NULL);
+		state->num_writes = 0;
+		num_reads = insert_reserve_mem(drcontext, bb, instr, where, state, reads);
+	}
+	#endif
 
-static dr_emit_flags_t per_insn_instrument(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, 
-		                             bool for_trace, bool translating, void *user_data)
-{
-	drmgr_disable_auto_predication(drcontext, bb);
-	if (!instr_is_app(instr)) return DR_EMIT_DEFAULT;
+	if (options.bb_trace && is_first_instr(drcontext, instr))
+		instrument_bb(drcontext, bb, where, state->bb_id);
 
 	/* insert code to add an entry for each memory reference opnd */
 	uint32_t mem_count = 0;
 	int i;
 	for (i = 0; i < instr_num_srcs(instr); i++) {
-		if (opnd_is_memory_reference(instr_get_src(instr, i)))
+		if (is_mem_src(instr, i))
 		{
-			instrument_mem(drcontext, bb, instr, instr_get_src(instr, i), false);
+			instrument_mem(drcontext, bb, instr, where, instr_get_src(instr, i), false);
 			mem_count++;
 		}
 	}
 
 	for (i = 0; i < instr_num_dsts(instr); i++) {
-		if (opnd_is_memory_reference(instr_get_dst(instr, i)))
+		if (is_mem_dst(instr, i))
 		{
-			instrument_mem(drcontext, bb, instr, instr_get_dst(instr, i), true);
+			instrument_mem(drcontext, bb, instr, where, instr_get_dst(instr, i), true);
 			mem_count++;
 		}
 	}
 
 	// ZL: would instrument the memref count (memfile) inside
-	instrument_insn(drcontext, bb, instr, mem_count);
+	instrument_insn(drcontext, bb, instr, where, mem_count);
+
+	#ifdef HAS_MEMVAL
+	// Loaded values go last: if a load faults, the instruction is recorded in
+	// full, the same as when the instruction itself faults.
+	if (options.memval)
+		insert_save_values(drcontext, bb, where, reads, num_reads, instr_get_app_pc(instr));
+	#endif
 
 
 	//if (drmgr_is_first_instr(drcontext, instr) IF_AARCHXX(&& !instr_is_exclusive_store(instr)))
 	//	dr_insert_clean_call(drcontext, bb, instr, (void *)save_insn, false, 0);
+	free_bb_state(drcontext, instr, state);
+}
+
+static dr_emit_flags_t per_insn_instrument(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, 
+		                             bool for_trace, bool translating, void *user_data)
+{
+	instrument_instr(drcontext, bb, instr, instr, 0, user_data);
+	return DR_EMIT_DEFAULT;
+}
+
+/* -sample_*, -function: drbbdup builds two copies of each block. The trace
+ * case of the thread, a raw TLS slot, picks the traced one, TRACE_CASE, or the
+ * untraced default one. Opening and closing a window or entering and leaving
+ * the function only flips bits in it and leaves the code cache alone.
+ */
+static uintptr_t set_up_bb_dups(void *drbbdup_ctx, void *drcontext, void *tag, instrlist_t *bb, bool *enable_dups,
+				bool *enable_dynamic_handling, void *user_data)
+{
+	// Filtered out blocks are never traced
+	*enable_dups = !is_filtering() || should_trace_bb(dr_fragment_app_pc(tag));
+	*enable_dynamic_handling = false;
+	if (*enable_dups && drbbdup_register_case_encoding(drbbdup_ctx, TRACE_CASE) != DRBBDUP_SUCCESS) DR_ASSERT(false);
+	return 0;
+}
+
+static dr_emit_flags_t analyze_case(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, uintptr_t encoding,
+				    void *user_data, void *orig_analysis_data, void **case_analysis_data)
+{
+	return analyze_bb(drcontext, tag, bb, for_trace, translating, encoding == TRACE_CASE, case_analysis_data);
+}
+
+static void destroy_case(void *drcontext, uintptr_t encoding, void *user_data, void *orig_analysis_data, void *case_analysis_data)
+{
+	if (case_analysis_data != NULL && case_analysis_data != BB_SKIPPED && case_analysis_data != BB_COUNTED)
+		dr_thread_free(drcontext, case_analysis_data, sizeof(bb_state_t));
+}
+
+// The copies share the last instruction if it is a control transfer, so the block is counted up front
+static void analyze_orig(void *drcontext, void *tag, instrlist_t *bb, void *user_data, void **orig_analysis_data)
+{
+	uint32_t num_insns = 0;
+	instr_t *insn;
+	for (insn = instrlist_first_app(bb); insn; insn = instr_get_next_app(insn)) num_insns++;
+	*orig_analysis_data = (void *)(ptr_uint_t)num_insns;
+}
+
+static dr_emit_flags_t instrument_case(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, instr_t *where, bool for_trace,
+				       bool translating, uintptr_t encoding, void *user_data, void *orig_analysis_data, void *case_analysis_data)
+{
+	instrument_instr(drcontext, bb, instr, where, (uint32_t)(ptr_uint_t)orig_analysis_data, case_analysis_data);
 	return DR_EMIT_DEFAULT;
 }
 
+/* Every thread gets its own trace in trace_dir/tid. The first thread of a
+ * process has tid == pid, so a single threaded process keeps the trace_dir/pid
+ * layout. thread_tree.txt lists the threads of every process as pid-tid.
+ * With -flight_recorder, the trace is only created when the thread dumps it.
+ */
 static void init_thread_in_process(void *drcontext)
 {
 	char buf[256];
@@ -468,32 +2718,44 @@ static void init_thread_in_process(void *drcontext)
 	drmgr_set_tls_field(drcontext, tls_idx, data);
 
 	int pid = dr_get_process_id();
-	snprintf(buf, 256, "%s/%d", trace_dir, pid);
-
-	data->num_refs = 0;
-	data->peek_trace = create_trace(buf);
-
-	if (data->peek_trace == NULL)
+	int tid = dr_get_thread_id(drcontext);
+	snprintf(buf, 256, "%s/%d", trace_dir, tid);
+
+	memset(data, 0, sizeof(per_thread_t));
+	data->delta_buf = options.keyframe ? dr_thread_alloc(drcontext, DELTA_BUF_SIZE) : NULL;
+	data->bytes_map = dr_thread_alloc(drcontext, MAX_BYTES_MAP_SIZE);
+	data->memdescs = options.memdesc ? dr_thread_alloc(drcontext, MAX_MEMDESCS_SIZE) : NULL;
+	data->sample_epoch = ~0U;
+	data->flight_epoch = __atomic_load_n(&flight_epoch, __ATOMIC_RELAXED);
+	if (options.compress)
 	{
-		PEEKABOO_DIE("libpeekaboo: Unable to create directory %s.\n", buf);
+		data->compress_work = dr_thread_alloc(drcontext, sizeof(compress_work_t));
+		data->compress_buf = dr_thread_alloc(drcontext, COMPRESS_BOUND(COMPRESS_BLOCK_SIZE));
 	}
-
-	data->peek_trace->bytes_map = bytes_map_file;
-	write_metadata(data->peek_trace, arch, LIBPEEKABOO_VER);
-	
-	char path[512];
-	snprintf(path, 512, "%s/proc_map", buf);
-
-	if(access(path, F_OK ) == -1 ) 
+	if (!options.flight_recorder) open_thread_trace(drcontext, data, buf);
+	if (options.branch_trace)
 	{
-		snprintf(path, 512, "cp /proc/%d/maps %s/proc_map", pid, buf);
-		system(path);
+		// Where the thread starts, if DR can tell
+		dr_mcontext_t mc = {sizeof(mc), DR_MC_CONTROL};
+		append_async_branch(drcontext, NULL, dr_get_mcontext(drcontext, &mc) ? mc.pc : NULL);
 	}
 
-	printf("Created a new trace for %d\n", pid);
+	char path[512];
+	snprintf(path, 512, "%s/thread_tree.txt", trace_dir);
+	dr_mutex_lock(mutex);
+	FILE *fp = fopen(path, "a");
+	if (fp == NULL) PEEKABOO_DIE("Peekaboo: Cannot append to thread tree at %s!", path);
+	fprintf(fp, "%d-%d\n", pid, tid);
+	fclose(fp);
+	dr_mutex_unlock(mutex);
+
+	if (options.flight_recorder)
+		printf("Recording the last %u instructions of %d\n", options.flight_recorder, tid);
+	else
+		printf("Created a new trace for %d\n", tid);
 }
 
-static void event_thread_init(void *drcontext)
+static void init_trace_dir(void)
 {
 	root_pid = dr_get_process_id();
 
@@ -519,10 +2781,36 @@ static void event_thread_init(void *drcontext)
 		}
 	}
 
-	dr_mutex_lock(mutex);
 	create_trace_file(trace_dir, "insn.bytemap", 256, &bytes_map_file);
 	snprintf(name, 256, "%s/insn.bytemap", trace_dir);
 	chmod(name, S_IRWXU|S_IRWXG|S_IRWXO);
+	create_trace_file(trace_dir, "modules", 256, &modules_file);
+	snprintf(name, 256, "%s/modules", trace_dir);
+	chmod(name, S_IRWXU|S_IRWXG|S_IRWXO);
+	if (options.bb_trace)
+	{
+		create_trace_file(trace_dir, "insn.bbtable", 256, &bb_table_file);
+		snprintf(name, 256, "%s/insn.bbtable", trace_dir);
+		chmod(name, S_IRWXU|S_IRWXG|S_IRWXO);
+	}
+	if (options.memdesc)
+	{
+		create_trace_file(trace_dir, "insn.memdesc", 256, &memdesc_file);
+		snprintf(name, 256, "%s/insn.memdesc", trace_dir);
+		chmod(name, S_IRWXU|S_IRWXG|S_IRWXO);
+	}
+	if (options.bb_counts)
+	{
+		create_trace_file(trace_dir, "bbcounts", 256, &bb_counts_file);
+		snprintf(name, 256, "%s/bbcounts", trace_dir);
+		chmod(name, S_IRWXU|S_IRWXG|S_IRWXO);
+	}
+	if (options.branch_trace)
+	{
+		create_trace_file(trace_dir, "insn.brtable", 256, &branch_table_file);
+		snprintf(name, 256, "%s/insn.brtable", trace_dir);
+		chmod(name, S_IRWXU|S_IRWXG|S_IRWXO);
+	}
 
 	snprintf(name, 256, "%s/process_tree.txt", trace_dir);
 	FILE * fp;
@@ -531,10 +2819,88 @@ static void event_thread_init(void *drcontext)
 	fprintf(fp, "%d-%d\n", dr_get_parent_id(), root_pid);
 	fclose(fp);
 	chmod(name, S_IRWXU|S_IRWXG|S_IRWXO);
-	dr_mutex_unlock(mutex);
+}
+
+// -flight_recorder keeps the last instructions in rings instead of flushing them
+static void create_buffers(void)
+{
+	// -syscalls and -bb_counts buffer nothing, -branch_trace only insn.trace, -memaddr only memaddrs
+	if (options.syscalls || options.bb_counts) return;
+	if (options.branch_trace)
+	{
+		insn_ref_buf = drx_buf_create_trace_buffer(INSN_REF_SIZE, flush_branchrefs);
+		return;
+	}
+	if (options.memaddr)
+	{
+		memaddr_buf = drx_buf_create_trace_buffer(MEMADDR_SIZE, flush_memaddrs);
+		return;
+	}
+	if (options.flight_recorder)
+	{
+		insn_ref_buf = drx_buf_create_circular_buffer(sizeof(insn_ref_t) * options.flight_recorder);
+		memfile_buf = drx_buf_create_circular_buffer(sizeof(memfile_t) * options.flight_recorder * FLIGHT_MEMFILE_RATIO);
+		memrefs_buf = drx_buf_create_circular_buffer(sizeof(memref_t) * options.flight_recorder);
+		regfile_buf = drx_buf_create_circular_buffer(regfile_size * options.flight_recorder);
+#ifdef HAS_REGDEREF
+		if (options.regderef)
+			regderef_buf = drx_buf_create_circular_buffer(sizeof(regderef_t) * options.flight_recorder);
+#endif
+		return;
+	}
+
+	insn_ref_buf = drx_buf_create_trace_buffer(INSN_REF_SIZE, options.bb_trace ? flush_bbrefs : flush_insnrefs);
+	memfile_buf = drx_buf_create_trace_buffer(MEMFILE_SIZE, flush_memfile);
+	memrefs_buf = drx_buf_create_trace_buffer(MEM_REFS_SIZE, flush_memrefs);
+	regfile_buf = drx_buf_create_trace_buffer(REG_BUF_SIZE, flush_regfile);
+#ifdef HAS_REGDEREF
+	if (options.regderef)
+		regderef_buf = drx_buf_create_trace_buffer(REGDEREF_SIZE, flush_regderef);
+#endif
+#ifdef HAS_MEMVAL
+	if (options.memval)
+		memext_buf = drx_buf_create_trace_buffer(MEMEXT_SIZE, flush_memext);
+#endif
+}
+
+static void free_buffers(void)
+{
+	if (regfile_buf) drx_buf_free(regfile_buf);
+	if (memrefs_buf) drx_buf_free(memrefs_buf);
+	if (memfile_buf) drx_buf_free(memfile_buf);
+	if (insn_ref_buf) drx_buf_free(insn_ref_buf);
+	if (regderef_buf) drx_buf_free(regderef_buf);
+	if (memext_buf) drx_buf_free(memext_buf);
+	if (memaddr_buf) drx_buf_free(memaddr_buf);
+}
 
-	printf("Peekaboo: Main thread starts. ");
+/* The forking thread's buffers still hold what the parent has not flushed.
+ * The parent writes that into its own trace, so the child drops it and all of
+ * its streams start at the same instruction. The code cache keeps using the
+ * same buffers.
+ */
+static void reset_buffers(void *drcontext)
+{
+	drx_buf_t *bufs[] = {insn_ref_buf, memfile_buf, memrefs_buf, regfile_buf, regderef_buf, memext_buf, memaddr_buf};
+	size_t x;
+	for (x=0; x<sizeof(bufs)/sizeof(bufs[0]); x++)
+	{
+		if (!bufs[x]) continue;
+		void *base = drx_buf_get_buffer_base(drcontext, bufs[x]);
+		// -flight_recorder tells a wrapped ring by its next slot
+		if (options.flight_recorder) memset(base, 0, drx_buf_get_buffer_size(drcontext, bufs[x]));
+		drx_buf_set_buffer_ptr(drcontext, bufs[x], base);
+	}
+}
+
+static void event_thread_init(void *drcontext)
+{
+	if (dr_get_thread_id(drcontext) == dr_get_process_id())
+		printf("Peekaboo: Main thread starts. ");
+	else
+		printf("Peekaboo: Thread %d starts. ", dr_get_thread_id(drcontext));
 	init_thread_in_process(drcontext);
+	if (has_trace_cases()) start_trace_case(drmgr_get_tls_field(drcontext, tls_idx));
 }
 
 #ifdef UNIX
@@ -550,20 +2916,53 @@ static void fork_init(void *drcontext)
 	fclose(fp);
 	dr_mutex_unlock(mutex);
 
-	// Recreate buffers to make them clean
-	
-	drx_buf_free(regfile_buf);
-	drx_buf_free(memrefs_buf);
-	drx_buf_free(memfile_buf);
-	drx_buf_free(insn_ref_buf);
-	insn_ref_buf = drx_buf_create_trace_buffer(INSN_REF_SIZE, flush_insnrefs);
-	memfile_buf = drx_buf_create_trace_buffer(MEMFILE_SIZE, flush_memfile);
-	memrefs_buf = drx_buf_create_trace_buffer(MEM_REFS_SIZE, flush_memrefs);
-	regfile_buf = drx_buf_create_trace_buffer(REG_BUF_SIZE, flush_regfile);
-	
+	log_inherited_modules();
+	// The child counts its own runs of the blocks
+	if (options.bb_counts)
+	{
+		uint32_t x;
+		for (x=0; x<num_bbs; x+=BB_CHUNK_SIZE)
+			if (bb_count_chunks[x / BB_CHUNK_SIZE])
+				memset(bb_count_chunks[x / BB_CHUNK_SIZE], 0, sizeof(uint64_t) * BB_CHUNK_SIZE);
+	}
+	writer_fork_init();
+	// The parent keeps its ring. The child gets its own next to it.
+	if (options.live[0])
+	{
+		live_ring_unmap(&live_ring);
+		snprintf(name, 256, "%s.%d", options.live, dr_get_process_id());
+		if (live_ring_create(name, (uint64_t)options.live_size << 20, options.live_drop ? LIVE_POLICY_DROP : LIVE_POLICY_BLOCK, &live_ring))
+			PEEKABOO_DIE("Peekaboo: Cannot create the live ring %s\n", name);
+		live_replay_bytes_map();
+		printf("Peekaboo: The child publishes its trace to %s. ", name);
+	}
+	// Client threads do not survive a fork. The sampler thread may have held
+	// the lock, and the parent keeps waiting for it with its own event.
+	if (is_sampling())
+	{
+		dr_mutex_destroy(sampler.lock);
+		sampler.lock = dr_mutex_create();
+		// The other threads did not come along
+		sampler.threads = NULL;
+		if (has_sampler_thread())
+		{
+			dr_event_destroy(sampler.exited_event);
+			start_sampler();
+		}
+	}
 
+	reset_buffers(drcontext);
+
+	// The thread may have forked inside -function
+	uint32_t function_depth = ((per_thread_t *)drmgr_get_tls_field(drcontext, tls_idx))->function_depth;
 	printf("Peekaboo: Application process forks. ");
 	init_thread_in_process(drcontext);
+	if (has_trace_cases())
+	{
+		per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+		data->function_depth = function_depth;
+		start_trace_case(data);
+	}
 }
 #endif
 
@@ -571,10 +2970,22 @@ static void event_thread_exit(void *drcontext)
 {
 	per_thread_t *data;
 	data = drmgr_get_tls_field(drcontext, tls_idx);
-	dr_mutex_lock(mutex);
-	num_refs += data->num_refs;
-	close_trace(data->peek_trace);
-	dr_mutex_unlock(mutex);
+	if (has_trace_cases()) stop_trace_case(data);
+	// exit and the like never return
+	if (data->syscall_pending) write_syscall(data);
+	// -flight_recorder has dumped and closed the trace already
+	if (data->peek_trace) close_thread_trace(data);
+	__atomic_fetch_add(&num_refs, data->num_refs, __ATOMIC_RELAXED);
+	flush_bytes_map(data);
+	if (options.live[0]) live_publish(LIVE_STREAM_EXIT, 0, 0, NULL, 0);
+	dr_thread_free(drcontext, data->bytes_map, MAX_BYTES_MAP_SIZE);
+	if (data->memdescs) dr_thread_free(drcontext, data->memdescs, MAX_MEMDESCS_SIZE);
+	if (options.compress)
+	{
+		dr_thread_free(drcontext, data->compress_work, sizeof(compress_work_t));
+		dr_thread_free(drcontext, data->compress_buf, COMPRESS_BOUND(COMPRESS_BLOCK_SIZE));
+	}
+	if (data->delta_buf) dr_thread_free(drcontext, data->delta_buf, DELTA_BUF_SIZE);
 	dr_thread_free(drcontext, data, sizeof(per_thread_t));
 }
 
@@ -587,33 +2998,356 @@ static void event_exit(void)
 	else
 		printf("Peekaboo: Parent process (PID:%d) exits. Total number of instructions seen: " SZFMT "\n", pid, num_refs);
 
+	uint32_t x;
+	writer_stats_t stats;
+	if (has_sampler_thread()) stop_sampler();
+	writer_get_stats(&stats);
+	if (stats.num_stalls)
+		printf("Peekaboo: The application waited %"PRIu64" times for the writer, %"PRIu64" ms in total. Try more -write_buffers.\n", stats.num_stalls, stats.stall_us / 1000);
+	if (options.live[0])
+	{
+		if (live_ring.hdr->dropped)
+			printf("Peekaboo: %"PRIu64" bytes did not fit into the live ring and were dropped. Try a larger -live_size.\n", live_ring.hdr->dropped);
+		live_ring_close(&live_ring);
+		live_ring_unmap(&live_ring);
+		dr_mutex_destroy(live_mutex);
+	}
+
 	if (!drmgr_unregister_tls_field(tls_idx) ||
 	    !drmgr_unregister_thread_init_event(event_thread_init) ||
 	    !drmgr_unregister_thread_exit_event(event_thread_exit) ||
-	    !drmgr_unregister_bb_insertion_event(per_insn_instrument) ||
+	    (has_trace_cases() ? drbbdup_exit() != DRBBDUP_SUCCESS : !drmgr_unregister_bb_insertion_event(per_insn_instrument)) ||
 	    drreg_exit() != DRREG_SUCCESS)
 	    DR_ASSERT(false);
+	if (has_trace_cases() && !dr_raw_tls_cfree(trace_case_offs, 1))
+		DR_ASSERT(false);
 
 #ifdef UNIX
 	if (!dr_unregister_fork_init_event(fork_init))
 		DR_ASSERT(false);
 #endif
+	if (options.syscalls)
+	{
+		if (!dr_unregister_filter_syscall_event(event_filter_syscall) ||
+		    !drmgr_unregister_pre_syscall_event(event_pre_syscall) ||
+		    !drmgr_unregister_post_syscall_event(event_post_syscall))
+			DR_ASSERT(false);
+	}
+	if (options.toggle)
+	{
+		if (!dr_unregister_nudge_event(event_toggle_nudge, client_id) ||
+		    (options.toggle_signal && !drmgr_unregister_signal_event(event_toggle_signal)))
+			DR_ASSERT(false);
+	}
+	if (options.flight_recorder)
+	{
+		if (!drmgr_unregister_thread_exit_event(event_flight_thread_exit) ||
+		    !drmgr_unregister_signal_event(event_signal) ||
+		    !dr_unregister_nudge_event(event_nudge, client_id))
+			DR_ASSERT(false);
+	}
 
+	if (!drmgr_unregister_module_load_event(event_module_load) ||
+	    !drmgr_unregister_module_unload_event(event_module_unload))
+		DR_ASSERT(false);
+	fclose(modules_file);
+
+	dr_rwlock_destroy(module_ranges_lock);
+	if (is_sampling()) dr_mutex_destroy(sampler.lock);
 	dr_mutex_destroy(mutex);
 	drmgr_exit();
 	drutil_exit();
 
-	drx_buf_free(regfile_buf);
-	drx_buf_free(memrefs_buf);
-	drx_buf_free(memfile_buf);
-	drx_buf_free(insn_ref_buf);
+	free_buffers();
+	writer_exit();
+	sort_bytes_map();
+	fclose(bytes_map_file);
+	if (options.memdesc) fclose(memdesc_file);
+	for (x=0; x<BYTES_MAP_SHARDS; x++)
+		hashtable_delete(&bytes_map_pcs[x]);
+
+	if (options.function[0])
+	{
+		drsym_exit();
+		drwrap_exit();
+	}
+
+	if (options.bb_trace)
+	{
+		if (!drmgr_unregister_kernel_xfer_event(event_kernel_xfer))
+			DR_ASSERT(false);
+		fclose(bb_table_file);
+	}
+	if (options.bb_counts)
+	{
+		write_bb_counts();
+		fclose(bb_counts_file);
+		for (x=0; x<num_bbs; x+=BB_CHUNK_SIZE)
+			if (bb_count_chunks[x / BB_CHUNK_SIZE])
+				dr_global_free(bb_count_chunks[x / BB_CHUNK_SIZE], sizeof(uint64_t) * BB_CHUNK_SIZE);
+	}
+	if (options.bb_trace || options.bb_counts)
+	{
+		hashtable_delete(&bb_ids);
+		for (x=0; x<num_bbs; x+=BB_CHUNK_SIZE)
+			if (bb_chunks[x / BB_CHUNK_SIZE])
+				dr_global_free(bb_chunks[x / BB_CHUNK_SIZE], sizeof(bb_entry_t) * BB_CHUNK_SIZE);
+	}
+	if (options.branch_trace)
+	{
+		if (!drmgr_unregister_kernel_xfer_event(event_branch_kernel_xfer))
+			DR_ASSERT(false);
+		fclose(branch_table_file);
+		hashtable_delete(&branch_pcs);
+	}
 
 	drx_exit();
 }
 
 
+#ifdef HAS_REGFILE_LAYOUT
+/* -regs: a comma separated list of gpr, simd and fxsave, or all. GPRs are
+ * always stored, rip and the syscall arguments come from them.
+ */
+static void parse_regs(const char *list)
+{
+	char names[64];
+	char *name = names;
+
+	strncpy(names, list, sizeof(names) - 1);
+	names[sizeof(names) - 1] = 0;
+	storage_option.has_simd = 0;
+	storage_option.has_fxsave = 0;
+	while (name)
+	{
+		char *next = strchr(name, ',');
+		if (next) *next++ = 0;
+		if (strcmp(name, "simd") == 0)
+			storage_option.has_simd = 1;
+		else if (strcmp(name, "fxsave") == 0)
+			storage_option.has_fxsave = 1;
+		else if (strcmp(name, "all") == 0)
+			storage_option.has_simd = storage_option.has_fxsave = 1;
+		else if (strcmp(name, "gpr") != 0)
+			PEEKABOO_DIE("Peekaboo: Unknown register class %s. -regs takes gpr, simd, fxsave or all.\n", name);
+		name = next;
+	}
+}
+#endif
+
+static void parse_options(int argc, const char *argv[])
+{
+	int x;
+	for (x=1; x<argc; x++)
+	{
+		if (strcmp(argv[x], "-regderef") == 0)
+		{
+			#ifndef HAS_REGDEREF
+			PEEKABOO_DIE("Peekaboo: -regderef is only supported on %s.\n", "AMD64");
+			#endif
+			options.regderef = true;
+		}
+		else if (strcmp(argv[x], "-regs") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -regs needs a list of register classes, e.g. gpr,simd.\n");
+			#ifdef HAS_REGFILE_LAYOUT
+			parse_regs(argv[x]);
+			#else
+			PEEKABOO_DIE("Peekaboo: -regs is only supported on %s.\n", "AMD64");
+			#endif
+		}
+		else if (strcmp(argv[x], "-keyframe") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -keyframe needs the number of instructions between keyframes.\n");
+			options.keyframe = strtoul(argv[x], NULL, 10);
+		}
+		else if (strcmp(argv[x], "-bb_trace") == 0)
+		{
+			options.bb_trace = true;
+		}
+		else if (strcmp(argv[x], "-branch_trace") == 0)
+		{
+			#ifndef HAS_BRANCH_TRACE
+			PEEKABOO_DIE("Peekaboo: -branch_trace is only supported on %s.\n", "AMD64");
+			#endif
+			options.branch_trace = true;
+		}
+		else if (strcmp(argv[x], "-memaddr") == 0)
+		{
+			options.memaddr = true;
+		}
+		else if (strcmp(argv[x], "-memval") == 0)
+		{
+			#ifndef HAS_MEMVAL
+			PEEKABOO_DIE("Peekaboo: -memval is only supported on %s.\n", "AMD64");
+			#endif
+			options.memval = true;
+		}
+		else if (strcmp(argv[x], "-write_buffers") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -write_buffers needs the number of buffers.\n");
+			options.write_buffers = strtoul(argv[x], NULL, 10);
+		}
+		else if (strcmp(argv[x], "-module") == 0 || strcmp(argv[x], "-exclude_module") == 0)
+		{
+			bool exclude = argv[x][1] == 'e';
+			uint32_t *num_names = exclude ? &options.num_exclude_modules : &options.num_modules;
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: %s needs a module name.\n", argv[x-1]);
+			if (*num_names == MAX_FILTERS) PEEKABOO_DIE("Peekaboo: At most %d modules can be given.\n", MAX_FILTERS);
+			strncpy(exclude ? options.exclude_modules[*num_names] : options.modules[*num_names], argv[x], MAX_FILTER_NAME - 1);
+			(*num_names)++;
+		}
+		else if (strcmp(argv[x], "-range") == 0)
+		{
+			char *end;
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -range needs <start>-<end>.\n");
+			if (options.num_ranges == MAX_FILTERS) PEEKABOO_DIE("Peekaboo: At most %d ranges can be given.\n", MAX_FILTERS);
+			options.ranges[options.num_ranges].start = (app_pc)strtoull(argv[x], &end, 16);
+			if (*end != '-') PEEKABOO_DIE("Peekaboo: Bad range %s. Expected <start>-<end> in hex.\n", argv[x]);
+			options.ranges[options.num_ranges].end = (app_pc)strtoull(end + 1, NULL, 16);
+			options.num_ranges++;
+		}
+		else if (strcmp(argv[x], "-sample_window") == 0 || strcmp(argv[x], "-sample_period") == 0 || strcmp(argv[x], "-sample_ms") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: %s needs a number.\n", argv[x-1]);
+			uint64_t value = strtoull(argv[x], NULL, 10);
+			if (strcmp(argv[x-1], "-sample_window") == 0) options.sample_window = value;
+			else if (strcmp(argv[x-1], "-sample_period") == 0) options.sample_period = value;
+			else options.sample_ms = value;
+		}
+		else if (strcmp(argv[x], "-toggle") == 0)
+		{
+			options.toggle = true;
+		}
+		else if (strcmp(argv[x], "-toggle_signal") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -toggle_signal needs a signal number.\n");
+			options.toggle_signal = atoi(argv[x]);
+			if (options.toggle_signal <= 0 || options.toggle_signal == SIGKILL || options.toggle_signal == SIGSTOP)
+				PEEKABOO_DIE("Peekaboo: -toggle_signal cannot catch signal %s.\n", argv[x]);
+		}
+		else if (strcmp(argv[x], "-max_insns") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -max_insns needs the number of instructions to trace.\n");
+			options.max_insns = strtoull(argv[x], NULL, 10);
+			if (!options.max_insns) PEEKABOO_DIE("Peekaboo: -max_insns needs at least one instruction.\n");
+		}
+		else if (strcmp(argv[x], "-compress") == 0)
+		{
+			options.compress = true;
+		}
+		else if (strcmp(argv[x], "-flight_recorder") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -flight_recorder needs the number of instructions to keep.\n");
+			options.flight_recorder = strtoul(argv[x], NULL, 10);
+			if (!options.flight_recorder) PEEKABOO_DIE("Peekaboo: -flight_recorder needs at least one instruction.\n");
+		}
+		else if (strcmp(argv[x], "-syscalls") == 0)
+		{
+			options.syscalls = true;
+		}
+		else if (strcmp(argv[x], "-function") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -function needs a function name.\n");
+			strncpy(options.function, argv[x], MAX_FILTER_NAME - 1);
+		}
+		else if (strcmp(argv[x], "-live") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -live needs the path of the ring, e.g. /dev/shm/peekaboo.\n");
+			strncpy(options.live, argv[x], MAX_FILTER_NAME - 1);
+		}
+		else if (strcmp(argv[x], "-live_size") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -live_size needs the size of the ring in MB.\n");
+			options.live_size = strtoul(argv[x], NULL, 10);
+			if (!options.live_size) PEEKABOO_DIE("Peekaboo: -live_size needs at least 1 MB.\n");
+		}
+		else if (strcmp(argv[x], "-live_drop") == 0)
+		{
+			options.live_drop = true;
+		}
+		else if (strcmp(argv[x], "-order") == 0)
+		{
+			options.order = true;
+		}
+		else if (strcmp(argv[x], "-bb_counts") == 0)
+		{
+			options.bb_counts = true;
+		}
+		else if (strcmp(argv[x], "-memdesc") == 0)
+		{
+			options.memdesc = true;
+		}
+		else if (strcmp(argv[x], "-module_pcs") == 0)
+		{
+			#ifndef X64
+			PEEKABOO_DIE("Peekaboo: -module_pcs is only supported on %s.\n", "AMD64 and AArch64");
+			#endif
+			options.module_pcs = true;
+		}
+		else if (strcmp(argv[x], "-part_size") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -part_size needs the size of a part in MB.\n");
+			options.part_size = strtoull(argv[x], NULL, 10) << 20;
+			if (!options.part_size) PEEKABOO_DIE("Peekaboo: -part_size needs at least 1 MB.\n");
+		}
+		else if (strcmp(argv[x], "-part_insns") == 0)
+		{
+			if (++x >= argc) PEEKABOO_DIE("Peekaboo: -part_insns needs the number of instructions in a part.\n");
+			options.part_insns = strtoull(argv[x], NULL, 10);
+			if (!options.part_insns) PEEKABOO_DIE("Peekaboo: -part_insns needs at least one instruction.\n");
+		}
+		else
+		{
+			PEEKABOO_DIE("Peekaboo: Unknown option %s\n", argv[x]);
+		}
+	}
+
+	#ifdef HAS_REGFILE_LAYOUT
+	amd64_regfile_layout(&storage_option, &regfile_layout);
+	regfile_size = regfile_layout.size;
+	#endif
+
+	if ((options.sample_period || options.sample_ms) && !options.sample_window)
+		PEEKABOO_DIE("Peekaboo: -sample_period and -sample_ms need -sample_window.\n");
+	if (options.sample_window && !options.sample_ms && options.sample_period <= options.sample_window)
+		PEEKABOO_DIE("Peekaboo: -sample_window needs a longer -sample_period or -sample_ms.\n");
+	if (options.toggle_signal && !options.toggle)
+		PEEKABOO_DIE("Peekaboo: -toggle_signal needs -toggle.\n");
+	if (options.flight_recorder && (options.bb_trace || options.memval || is_sampling()))
+		PEEKABOO_DIE("Peekaboo: -flight_recorder does not work with -bb_trace, -memval, -sample_window, -toggle or -max_insns.\n");
+	if (options.syscalls && (options.regderef || options.keyframe || options.bb_trace || options.memval || is_sampling() || options.flight_recorder))
+		PEEKABOO_DIE("Peekaboo: -syscalls records nothing but the system calls. Leave out the other recording options.\n");
+	if (options.branch_trace && (options.regderef || options.keyframe || options.bb_trace || options.memval || is_sampling() || options.flight_recorder || options.syscalls))
+		PEEKABOO_DIE("Peekaboo: -branch_trace records nothing but the control flow. Leave out the other recording options.\n");
+	// A block left out would lose its branches, and the rest of the control flow with them
+	if (options.memaddr && (options.regderef || options.keyframe || options.bb_trace || options.memval || is_sampling() || options.flight_recorder || options.syscalls || options.branch_trace))
+		PEEKABOO_DIE("Peekaboo: -memaddr records nothing but the memory accesses. Leave out the other recording options.\n");
+	if ((options.live_drop || options.live_size != 64) && !options.live[0])
+		PEEKABOO_DIE("Peekaboo: -live_size and -live_drop need -live.\n");
+	// The consumer reads plain per-instruction records
+	if (options.live[0] && (options.regderef || options.keyframe || options.bb_trace || options.memval || options.flight_recorder || options.syscalls || options.branch_trace || options.memaddr || options.compress))
+		PEEKABOO_DIE("Peekaboo: -live does not work with -regderef, -keyframe, -bb_trace, -memval, -flight_recorder, -syscalls, -branch_trace, -memaddr or -compress.\n");
+	// The stamps count instructions in insn.trace
+	if (options.order && (options.bb_trace || options.branch_trace || options.memaddr || options.syscalls || options.flight_recorder || options.live[0]))
+		PEEKABOO_DIE("Peekaboo: -order does not work with -bb_trace, -branch_trace, -memaddr, -syscalls, -flight_recorder or -live.\n");
+	if ((options.part_size || options.part_insns) && (options.live[0] || options.flight_recorder))
+		PEEKABOO_DIE("Peekaboo: -part_size and -part_insns do not work with -live or -flight_recorder.\n");
+	if (options.bb_counts && (options.regderef || options.keyframe || options.bb_trace || options.memval || is_sampling() || options.flight_recorder || options.syscalls || options.branch_trace || options.memaddr || options.live[0] || options.order))
+		PEEKABOO_DIE("Peekaboo: -bb_counts records nothing but the block counts. Leave out the other recording options.\n");
+	// Block and branch tables and memaddr pc deltas hold absolute pcs
+	if (options.module_pcs && (options.bb_trace || options.branch_trace || options.memaddr))
+		PEEKABOO_DIE("Peekaboo: -module_pcs does not work with -bb_trace, -branch_trace or -memaddr.\n");
+	// Wide -memval values are found by the size in each memfile_t
+	if (options.memdesc && (options.memval || options.flight_recorder || options.live[0] || options.syscalls || options.branch_trace || options.memaddr || options.bb_counts))
+		PEEKABOO_DIE("Peekaboo: -memdesc does not work with -memval, -flight_recorder, -live, -syscalls, -branch_trace, -memaddr or -bb_counts.\n");
+	if (options.branch_trace && is_filtering())
+		PEEKABOO_DIE("Peekaboo: -branch_trace does not work with -module, -exclude_module, -range or -function.\n");
+}
+
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 {
+	parse_options(argc, argv);
 
     drreg_options_t ops = {sizeof(ops), 4, false};
 	dr_set_client_name("peekaboo DynamoRIO tracer", "https://github.com/melynx/peekaboo");
@@ -623,8 +3357,6 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 	drutil_init();
 	drx_init();
 
-	// drmgr_register_signal_event(event_signal);
-
 	dr_register_exit_event(event_exit);
 #ifdef UNIX
 	// KH: dr_register_fork_init_event only support UNIX
@@ -632,18 +3364,104 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 #endif
 	drmgr_register_thread_init_event(event_thread_init);
 	drmgr_register_thread_exit_event(event_thread_exit);
-	drmgr_register_bb_instrumentation_event(save_bb_rawbytes, per_insn_instrument, NULL);
+	if (has_trace_cases())
+	{
+		if (!dr_raw_tls_calloc(&trace_case_seg, &trace_case_offs, 1, 0))
+			PEEKABOO_DIE("Peekaboo: Unable to allocate the trace case slot.\n");
+		drbbdup_options_t dup_ops = {
+			.struct_size = sizeof(dup_ops),
+			.set_up_bb_dups = set_up_bb_dups,
+			.analyze_orig = analyze_orig,
+			.analyze_case_ex = analyze_case,
+			.destroy_case_analysis = destroy_case,
+			.instrument_instr_ex = instrument_case,
+			.runtime_case_opnd = opnd_create_far_base_disp(trace_case_seg, DR_REG_NULL, DR_REG_NULL, 0, trace_case_offs, OPSZ_PTR),
+			.atomic_load_encoding = true,
+			.non_default_case_limit = 1,
+			.max_case_encoding = TRACE_CASE,
+		};
+		if (drbbdup_init(&dup_ops) != DRBBDUP_SUCCESS)
+			PEEKABOO_DIE("Peekaboo: Unable to initialise drbbdup.\n");
+	}
+	else
+		drmgr_register_bb_instrumentation_event(save_bb_rawbytes, per_insn_instrument, NULL);
+	int x;
+	for (x=0; x<BYTES_MAP_SHARDS; x++)
+		hashtable_init_ex(&bytes_map_pcs[x], 10, HASH_INTPTR, false, true, NULL, NULL, NULL);
+	if (options.function[0])
+	{
+		drwrap_init();
+		drsym_init(0);
+	}
+	// Every module goes into modules, filtered or not
+	drmgr_register_module_load_event(event_module_load);
+	drmgr_register_module_unload_event(event_module_unload);
+	if (options.bb_trace || options.bb_counts)
+		hashtable_init(&bb_ids, 16, HASH_INTPTR, false);
+	if (options.bb_trace)
+		drmgr_register_kernel_xfer_event(event_kernel_xfer);
+	if (options.branch_trace)
+	{
+		hashtable_init(&branch_pcs, 16, HASH_INTPTR, false);
+		drmgr_register_kernel_xfer_event(event_branch_kernel_xfer);
+	}
+
+	if (options.syscalls)
+	{
+		dr_register_filter_syscall_event(event_filter_syscall);
+		drmgr_register_pre_syscall_event(event_pre_syscall);
+		drmgr_register_post_syscall_event(event_post_syscall);
+	}
+	if (options.flight_recorder)
+	{
+		// Dump at exit before drx frees the rings
+		drmgr_priority_t exit_priority = {sizeof(exit_priority), "peekaboo.flight_recorder", NULL, NULL, DRMGR_PRIORITY_THREAD_EXIT_DRX_BUF - 1};
+		drmgr_register_thread_exit_event_ex(event_flight_thread_exit, &exit_priority);
+		drmgr_register_signal_event(event_signal);
+		dr_register_nudge_event(event_nudge, id);
+	}
+
+	if (options.toggle)
+	{
+		dr_register_nudge_event(event_toggle_nudge, id);
+		if (options.toggle_signal) drmgr_register_signal_event(event_toggle_signal);
+		sampler.tracing = false;
+	}
 
 	client_id = id;
 	mutex = dr_mutex_create();
+	module_ranges_lock = dr_rwlock_create();
+	init_trace_dir();
+	if (options.order)
+	{
+		// Forked children count on from the same clock
+		order_clock = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (order_clock == MAP_FAILED) PEEKABOO_DIE("Peekaboo: Unable to map the -order clock.\n");
+	}
+	if (options.bb_trace || options.bb_counts)
+	{
+		next_bb_id = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (next_bb_id == MAP_FAILED) PEEKABOO_DIE("Peekaboo: Unable to map the basic block ids.\n");
+	}
+	if (options.live[0])
+	{
+		live_mutex = dr_mutex_create();
+		if (live_ring_create(options.live, (uint64_t)options.live_size << 20, options.live_drop ? LIVE_POLICY_DROP : LIVE_POLICY_BLOCK, &live_ring))
+			PEEKABOO_DIE("Peekaboo: Cannot create the live ring %s\n", options.live);
+	}
 
 	tls_idx = drmgr_register_tls_field();
 	DR_ASSERT(tls_idx != -1);
 
-	insn_ref_buf = drx_buf_create_trace_buffer(INSN_REF_SIZE, flush_insnrefs);
-	memfile_buf = drx_buf_create_trace_buffer(MEMFILE_SIZE, flush_memfile);
-	memrefs_buf = drx_buf_create_trace_buffer(MEM_REFS_SIZE, flush_memrefs);
-	regfile_buf = drx_buf_create_trace_buffer(REG_BUF_SIZE, flush_regfile);
+	writer_init(options.write_buffers);
+	if (is_sampling())
+	{
+		sampler.window_ms = dr_get_milliseconds();
+		sampler.lock = dr_mutex_create();
+		if (has_sampler_thread()) start_sampler();
+	}
+
+	create_buffers();
 
 	//dr_log(NULL, DR_LOG_ALL, 11, "%s - Client 'peekaboo' initializing\n", arch);
 	printf("Peekaboo: %s - Client 'peekaboo' initializing\n", arch_str);
@@ -651,5 +3469,37 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 	printf("Peekaboo: Binary being traced: %s\n", dr_get_application_name());
 	printf("Peekaboo: Number of SIMD slots: %d\n", MCXT_NUM_SIMD_SLOTS);
 	printf("Peekaboo: libpeekaboo Version: %d\n", LIBPEEKABOO_VER);
+	#ifdef HAS_REGFILE_LAYOUT
+	printf("Peekaboo: Storing registers: GPRs%s%s\n", storage_option.has_simd ? " SIMD" : "", storage_option.has_fxsave ? " FXSAVE" : "");
+	#endif
+	if (options.regderef) printf("Peekaboo: Recording memory pointed by registers.\n");
+	if (options.keyframe) printf("Peekaboo: Delta encoding regfile with a keyframe every %u instructions.\n", options.keyframe);
+	if (options.bb_trace) printf("Peekaboo: Recording basic blocks instead of instructions.\n");
+	if (options.memval) printf("Peekaboo: Recording memory values.\n");
+	if (options.sample_window && options.sample_ms)
+		printf("Peekaboo: Tracing %"PRIu64" instructions every %u ms.\n", options.sample_window, options.sample_ms);
+	else if (options.sample_window)
+		printf("Peekaboo: Tracing %"PRIu64" instructions every %"PRIu64" instructions.\n", options.sample_window, options.sample_period);
+	if (options.toggle_signal)
+		printf("Peekaboo: Tracing is off. A nudge or signal %d turns it on and off.\n", options.toggle_signal);
+	else if (options.toggle)
+		printf("Peekaboo: Tracing is off. A nudge turns it on and off.\n");
+	if (options.max_insns)
+		printf("Peekaboo: Tracing stops after %"PRIu64" instructions.\n", options.max_insns);
+	if (options.live[0])
+		printf("Peekaboo: Publishing the trace to %s through a %u MB ring. %s\n", options.live, options.live_size, options.live_drop ? "What does not fit is dropped." : "The application waits for the consumer.");
+	if (options.part_size || options.part_insns)
+		printf("Peekaboo: Starting a new part of each stream every %"PRIu64" MB or %"PRIu64" instructions (0 for no limit).\n", options.part_size >> 20, options.part_insns);
+	if (options.module_pcs) printf("Peekaboo: Storing pcs inside modules as module id and offset.\n");
+	if (options.order) printf("Peekaboo: Stamping a global clock at system calls, locked instructions and flushes.\n");
+	if (options.compress) printf("Peekaboo: Compressing the trace in blocks of up to %d KB.\n", COMPRESS_BLOCK_SIZE >> 10);
+	if (options.syscalls) printf("Peekaboo: Recording system calls only.\n");
+	if (options.branch_trace) printf("Peekaboo: Recording the control flow only.\n");
+	if (options.memaddr) printf("Peekaboo: Recording memory addresses only.\n");
+	if (options.bb_counts) printf("Peekaboo: Counting basic block runs only.\n");
+	if (options.memdesc) printf("Peekaboo: Recording only the addresses of memory operands. The rest goes into insn.memdesc.\n");
+	if (options.flight_recorder) printf("Peekaboo: Keeping the last %u instructions of each thread. Nudge the process to dump them.\n", options.flight_recorder);
+	if (is_filtering()) printf("Peekaboo: Tracing only the selected modules, ranges or function.\n");
+	if (options.write_buffers) printf("Peekaboo: Writing the trace in the background with %u buffers of %d KB.\n", options.write_buffers, WRITER_BLOCK_SIZE >> 10);
 
 }
@@ -0,0 +1,284 @@
+/* 
+ * Copyright 2019 Chua Zheng Leong
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "dr_api.h"
+#include "writer.h"
+
+typedef struct writer_block {
+	FILE *file;
+	size_t size;
+	bool close;		/* Close file instead of writing, see writer_close() */
+	uint8_t *data;
+	struct writer_block *next;
+} writer_block_t;
+
+static struct {
+	uint32_t num_blocks;
+	writer_block_t *blocks;
+	uint8_t *pool;
+
+	void *lock;		/* Protects everything below */
+	writer_block_t *free_list;
+	writer_block_t *queue_head;
+	writer_block_t *queue_tail;
+	uint32_t num_busy;	/* Blocks taken from the free list and not written yet */
+	bool exiting;
+	writer_stats_t stats;
+
+	uint32_t num_free_waiters;
+	uint32_t num_drain_waiters;
+
+	void *work_event;	/* Something was queued, or exiting */
+	void *free_event;	/* A block went back to the free list */
+	void *drained_event;	/* num_busy dropped to 0 */
+	void *exited_event;	/* The writer thread is gone */
+} writer;
+
+/* Waits for event with the lock held, counting the waiters in num_waiters.
+ * The events are never reset, so a signal sent before the wait is not lost;
+ * the caller rechecks its condition in a loop. A signal wakes a single
+ * waiter, and several collapse into one, so a waiter that finds the
+ * condition still true for the others passes the signal on, see wake_next().
+ */
+static void wait_locked(void *event, uint32_t *num_waiters)
+{
+	(*num_waiters)++;
+	dr_mutex_unlock(writer.lock);
+	dr_event_wait(event);
+	dr_mutex_lock(writer.lock);
+	(*num_waiters)--;
+}
+
+static void wake_next(void *event, uint32_t num_waiters)
+{
+	if (num_waiters) dr_event_signal(event);
+}
+
+static void writer_main(void *arg)
+{
+	// The exit event waits for us, so don't get suspended at exit.
+	dr_client_thread_set_suspendable(false);
+
+	dr_mutex_lock(writer.lock);
+	while (true)
+	{
+		writer_block_t *block = writer.queue_head;
+		if (block == NULL)
+		{
+			if (writer.exiting) break;
+			// The writer thread is the only waiter
+			dr_mutex_unlock(writer.lock);
+			dr_event_wait(writer.work_event);
+			dr_mutex_lock(writer.lock);
+			continue;
+		}
+		writer.queue_head = block->next;
+		if (writer.queue_head == NULL) writer.queue_tail = NULL;
+		dr_mutex_unlock(writer.lock);
+
+		if (block->close)
+			fclose(block->file);
+		else
+			fwrite(block->data, 1, block->size, block->file);
+
+		dr_mutex_lock(writer.lock);
+		writer.stats.bytes += block->size;
+		block->next = writer.free_list;
+		writer.free_list = block;
+		writer.num_busy--;
+		wake_next(writer.free_event, writer.num_free_waiters);
+		if (writer.num_busy == 0) wake_next(writer.drained_event, writer.num_drain_waiters);
+	}
+	dr_mutex_unlock(writer.lock);
+	dr_event_signal(writer.exited_event);
+}
+
+static void start_writer(void)
+{
+	uint32_t x;
+	writer.lock = dr_mutex_create();
+	writer.work_event = dr_event_create();
+	writer.free_event = dr_event_create();
+	writer.drained_event = dr_event_create();
+	writer.exited_event = dr_event_create();
+
+	writer.free_list = NULL;
+	for (x=0; x<writer.num_blocks; x++)
+	{
+		writer.blocks[x].data = writer.pool + (size_t)x * WRITER_BLOCK_SIZE;
+		writer.blocks[x].next = writer.free_list;
+		writer.free_list = &writer.blocks[x];
+	}
+	writer.queue_head = writer.queue_tail = NULL;
+	writer.num_busy = 0;
+	writer.num_free_waiters = writer.num_drain_waiters = 0;
+	writer.exiting = false;
+	memset(&writer.stats, 0, sizeof(writer_stats_t));
+
+	if (!dr_create_client_thread(writer_main, NULL))
+		DR_ASSERT_MSG(false, "Peekaboo: Unable to create the writer thread.");
+}
+
+void writer_init(uint32_t num_blocks)
+{
+	writer.num_blocks = num_blocks;
+	if (num_blocks == 0) return;
+	writer.blocks = dr_global_alloc(sizeof(writer_block_t) * num_blocks);
+	writer.pool = dr_global_alloc((size_t)WRITER_BLOCK_SIZE * num_blocks);
+	start_writer();
+}
+
+void writer_fork_init(void)
+{
+	if (writer.num_blocks == 0) return;
+	// The parent writes what it queued. Its writer thread did not come
+	// along and may have held the lock, so start from scratch. No thread
+	// of the child waits on the events or holds the lock.
+	dr_event_destroy(writer.work_event);
+	dr_event_destroy(writer.free_event);
+	dr_event_destroy(writer.drained_event);
+	dr_event_destroy(writer.exited_event);
+	dr_mutex_destroy(writer.lock);
+	start_writer();
+}
+
+// Takes a block from the free list. Waits for the writer thread if there is none.
+static writer_block_t *get_free_block(void)
+{
+	writer_block_t *block;
+	dr_mutex_lock(writer.lock);
+	if (writer.free_list == NULL)
+	{
+		uint64 start = dr_get_microseconds();
+		while (writer.free_list == NULL) wait_locked(writer.free_event, &writer.num_free_waiters);
+		writer.stats.num_stalls++;
+		writer.stats.stall_us += dr_get_microseconds() - start;
+	}
+	block = writer.free_list;
+	writer.free_list = block->next;
+	writer.num_busy++;
+	if (writer.free_list) wake_next(writer.free_event, writer.num_free_waiters);
+	dr_mutex_unlock(writer.lock);
+	return block;
+}
+
+static void queue_block(writer_block_t *block)
+{
+	dr_mutex_lock(writer.lock);
+	if (writer.queue_tail) writer.queue_tail->next = block;
+	else writer.queue_head = block;
+	writer.queue_tail = block;
+	dr_mutex_unlock(writer.lock);
+	dr_event_signal(writer.work_event);
+}
+
+void writer_write(FILE *file, const void *data, size_t size)
+{
+	const uint8_t *ptr = data;
+
+	if (writer.num_blocks == 0)
+	{
+		fwrite(data, 1, size, file);
+		return;
+	}
+
+	// Small writes go into the last queued block if it is for the same file
+	dr_mutex_lock(writer.lock);
+	writer_block_t *tail = writer.queue_tail;
+	if (tail && tail->file == file && !tail->close && tail->size + size <= WRITER_BLOCK_SIZE)
+	{
+		memcpy(tail->data + tail->size, ptr, size);
+		tail->size += size;
+		size = 0;
+	}
+	dr_mutex_unlock(writer.lock);
+
+	while (size)
+	{
+		size_t chunk_size = size < WRITER_BLOCK_SIZE ? size : WRITER_BLOCK_SIZE;
+		writer_block_t *block = get_free_block();
+		memcpy(block->data, ptr, chunk_size);
+		block->file = file;
+		block->size = chunk_size;
+		block->close = false;
+		block->next = NULL;
+		queue_block(block);
+
+		ptr += chunk_size;
+		size -= chunk_size;
+	}
+}
+
+void writer_close(FILE *file)
+{
+	if (writer.num_blocks == 0)
+	{
+		fclose(file);
+		return;
+	}
+
+	// The blocks are written in order, so this comes after the writes to file
+	writer_block_t *block = get_free_block();
+	block->file = file;
+	block->size = 0;
+	block->close = true;
+	block->next = NULL;
+	queue_block(block);
+}
+
+void writer_drain(void)
+{
+	if (writer.num_blocks == 0) return;
+	dr_mutex_lock(writer.lock);
+	while (writer.num_busy) wait_locked(writer.drained_event, &writer.num_drain_waiters);
+	wake_next(writer.drained_event, writer.num_drain_waiters);
+	dr_mutex_unlock(writer.lock);
+}
+
+void writer_get_stats(writer_stats_t *stats)
+{
+	if (writer.num_blocks == 0)
+	{
+		memset(stats, 0, sizeof(writer_stats_t));
+		return;
+	}
+	dr_mutex_lock(writer.lock);
+	*stats = writer.stats;
+	dr_mutex_unlock(writer.lock);
+}
+
+void writer_exit(void)
+{
+	if (writer.num_blocks == 0) return;
+	writer_drain();
+
+	dr_mutex_lock(writer.lock);
+	writer.exiting = true;
+	dr_mutex_unlock(writer.lock);
+	dr_event_signal(writer.work_event);
+	dr_event_wait(writer.exited_event);
+
+	dr_event_destroy(writer.work_event);
+	dr_event_destroy(writer.free_event);
+	dr_event_destroy(writer.drained_event);
+	dr_event_destroy(writer.exited_event);
+	dr_mutex_destroy(writer.lock);
+	dr_global_free(writer.pool, (size_t)WRITER_BLOCK_SIZE * writer.num_blocks);
+	dr_global_free(writer.blocks, sizeof(writer_block_t) * writer.num_blocks);
+	writer.num_blocks = 0;
+}
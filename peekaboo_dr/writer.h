@@ -0,0 +1,48 @@
+/* 
+ * Copyright 2019 Chua Zheng Leong
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PEEKABOO_WRITER_H__
+#define __PEEKABOO_WRITER_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Background trace writer.
+ * writer_write() copies the data into one of the writer's blocks and returns.
+ * A DR client thread fwrites the blocks in the order they were queued. The
+ * application thread only waits (stalls) when all blocks are queued.
+ */
+#define WRITER_BLOCK_SIZE (1 << 20)
+
+typedef struct {
+	uint64_t num_stalls;	/* Times an application thread waited for a free block */
+	uint64_t stall_us;	/* Total time spent waiting */
+	uint64_t bytes;		/* Bytes written */
+} writer_stats_t;
+
+// Creates the writer thread with num_blocks blocks. With 0 blocks writer_write() is a plain fwrite().
+void writer_init(uint32_t num_blocks);
+// Forgets the parent's queue and restarts the writer thread in a forked child.
+void writer_fork_init(void);
+void writer_write(FILE *file, const void *data, size_t size);
+// Closes file once everything queued for it so far is written
+void writer_close(FILE *file);
+// Waits until everything queued so far is written. Call before closing a file.
+void writer_drain(void);
+void writer_get_stats(writer_stats_t *stats);
+void writer_exit(void);
+
+#endif
@@ -313,6 +313,48 @@ uint32_t is_buffer_matched(cache_linked_list_t const *raw_bytes_buffer,
 
 uint8_t digits;
 uint64_t read_bytes, write_bytes;
+
+// A module pc (traced with -module_pcs) is printed as module+offset
+void print_pc(const uint64_t pc, peekaboo_trace_t *peekaboo_trace_ptr)
+{
+    module_event_t *module = IS_MODULE_PC(pc) ? find_module(MODULE_PC_ID(pc), peekaboo_trace_ptr) : NULL;
+    if (module == NULL)
+    {
+        printf("0x%"PRIx64"", pc);
+        return;
+    }
+    const char *name = strrchr(module->path, '/');
+    printf("%s+0x%x", name ? name + 1 : module->path, MODULE_PC_OFFSET(pc));
+}
+
+void print_disasm(uint8_t *rawbytes, const size_t size, const uint64_t addr, peekaboo_trace_t *peekaboo_trace_ptr)
+{
+    // Print disassemble for instructions using libopcodes
+    #ifdef ASM
+    {
+        // Disasmble the instruction
+        int rvalue = disassemble_raw((enum ARCH)peekaboo_trace_ptr->internal->arch, false, rawbytes, size);
+        if(rvalue != 0) PEEKABOO_DIE("Libopcodes disasm error!\n");
+    }
+    #else 
+    #ifdef ASM_CAPSTONE
+    {
+        cs_insn *capstone_insn;
+        size_t count = cs_disasm(capstone_handler, rawbytes, size, IS_MODULE_PC(addr) ? MODULE_PC_OFFSET(addr) : addr, 0, &capstone_insn);
+        if (count == 0)
+        {
+            printf("Capstone Error");
+        }
+        else
+        {
+            printf("%s\t%s", capstone_insn[0].mnemonic, capstone_insn[0].op_str);
+            cs_free(capstone_insn, count);
+        }
+    }
+    #endif //ASM_CAPSTONE
+    #endif // ASM
+}
+
 void print_peekaboo_insn(peekaboo_insn_t *insn, 
                          peekaboo_trace_t *peekaboo_trace_ptr, 
                          const size_t insn_idx,
@@ -334,7 +376,7 @@ void print_peekaboo_insn(peekaboo_insn_t *insn,
     if (!print_syscall_info)
     {
         // Print instruction ea
-        printf("0x%"PRIx64"", insn->addr);
+        print_pc(insn->addr, peekaboo_trace_ptr);
             
         // Print Rawbytes
         printf(":\t ");
@@ -355,11 +397,10 @@ void print_peekaboo_insn(peekaboo_insn_t *insn,
     if (insn->size == 2 && insn->rawbytes[0]=='\x0f' && insn->rawbytes[1]=='\x05')
     {
         // Yes, syscall. Print it!
-        size_t trace_length = get_num_insn(peekaboo_trace_ptr);
         size_t next_insn_idx = insn_idx + 1;
         const regfile_amd64_t *regfile_ptr = (regfile_amd64_t *) insn->regfile;
         uint64_t rvalue;
-        if (next_insn_idx > trace_length)
+        if (!has_insn(peekaboo_trace_ptr, next_insn_idx))
             rvalue = 0;
         else
         {
@@ -377,30 +418,7 @@ void print_peekaboo_insn(peekaboo_insn_t *insn,
         return;
     }
 
-    // Print disassemble for instructions using libopcodes
-    #ifdef ASM
-    {
-        // Disasmble the instruction
-        int rvalue = disassemble_raw((enum ARCH)peekaboo_trace_ptr->internal->arch, false, insn->rawbytes, insn->size);
-        if(rvalue != 0) PEEKABOO_DIE("Libopcodes disasm error!\n");
-    }
-    #else 
-    #ifdef ASM_CAPSTONE
-    {
-        cs_insn *capstone_insn;
-        size_t count = cs_disasm(capstone_handler, insn->rawbytes, insn->size, insn->addr, 0, &capstone_insn);
-        if (count == 0)
-        {
-            printf("Capstone Error");
-        }
-        else
-        {
-            printf("%s\t%s", capstone_insn[0].mnemonic, capstone_insn[0].op_str);
-            cs_free(capstone_insn, count);
-        }
-    }
-    #endif //ASM_CAPSTONE
-    #endif // ASM
+    print_disasm(insn->rawbytes, insn->size, insn->addr, peekaboo_trace_ptr);
     printf("\n");
 
     // Print memory ops
@@ -414,7 +432,19 @@ void print_peekaboo_insn(peekaboo_insn_t *insn,
                 write_bytes+=insn->mem[mem_idx].size; 
             else
                 read_bytes+=insn->mem[mem_idx].size; 
-            printf("%d bytes @ 0x%lx\n", insn->mem[mem_idx].size, insn->mem[mem_idx].addr);
+            printf("%d bytes @ 0x%lx", insn->mem[mem_idx].size, insn->mem[mem_idx].addr);
+
+            // Print the value if the trace has it. Wide values byte by byte, lowest address first.
+            uint8_t *value = get_mem_value(insn, mem_idx, peekaboo_trace_ptr);
+            if (value != NULL && insn->mem[mem_idx].size <= 8)
+                printf(" = 0x%lx", insn->mem[mem_idx].value);
+            else if (value != NULL)
+            {
+                printf(" = ");
+                for (uint32_t byte_idx = 0; byte_idx < insn->mem[mem_idx].size; byte_idx++)
+                    printf("%02x", value[byte_idx]);
+            }
+            printf("\n");
 
             // Memory trace broken checker
             if (!(insn->mem[mem_idx].status==0 || insn->mem[mem_idx].status==1)) 
@@ -422,8 +452,12 @@ void print_peekaboo_insn(peekaboo_insn_t *insn,
         }
     }
 
-    // Print GPR
-    if (print_register) regfile_pp(insn);
+    // Print GPR, and what they point to if the trace has regderef
+    if (print_register)
+    {
+        regfile_pp(insn);
+        regderef_pp(insn);
+    }
 }
 
 uint64_t print_back(const int64_t unprinted_size,
@@ -631,9 +665,54 @@ void print_usage(const char* program_name)
     fprintf(stderr, "  -e <instr id>    \tPrint trace till the given id.\n");
     fprintf(stderr, "  -a <addr>[,size] \tSearch for all accesses to given memory address, for accesses to buffer when size is given.\n");
     fprintf(stderr, "  -p <pattern file>\tSearch for instruction patterns in trace. See pattern.txt for samples. Not compatible with -c.\n");
+    fprintf(stderr, "  -l               \tThe path is a live trace the tracer writes with -live. Follows it while the program runs.\n");
+    fprintf(stderr, "  -t <tid>         \tWith -l, follow this thread instead of the first one.\n");
+    fprintf(stderr, "  -o               \tThe path is a trace directory traced with -order. Prints the instructions of all its threads in about the order they ran.\n");
+    fprintf(stderr, "  -b <num blocks>  \tWith a trace traced with -bb_counts, only print this many of the hottest blocks.\n");
     fprintf(stderr, "  -h               \tPrint this help.\n");
 }
 
+// Block profile (-bb_counts): the hottest blocks with their instructions
+void print_hot_blocks(peekaboo_trace_t *peekaboo_trace_ptr, size_t num_blocks)
+{
+    uint64_t total_insns = 0;
+    for (size_t bb_idx = 0; bb_idx < get_num_bb_counts(peekaboo_trace_ptr); bb_idx++)
+        total_insns += get_bb_count(bb_idx, peekaboo_trace_ptr)->count * get_bb_count(bb_idx, peekaboo_trace_ptr)->num_insns;
+    if (num_blocks == 0 || num_blocks > get_num_bb_counts(peekaboo_trace_ptr)) num_blocks = get_num_bb_counts(peekaboo_trace_ptr);
+    printf("%lu basic blocks ran %"PRIu64" instructions. The %lu hottest:\n", get_num_bb_counts(peekaboo_trace_ptr), total_insns, num_blocks);
+
+    for (size_t bb_idx = 0; bb_idx < num_blocks; bb_idx++)
+    {
+        bb_count_t *bb = get_bb_count(bb_idx, peekaboo_trace_ptr);
+        uint64_t bb_insns = bb->count * bb->num_insns;
+        printf("[%lu] ", bb_idx + 1);
+        print_pc(bb->pc, peekaboo_trace_ptr);
+        printf(": %"PRIu64" runs x %u instructions = %"PRIu64" (%.2f%%)\n", bb->count, bb->num_insns, bb_insns, total_insns ? 100.0 * bb_insns / total_insns : 0);
+
+        // Walk the block through insn.bytemap
+        uint64_t pc = bb->pc;
+        for (uint32_t insn_idx = 0; insn_idx < bb->num_insns; insn_idx++)
+        {
+            bytes_map_t *bytes_map = find_bytes_map(pc, peekaboo_trace_ptr);
+            if (bytes_map == NULL)
+            {
+                printf("\t(not in insn.bytemap)\n");
+                break;
+            }
+            printf("\t");
+            print_pc(pc, peekaboo_trace_ptr);
+            printf(":\t ");
+            for (uint8_t rawbyte_idx = 0; rawbyte_idx < bytes_map->size; rawbyte_idx++)
+                printf("%02"PRIx8" ", bytes_map->rawbytes[rawbyte_idx]);
+            for (uint8_t idx = bytes_map->size; idx < 8; idx++) printf("   ");
+            printf("\t");
+            print_disasm(bytes_map->rawbytes, bytes_map->size, pc, peekaboo_trace_ptr);
+            printf("\n");
+            pc += bytes_map->size;
+        }
+    }
+}
+
 void append2macthed_list(matched_list_node_t **list_header, const uint64_t addr)
 {
 
@@ -688,10 +767,14 @@ int main(int argc, char *argv[])
     bool target_addr_size_hex = false;      // Does user type-in buffer size in hex? For memory access search mode
     char *comma_pos, *size_ptr;             // Temp pointers for arg parsing. For memory access search mode
     uint64_t printed_instr_num = 0;         // Counter for how many instr have been printed for non-pattern-search modes
+    bool is_live = false;                   // The path is a live trace ring
+    uint32_t live_tid = 0;                  // Thread to follow in a live trace. 0 for the first one.
+    bool is_merged = false;                 // The path is a trace directory to print in global order
+    size_t num_hot_blocks = 0;              // Hottest blocks to print of a block profile. 0 for all.
 
     // Argument parsing
     int opt;
-    while ((opt = getopt(argc, argv, "hrms:p:e:a:y")) != -1) {
+    while ((opt = getopt(argc, argv, "hrms:p:e:a:ylt:ob:")) != -1) {
         switch (opt) {
         case 'r':
             print_register = true;
@@ -735,6 +818,18 @@ int main(int argc, char *argv[])
         case 'y':
             print_syscall_only = true;
             break;
+        case 'l':
+            is_live = true;
+            break;
+        case 't':
+            live_tid = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            is_merged = true;
+            break;
+        case 'b':
+            num_hot_blocks = strtoul(optarg, NULL, 10);
+            break;
         case 'h':
             print_usage(argv[0]);
             exit(EXIT_FAILURE);
@@ -770,13 +865,43 @@ int main(int argc, char *argv[])
 
     // Load trace
     char *trace_path = argv[argc - 1];
+
+    // Global order: all threads of the trace directory, one instruction at a time
+    if (is_merged)
+    {
+        peekaboo_merge_t *merge = open_merge(trace_path);
+        merged_insn_t *merged;
+        digits = 10;
+        while ((merged = next_merged_insn(merge)) != NULL)
+        {
+            peekaboo_insn_t *insn = get_peekaboo_insn(merged->id, merged->trace);
+            printf("%u:", merged->tid);
+            print_peekaboo_insn(insn, merged->trace, merged->id, false, false);
+            free_peekaboo_insn(insn);
+            printed_instr_num++;
+        }
+        printf("End of printing. Totol printed instructions: %lu.\n", printed_instr_num);
+#ifdef ASM_CAPSTONE
+        cs_close(&capstone_handler);
+#endif
+        close_merge(merge);
+        return 0;
+    }
+
     peekaboo_trace_t *peekaboo_trace_ptr = malloc(sizeof(peekaboo_trace_t));
     if (peekaboo_trace_ptr == NULL) PEEKABOO_DIE("Fail to malloc trace structure.");
-    load_trace(trace_path, peekaboo_trace_ptr);
+    if (is_live)
+    {
+        // A live trace has no length yet, and only goes forward
+        if (loop_starts < 0) PEEKABOO_DIE("A live trace cannot be printed in reversed order.\n");
+        load_live_trace(trace_path, live_tid, peekaboo_trace_ptr);
+    }
+    else
+        load_trace(trace_path, peekaboo_trace_ptr);
 
     // Get and print the length of the trace
     const size_t num_insn = get_num_insn(peekaboo_trace_ptr);
-    digits = (uint8_t) log10(num_insn) + 2;
+    digits = is_live ? 10 : (uint8_t) log10(num_insn) + 2;
 
     // Load and Print search pattern
     cache_linked_list_t pattern;
@@ -794,12 +919,59 @@ int main(int argc, char *argv[])
     uint64_t num_found_block = 0;
     matched_list_node_t *matched_list_header = NULL;
 
+    // strace mode with a syscalls stream: no need to look at the instructions
+    if (print_syscall_only && get_num_syscalls(peekaboo_trace_ptr))
+    {
+        for (size_t syscall_idx = 0; syscall_idx < get_num_syscalls(peekaboo_trace_ptr); syscall_idx++)
+        {
+            syscall_t *syscall = get_syscall(syscall_idx, peekaboo_trace_ptr);
+            printf("[%"PRIu64"] ", syscall->insn_idx);
+            if (0!=amd64_syscall_args_pp(syscall->num, syscall->args, syscall->ret, true))
+                printf("Syscall analysis failed");
+            if (!syscall->returned) printf(" (did not return)");
+            printf("\n");
+        }
+#ifdef ASM_CAPSTONE
+        cs_close(&capstone_handler);
+#endif
+        free_peekaboo_trace(peekaboo_trace_ptr);
+        return 0;
+    }
+
+    // Block profile: there are no instructions, only block counts
+    if (get_num_bb_counts(peekaboo_trace_ptr))
+    {
+        print_hot_blocks(peekaboo_trace_ptr, num_hot_blocks);
+#ifdef ASM_CAPSTONE
+        cs_close(&capstone_handler);
+#endif
+        free_peekaboo_trace(peekaboo_trace_ptr);
+        return 0;
+    }
+
+    // Memory address trace: there are no instructions, only accesses
+    if (peekaboo_trace_ptr->memaddrs)
+    {
+        size_t access_idx = 0;
+        mem_access_t *access;
+        while ((access = next_mem_access(peekaboo_trace_ptr)) != NULL)
+            printf("[%lu] 0x%"PRIx64" %s 0x%"PRIx64" %u\n", ++access_idx, access->pc, access->write ? "W" : "R", access->addr, access->size);
+#ifdef ASM_CAPSTONE
+        cs_close(&capstone_handler);
+#endif
+        free_peekaboo_trace(peekaboo_trace_ptr);
+        return 0;
+    }
+
     // We print instructions sequentially. 
     // Please note the first instruction's index is 1, instead of 0.
-    const size_t _loop_ends = (loop_ends) ? loop_ends : num_insn;
+    const size_t _loop_ends = (loop_ends) ? loop_ends : (is_live ? (size_t) -1 : num_insn);
     const size_t _loop_starts = (loop_starts < 0) ? (_loop_ends + loop_starts + 1) : loop_starts;
-    printf("Range: from %lu to %lu (%lu in total)\n", _loop_starts, _loop_ends, num_insn);
-    for (size_t insn_idx=_loop_starts; insn_idx<=_loop_ends; insn_idx++)
+    if (is_live)
+        printf("Range: from %lu, following the live trace\n", _loop_starts);
+    else
+        printf("Range: from %lu to %lu (%lu in total)\n", _loop_starts, _loop_ends, num_insn);
+    for (size_t insn_idx=_loop_starts; insn_idx<=_loop_ends && has_insn(peekaboo_trace_ptr, insn_idx); insn_idx++)
     {
         // Get instruction ptr by instruction index
         peekaboo_insn_t *insn = get_peekaboo_insn(insn_idx, peekaboo_trace_ptr);
@@ -847,6 +1019,14 @@ int main(int argc, char *argv[])
             printed_instr_num++;
         }
         
+        // Sampled trace: mark where a window starts
+        if (get_num_segments(peekaboo_trace_ptr))
+        {
+            size_t segment_idx = find_segment(insn_idx, peekaboo_trace_ptr);
+            segment_t *segment = get_segment(segment_idx, peekaboo_trace_ptr);
+            if (segment->first_insn + 1 == insn_idx)
+                printf("---- Window %lu: %"PRIu64" instructions run before it ----\n", segment_idx, segment->global_insn);
+        }
 
         // Body of print
         print_peekaboo_insn(insn, peekaboo_trace_ptr, insn_idx, false, false);